@@ -1,14 +1,18 @@
 #include "8080e.h"
+#include "coverage.h"
+#include "hash.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
 
-#define MEM_SIZE (0x4000)
-#define MIRROR_SIZE (0x4000)
 #define STACK_BOTTOM (0x2400)
-#define ROM_SIZE (0x2000)
+/* A zero page past the end, for operands fetched at the last addresses */
+#define ROM_MAP_SIZE (ROM_SIZE + 0x1000)
 
 #define FS  ((unsigned char)0x80)
 #define FZ  ((unsigned char)0x40)
@@ -21,7 +25,24 @@
 
 #define CARRY ((state->f & FC) != 0)
 
-#define MEM_LOC(loc) state->mem[((loc) >= 0x2000) ? ((loc) & 0x1FFF)|0x2000 : (loc)]
+/*
+ * Returned as the cycles of an instruction that stopped the machine, so
+ * the execute loops end without checking for errors on every step.
+ */
+#define FAULT_CYCLES (1 << 30)
+
+#define MEM_LOC(loc) (*(((loc) >= RAM_ADDRESS) ? &state->ram[(loc) & (RAM_SIZE - 1)] : &state->program[(loc)]))
+
+/*
+ * Every store to memory goes through STORE so the state hash can follow
+ * it. A store into the ROM is dropped and stops the machine with
+ * I8080_ROM_WRITE at the end of the instruction.
+ */
+#ifdef ENABLE_STATE_HASH
+#define STORE(loc, v) store_hashed(state, (loc), (v))
+#else
+#define STORE(loc, v) store(state, (loc), (v))
+#endif
 
 #define BYTETOBINARYPATTERN "%d%d%d%d%d%d%d%d"
 #define BYTETOBINARY(byte)  \
@@ -41,9 +62,34 @@
                               state->pc, state->sp, state->a, *(state->b), *(state->c), *(state->d), *(state->e), BYTETOBINARY(state->f), *(state->h), *(state->l), state->intr, state->shift_reg, state->shift_reg_offset); \
                       print_stack(state)
 
+#ifdef ENABLE_STATS
+#define STATS_INS(ins) (state->stats.name[instruction] = #ins)
+#define STATS_COUNT(instr, cycle, taken)                                    \
+    do {                                                                    \
+        ++state->stats.count[instr];                                        \
+        state->stats.cycles[instr] += (cycle);                              \
+        if (IS_COND_BRANCH(instr)) {                                        \
+            if (taken) {                                                    \
+                ++state->stats.taken[instr];                                \
+            } else {                                                        \
+                ++state->stats.not_taken[instr];                            \
+            }                                                               \
+        }                                                                   \
+    } while (0)
+#else
+#define STATS_INS(ins)
+#define STATS_COUNT(instr, cycle, taken)
+#endif
+
+#define INS(name) TRACE_INS(name); STATS_INS(name)
+
+// Jcc, Ccc and Rcc
+#define IS_COND_BRANCH(instr) (((instr) & 0xC7) == 0xC2 || ((instr) & 0xC7) == 0xC4 || ((instr) & 0xC7) == 0xC0)
+
 struct state_t {
     struct cpu_mem_t *machine;
     unsigned short pc;
+    // Read-only, a store to it faults like it did on the machine
     unsigned char *program;
     unsigned short program_size;
     unsigned short sp;
@@ -58,17 +104,49 @@ struct state_t {
     unsigned char f;
     unsigned char *h;
     unsigned char *l;
-    unsigned char *mem;
     unsigned char intr;
     unsigned char pending_intr;
     unsigned short shift_reg;
     unsigned char shift_reg_offset;
+    unsigned long long total_cycles;
+    unsigned long long total_instructions;
+    struct keyboard_t *keyboard;
+    int engine;
+    // Why the machine stopped, I8080_OK while it runs
+    int error;
+    struct trace_t *trace;
+    struct coverage_t *coverage;
+#ifdef ENABLE_STATS
+    struct op_stats_t stats;
+#endif
+#ifdef ENABLE_STATE_HASH
+    unsigned long long ram_hash;
+#endif
+    struct rom_t *rom;
+    unsigned char ram[RAM_SIZE] __attribute__((aligned(MACHINE_ALIGN)));
+};
+
+/*
+ * A program loaded by some machine of the process. Machines loading the
+ * same bytes share it, it goes away with the last of them.
+ */
+struct rom_t {
+    struct rom_t *next;
+    unsigned char *data;
+    long size;
+    int refs;
+};
+
+static struct rom_t *roms;
+static pthread_mutex_t roms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A machine in one block, what machine_footprint() counts */
+struct machine_t {
+    struct state_t state;
+    struct cpu_mem_t machine;
 };
 
-static struct keyboard_t *keyboard;
-static int stop = 20;
 //static unsigned long long count = 0;
-static unsigned long long total_cycles = 0;
 //static int stop_count = 0;
 
 static int cycles[][16] = { { 4, 10, 7, 5, 5, 5, 7, 4, 4, 10, 7, 5, 5, 5, 7, 4, },
@@ -89,6 +167,54 @@ static int cycles[][16] = { { 4, 10, 7, 5, 5, 5, 7, 4, 4, 10, 7, 5, 5, 5, 7, 4,
                             { 111, 10, 10, 4, 117, 11, 7, 11, 111, 5, 10, 4, 117, 17, 7, 11, }, };
 
 
+static void init_ops();
+
+/*
+ * Zobrist style key of one RAM byte. The RAM hash is the XOR of the keys
+ * of all bytes, so a store only has to swap the key of the old value for
+ * the key of the new one.
+ */
+static inline unsigned long long byte_key(unsigned int offset, unsigned char v)
+{
+    return hash_mix((((unsigned long long)offset << 8) | v) + 0x9E3779B97F4A7C15ULL);
+}
+
+static unsigned long long ram_hash_full(struct state_t *state)
+{
+    const unsigned char *ram = state->ram;
+    unsigned long long h = 0;
+    unsigned int i;
+
+    for (i = 0; i < RAM_SIZE; ++i) {
+        h ^= byte_key(i, ram[i]);
+    }
+
+    return h;
+}
+
+#ifdef ENABLE_STATE_HASH
+static inline void store_hashed(struct state_t *state, unsigned int loc, unsigned char v)
+{
+    unsigned int offset = loc & (RAM_SIZE - 1);
+
+    if (loc < RAM_ADDRESS) {
+        state->error = I8080_ROM_WRITE;
+        return;
+    }
+    state->ram_hash ^= byte_key(offset, state->ram[offset]) ^ byte_key(offset, v);
+    state->ram[offset] = v;
+}
+#else
+static inline void store(struct state_t *state, unsigned int loc, unsigned char v)
+{
+    if (loc < RAM_ADDRESS) {
+        state->error = I8080_ROM_WRITE;
+        return;
+    }
+    state->ram[loc & (RAM_SIZE - 1)] = v;
+}
+#endif
+
 static void print_stack(struct state_t *state)
 {
     /*
@@ -115,32 +241,25 @@ static void print_stack(struct state_t *state)
     */
 }
 
-static long init_program(const char *name, unsigned char *buffer)
+long load_program(const char *bin_name, unsigned char *buffer)
 {
     FILE *bin;
     long size = -1;
 
-    bin = fopen(name, "rb");
+    bin = fopen(bin_name, "rb");
     if (NULL == bin) {
-        ABORT(("fopen() failed\n"));
+        return -1;
     }
 
-    if (0 != fseek(bin, 0, SEEK_END)) {
-        ABORT(("fseek() failed\n"));
-    }
-
-    size = ftell(bin);
-    if (0 > size) {
-        ABORT(("ftell() failed\n"));
-    }
-    if (size > ROM_SIZE) {
-        ABORT(("program size too big\n"));
+    if (0 != fseek(bin, 0, SEEK_END) || 0 > (size = ftell(bin)) || size > ROM_SIZE) {
+        fclose(bin);
+        return -1;
     }
 
     rewind(bin);
 
     if (size != fread(buffer, 1, size, bin)) {
-        ABORT(("didn't read enough data\n"));
+        size = -1;
     }
 
     fclose(bin);
@@ -150,72 +269,219 @@ static long init_program(const char *name, unsigned char *buffer)
 
 struct cpu_mem_t *init_machine(const char *bin_name, struct keyboard_t *k)
 {
-    struct cpu_mem_t *res;
-    struct state_t *state;
+    unsigned char rom[ROM_SIZE];
+    long size;
 
-    res = (struct cpu_mem_t *)malloc(sizeof(struct cpu_mem_t));
-    if (res == NULL) {
-        ABORT(("OOM\n"));
+    size = load_program(bin_name, rom);
+    if (size <= 0) {
+        return NULL;
     }
 
-    res->state = malloc(sizeof(struct state_t));
-    if (res->state == NULL) {
-        ABORT(("OOM\n"));
+    return init_machine_rom(rom, size, k);
+}
+
+/* The shared copy of the program, NULL if out of memory */
+static struct rom_t *get_rom(const unsigned char *program, long size)
+{
+    struct rom_t *rom;
+    void *data;
+
+    pthread_mutex_lock(&roms_lock);
+    for (rom = roms; rom != NULL; rom = rom->next) {
+        if (rom->size == size && memcmp(rom->data, program, size) == 0) {
+            ++rom->refs;
+            pthread_mutex_unlock(&roms_lock);
+            return rom;
+        }
     }
-    state = res->state;
 
-    state->machine = res;
+    rom = malloc(sizeof(*rom));
+    data = mmap(NULL, ROM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (rom == NULL || data == MAP_FAILED) {
+        if (data != MAP_FAILED) {
+            munmap(data, ROM_MAP_SIZE);
+        }
+        free(rom);
+        pthread_mutex_unlock(&roms_lock);
+        return NULL;
+    }
+    memcpy(data, program, size);
+    if (0 != mprotect(data, ROM_MAP_SIZE, PROT_READ)) {
+        munmap(data, ROM_MAP_SIZE);
+        free(rom);
+        pthread_mutex_unlock(&roms_lock);
+        return NULL;
+    }
+
+    rom->data = data;
+    rom->size = size;
+    rom->refs = 1;
+    rom->next = roms;
+    roms = rom;
+    pthread_mutex_unlock(&roms_lock);
+
+    return rom;
+}
+
+static void put_rom(struct rom_t *rom)
+{
+    struct rom_t **p;
+
+    pthread_mutex_lock(&roms_lock);
+    if (--rom->refs == 0) {
+        for (p = &roms; *p != rom; p = &(*p)->next) {
+        }
+        *p = rom->next;
+        munmap(rom->data, ROM_MAP_SIZE);
+        free(rom);
+    }
+    pthread_mutex_unlock(&roms_lock);
+}
+
+#ifdef ENABLE_STATE_HASH
+/* The hash of a RAM of zeros, which every machine powers on with */
+static unsigned long long zero_hash;
+
+static void build_zero_ram_hash()
+{
+    unsigned int i;
+
+    for (i = 0; i < RAM_SIZE; ++i) {
+        zero_hash ^= byte_key(i, 0);
+    }
+}
+
+static unsigned long long zero_ram_hash()
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, build_zero_ram_hash);
+    return zero_hash;
+}
+#endif
+
+/* Everything init_machine() sets up but the program and tracing */
+static void power_on(struct state_t *state, struct keyboard_t *k)
+{
     state->intr = 0;
     state->pending_intr = 0;
     state->shift_reg = 0;
     state->shift_reg_offset = 0;
+    state->total_cycles = 0;
+    state->total_instructions = 0;
+    state->engine = ENGINE_REFERENCE;
+    state->error = I8080_OK;
+    state->coverage = NULL;
     state->pc = 0;
     state->sp = STACK_BOTTOM;
+#ifdef ENABLE_STATS
+    memset(&state->stats, 0, sizeof(state->stats));
+#endif
     state->a = 0;
     state->f = F1;
     state->bc = 0;
     state->de = 0;
     state->hl = 0;
+    memset(state->ram, 0x00, RAM_SIZE);
+#ifdef ENABLE_STATE_HASH
+    state->ram_hash = zero_ram_hash();
+#endif
+
+    state->keyboard = k;
+    memset(state->keyboard, 0, sizeof(*state->keyboard));
+}
+
+/* Builds a machine in m around a reference to rom the caller took */
+static struct cpu_mem_t *build_machine(struct machine_t *m, struct rom_t *rom, struct keyboard_t *k)
+{
+    struct state_t *state = &m->state;
+    struct cpu_mem_t *res = &m->machine;
+
+    res->state = state;
+    state->machine = res;
+    state->rom = rom;
+    state->program = rom->data;
+    state->program_size = rom->size;
+    state->trace = NULL;
     state->b = ((unsigned char *)&(state->bc)) + 1;
     state->c = (unsigned char *)&(state->bc);
     state->d = ((unsigned char *)&(state->de)) + 1;
     state->e = (unsigned char *)&(state->de);
     state->h = ((unsigned char *)&(state->hl)) + 1;
     state->l = (unsigned char *)&(state->hl);
-    posix_memalign((void **)&(state->mem), 0x1000, MEM_SIZE + MIRROR_SIZE);
-    memset(state->mem, 0x00, MEM_SIZE + MIRROR_SIZE);
+    power_on(state, k);
 
-    state->program = state->mem;
-    state->program_size = init_program(bin_name, state->mem);
-    if (0 >= state->program_size) {
-        ABORT(("loading program failed\n"));
+    res->ram = state->ram;
+    res->rom = state->program;
+
+    init_ops();
+
+    return res;
+}
+
+struct cpu_mem_t *init_machine_rom(const unsigned char *rom, long size, struct keyboard_t *k)
+{
+    struct machine_t *m;
+    struct rom_t *shared;
+
+    if (0 >= size || size > ROM_SIZE) {
+        return NULL;
     }
 
-    if (0 != mprotect(state->program, ROM_SIZE, PROT_READ)) {
-        perror("mprotect() failed");
-        ABORT(("%p\n", state->program));
+    if (0 != posix_memalign((void **)&m, MACHINE_ALIGN, sizeof(*m))) {
+        return NULL;
     }
 
-    if (0 != mprotect(state->mem + MEM_SIZE, MIRROR_SIZE, PROT_NONE)) {
-        perror("mprotect() failed");
-        ABORT(("%p\n", state->program));
+    shared = get_rom(rom, size);
+    if (shared == NULL) {
+        free(m);
+        return NULL;
     }
 
-    res->mem = state->mem;
+    return build_machine(m, shared, k);
+}
 
-    keyboard = k;
-    memset(keyboard, 0, sizeof(*keyboard));
+struct cpu_mem_t *place_machine(void *memory, const struct cpu_mem_t *like, struct keyboard_t *k)
+{
+    struct rom_t *rom = ((struct state_t *)like->state)->rom;
 
-    return res;
+    pthread_mutex_lock(&roms_lock);
+    ++rom->refs;
+    pthread_mutex_unlock(&roms_lock);
+
+    return build_machine(memory, rom, k);
 }
 
-void deinit_machine(struct cpu_mem_t *machine)
+void reset_machine(struct cpu_mem_t *machine, struct keyboard_t *k)
 {
     struct state_t *state = (struct state_t *)machine->state;
-    mprotect(state->program, ROM_SIZE, PROT_READ | PROT_WRITE);
-    free(state->mem);
-    free(state);
-    free(machine);
+
+    disable_trace(machine);
+    power_on(state, k);
+}
+
+void release_machine(struct cpu_mem_t *machine)
+{
+    struct state_t *state = (struct state_t *)machine->state;
+
+    if (state->trace != NULL) {
+        trace_free(state->trace);
+    }
+    put_rom(state->rom);
+}
+
+void deinit_machine(struct cpu_mem_t *machine)
+{
+    // The state comes first in the block init_machine_rom() allocated
+    void *m = machine->state;
+
+    release_machine(machine);
+    free(m);
+}
+
+size_t machine_footprint()
+{
+    return sizeof(struct machine_t);
 }
 
 static unsigned char read_8b(struct state_t *state)
@@ -318,6 +584,16 @@ static unsigned char *get_reg(struct state_t *state, unsigned char encoding)
     return NULL;
 }
 
+/* The store half of get_reg(), M has to go through STORE */
+static void set_reg(struct state_t *state, unsigned char encoding, unsigned char v)
+{
+    if (encoding == 0x06) {
+        STORE(state->hl, v);
+    } else {
+        *get_reg(state, encoding) = v;
+    }
+}
+
 static unsigned short *get_dreg(struct state_t *state, unsigned char encoding)
 {
     switch (encoding) {
@@ -388,8 +664,8 @@ static void call_if(struct state_t *state, unsigned char c)
     unsigned short pc = read_16b(state);
 
     if (c) {
-        --state->sp; MEM_LOC(state->sp) = ((state->pc >> 8) & 0x00FF);
-        --state->sp; MEM_LOC(state->sp) = (state->pc & 0x00FF);
+        --state->sp; STORE(state->sp, ((state->pc >> 8) & 0x00FF));
+        --state->sp; STORE(state->sp, (state->pc & 0x00FF));
 
         state->pc = pc;
     }
@@ -504,11 +780,12 @@ static void PCHL(struct state_t *state)
     state->pc = state->hl;
 }
 
-static void JX(struct state_t *state, unsigned char instr)
+static int JX(struct state_t *state, unsigned char instr)
 {
     unsigned char cond = (instr & 0x38);
     unsigned char taken = get_cond(state, cond >> 3);
     jump_if(state, taken);
+    return taken;
 }
 
 static void JMP(struct state_t *state)
@@ -553,7 +830,7 @@ static void LXI(struct state_t *state, unsigned char instr)
 static void MVI(struct state_t *state, unsigned char instr)
 {
     unsigned char reg = (instr & 0x38);
-    *get_reg(state, (reg >> 3)) = read_8b(state);
+    set_reg(state, (reg >> 3), read_8b(state));
 }
 
 static void LDA(struct state_t *state)
@@ -572,8 +849,8 @@ static void LHLD(struct state_t *state)
 static void SHLD(struct state_t *state)
 {
     unsigned short mem = read_16b(state);
-    MEM_LOC(mem) = *state->l;
-    MEM_LOC(mem + 1) = *state->h;
+    STORE(mem, *state->l);
+    STORE(mem + 1, *state->h);
 }
 
 static void LDAX(struct state_t *state, unsigned int reg)
@@ -583,7 +860,7 @@ static void LDAX(struct state_t *state, unsigned int reg)
 
 static void STAX(struct state_t *state, unsigned int reg)
 {
-    MEM_LOC(reg) = state->a;
+    STORE(reg, state->a);
 }
 
 static void MOV(struct state_t *state, unsigned char instr)
@@ -593,7 +870,7 @@ static void MOV(struct state_t *state, unsigned char instr)
     dst = ((instr & 0x38) >> 3);
     src = (instr & 0x07);
 
-    *get_reg(state, dst) = *get_reg(state, src);
+    set_reg(state, dst, *get_reg(state, src));
 }
 
 static void ADD(struct state_t *state, unsigned char instr, int carry)
@@ -643,20 +920,20 @@ static void DCX(struct state_t *state, unsigned char instr)
 static void INR(struct state_t *state, unsigned char instr, int inc)
 {
     unsigned char enc = (instr & 0x38);
-    unsigned char *reg = get_reg(state, enc >> 3);
-    *reg = inc_dec(state, *reg, (inc ? 1 : -1));
+    unsigned char reg = *get_reg(state, enc >> 3);
+    set_reg(state, enc >> 3, inc_dec(state, reg, (inc ? 1 : -1)));
 }
 
 static void PUSH(struct state_t *state, unsigned int reg)
 {
-    --state->sp; MEM_LOC(state->sp) = ((reg >> 8) & 0x00FF);
-    --state->sp; MEM_LOC(state->sp) = (reg & 0x00FF);
+    --state->sp; STORE(state->sp, ((reg >> 8) & 0x00FF));
+    --state->sp; STORE(state->sp, (reg & 0x00FF));
 }
 
 static void PUSHPSW(struct state_t *state)
 {
-    --state->sp; MEM_LOC(state->sp) = state->a;
-    --state->sp; MEM_LOC(state->sp) = state->f;
+    --state->sp; STORE(state->sp, state->a);
+    --state->sp; STORE(state->sp, state->f);
 }
 
 static void POP(struct state_t *state, unsigned short *reg)
@@ -678,11 +955,11 @@ static void XTHL(struct state_t *state)
 
     t = *state->l;
     *state->l = MEM_LOC(state->sp);
-    MEM_LOC(state->sp) = t;
+    STORE(state->sp, t);
 
     t = *state->h;
     *state->h = MEM_LOC(state->sp + 1);
-    MEM_LOC(state->sp + 1) = t;
+    STORE(state->sp + 1, t);
 }
 
 static void DAD(struct state_t *state, unsigned char instr)
@@ -710,6 +987,7 @@ static void XCHG(struct state_t *state)
 
 static void IN(struct state_t *state)
 {
+    struct keyboard_t *keyboard = state->keyboard;
     unsigned char i = read_8b(state);
 
     switch (i) {
@@ -873,7 +1151,7 @@ static void SUI(struct state_t *state)
 static void STA(struct state_t *state)
 {
     unsigned short mem = read_16b(state);
-    MEM_LOC(mem) = state->a;
+    STORE(mem, state->a);
 }
 
 static void EI(struct state_t *state)
@@ -901,14 +1179,24 @@ static void DAA(struct state_t *state)
     }
 }
 
+/* Stops the machine with pc still on the instruction that stopped it */
+static int fault(struct state_t *state, int error, int fetched)
+{
+    state->error = error;
+    state->pc -= fetched;
+
+    return FAULT_CYCLES;
+}
+
 static int execute_one(struct state_t *state)
 {
+    unsigned short start = state->pc;
     unsigned char instruction;
     int cycle;
     int taken = 1;
 
     if (state->pc > state->program_size) {
-        ABORT(("pc out of bound! %u\n", state->pc));
+        return fault(state, I8080_PC_OUT_OF_ROM, 0);
     }
 
     instruction = state->program[state->pc];
@@ -918,246 +1206,246 @@ static int execute_one(struct state_t *state)
     // 01XX XXXX
         if (instruction == 0x76) {
             // HLT
-            exit(0);
+            return fault(state, I8080_HALTED, 1);
         }
 
-        TRACE_INS(MOV);
+        INS(MOV);
         MOV(state, instruction);
     } else if ((instruction & 0xF8) == 0x80) {
     // 1000 0XXX
-        TRACE_INS(ADD);
+        INS(ADD);
         ADD(state, instruction, 0);
     } else if ((instruction & 0xF8) == 0x88) {
     // 1000 1XXX
-        TRACE_INS(ADC);
+        INS(ADC);
         ADD(state, instruction, 1);
     } else if ((instruction & 0xF8) == 0x90) {
     // 1001 0XXX
-        TRACE_INS(SUB);
+        INS(SUB);
         SUB(state, instruction, 0);
     } else if ((instruction & 0xF8) == 0x98) {
     // 1001 1XXX
-        TRACE_INS(SBB);
+        INS(SBB);
         SUB(state, instruction, 1);
     } else if ((instruction & 0xF8) == 0xA0) {
     // 1010 0XXX
-        TRACE_INS(ANA);
+        INS(ANA);
         ANA(state, instruction);
     } else if ((instruction & 0xF8) == 0xA8) {
     // 1010 1XXX
-        TRACE_INS(XRA);
+        INS(XRA);
         XRA(state, instruction);
     } else if ((instruction & 0xF8) == 0xB0) {
     // 1011 0XXX
-        TRACE_INS(ORA);
+        INS(ORA);
         ORA(state, instruction);
     } else if ((instruction & 0xF8) == 0xB8) {
     // 1011 1XXX
-        TRACE_INS(CMP);
+        INS(CMP);
         CMP(state, instruction);
     } else if ((instruction & 0xCF) == 0x01) {
     // 00XX 0001
-        TRACE_INS(LXI);
+        INS(LXI);
         LXI(state, instruction);
     } else if ((instruction & 0xCF) == 0x03) {
     // 00XX 0011
-        TRACE_INS(INX);
+        INS(INX);
         INX(state, instruction);
     } else if ((instruction & 0xCF) == 0x0B) {
     // 00XX 1011
-        TRACE_INS(DCX);
+        INS(DCX);
         DCX(state, instruction);
     } else if ((instruction & 0xCF) == 0x09) {
     // 00XX 1001
-        TRACE_INS(DAD);
+        INS(DAD);
         DAD(state, instruction);
     } else if ((instruction & 0xC7) == 0x04) {
     // 00XX X100
-        TRACE_INS(INR);
+        INS(INR);
         INR(state, instruction, 1);
     } else if ((instruction & 0xC7) == 0x05) {
     // 00XX X101
-        TRACE_INS(DCR);
+        INS(DCR);
         INR(state, instruction, 0);
     } else if ((instruction & 0xC7) == 0xC4) {
     // 11XX X100
-        TRACE_INS(CX);
+        INS(CX);
         taken = CX(state, instruction);
     } else if ((instruction & 0xC7) == 0xC2) {
     // 11XX X010
-        TRACE_INS(JX);
-        JX(state, instruction);
+        INS(JX);
+        taken = JX(state, instruction);
     } else if ((instruction & 0xC7) == 0x06) {
     // 00XX X110
-        TRACE_INS(MVI);
+        INS(MVI);
         MVI(state, instruction);
     } else if ((instruction & 0xC7) == 0xC0) {
     // 11XX X000
-        TRACE_INS(RX);
+        INS(RX);
         taken = RX(state, instruction);
     } else {
         switch(instruction) {
             case 0x00:
-                TRACE_INS(NOP);
+                INS(NOP);
                 NOP(state);
                 break;
             case 0x02:
-                TRACE_INS(STAX);
+                INS(STAX);
                 TRACE("BC\t");
                 STAX(state, state->bc);
                 break;
             case 0x07:
-                TRACE_INS(RLC);
+                INS(RLC);
                 RLC(state);
                 break;
             case 0x0A:
-                TRACE_INS(LDAX);
+                INS(LDAX);
                 TRACE("BC\t");
                 LDAX(state, state->bc);
                 break;
             case 0x0F:
-                TRACE_INS(RRC);
+                INS(RRC);
                 RRC(state);
                 break;
             case 0x12:
-                TRACE_INS(STAX);
+                INS(STAX);
                 TRACE("DE\t");
                 STAX(state, state->de);
                 break;
             case 0x1A:
-                TRACE_INS(LDAX);
+                INS(LDAX);
                 TRACE("DE\t");
                 LDAX(state, state->de);
                 break;
             case 0x1F:
-                TRACE_INS(RAR);
+                INS(RAR);
                 RAR(state);
                 break;
             case 0x22:
-                TRACE_INS(SHLD);
+                INS(SHLD);
                 SHLD(state);
                 break;
             case 0x27:
-                TRACE_INS(DAA);
+                INS(DAA);
                 DAA(state);
                 break;
             case 0x2A:
-                TRACE_INS(LHLD);
+                INS(LHLD);
                 LHLD(state);
                 break;
             case 0x2F:
-                TRACE_INS(CMA);
+                INS(CMA);
                 CMA(state);
                 break;
             case 0x32:
-                TRACE_INS(STA);
+                INS(STA);
                 STA(state);
                 break;
             case 0x37:
-                TRACE_INS(STC);
+                INS(STC);
                 STC(state);
                 break;
             case 0x3A:
-                TRACE_INS(LDA);
+                INS(LDA);
                 LDA(state);
                 break;
             case 0xC1:
-                TRACE_INS(POP);
+                INS(POP);
                 TRACE("BC\t");
                 POP(state, &(state->bc));
                 break;
             case 0xC3:
-                TRACE_INS(JMP);
+                INS(JMP);
                 JMP(state);
                 break;
             case 0xC5:
-                TRACE_INS(PUSH);
+                INS(PUSH);
                 TRACE("B\tC\t");
                 PUSH(state, state->bc);
                 break;
             case 0xC6:
-                TRACE_INS(ADI);
+                INS(ADI);
                 ADI(state);
                 break;
             case 0xC9:
-                TRACE_INS(RET);
+                INS(RET);
                 RET(state);
                 break;
             case 0xCD:
-                TRACE_INS(CAL);
+                INS(CAL);
                 CAL(state);
                 break;
             case 0xD1:
-                TRACE_INS(POP);
+                INS(POP);
                 TRACE("DE\t");
                 POP(state, &(state->de));
                 break;
             case 0xD3:
-                TRACE_INS(OUT);
+                INS(OUT);
                 OUT(state);
                 break;
             case 0xD5:
-                TRACE_INS(PUSH);
+                INS(PUSH);
                 TRACE("D\tE\t");
                 PUSH(state, state->de);
                 break;
             case 0xD6:
-                TRACE_INS(SUI);
+                INS(SUI);
                 SUI(state);
                 break;
             case 0xDB:
-                TRACE_INS(IN);
+                INS(IN);
                 IN(state);
                 break;
             case 0xDE:
-                TRACE_INS(SBI);
+                INS(SBI);
                 SBI(state);
                 break;
             case 0xE1:
-                TRACE_INS(POP);
+                INS(POP);
                 TRACE("H\tL\t");
                 POP(state, &(state->hl));
                 break;
             case 0xE3:
-                TRACE_INS(XTHL);
+                INS(XTHL);
                 XTHL(state);
                 break;
             case 0xE5:
-                TRACE_INS(PUSH);
+                INS(PUSH);
                 TRACE("H\tL\t");
                 PUSH(state, state->hl);
                 break;
             case 0xE6:
-                TRACE_INS(ANI);
+                INS(ANI);
                 ANI(state);
                 break;
             case 0xE9:
-                TRACE_INS(PCHL);
+                INS(PCHL);
                 PCHL(state);
                 break;
             case 0xEB:
-                TRACE_INS(XCHG);
+                INS(XCHG);
                 TRACE("HL\tDE\t");
                 XCHG(state);
                 break;
             case 0xF1:
-                TRACE_INS(POPPSW);
+                INS(POPPSW);
                 POPPSW(state);
                 break;
             case 0xF5:
-                TRACE_INS(PUSHPSW);
+                INS(PUSHPSW);
                 PUSHPSW(state);
                 break;
             case 0xF6:
-                TRACE_INS(ORI);
+                INS(ORI);
                 ORI(state);
                 break;
             case 0xFB:
-                TRACE_INS(EI);
+                INS(EI);
                 EI(state);
                 break;
             case 0xFE:
-                TRACE_INS(CPI);
+                INS(CPI);
                 CPI(state);
                 break;
             case 0x08:
@@ -1172,12 +1460,17 @@ static int execute_one(struct state_t *state)
             case 0xDD:
             case 0xED:
             case 0xFD:
-                ABORT(("Alternative opcode used (0x%02x). Aborting...\n", instruction));
             default:
-                ABORT(("Unrecognized instruction 0x%02x at 0x%04x\n", instruction, state->pc));
+                return fault(state, I8080_BAD_OPCODE, 1);
         }
     }
 
+    if (state->error != I8080_OK) {
+        // A store to ROM, back to the start of the instruction
+        state->pc = start;
+        return FAULT_CYCLES;
+    }
+
     cycle = cycles[instruction >> 4][instruction & 0x0F];
     if (cycle > 100) {
         if (taken) {
@@ -1189,21 +1482,270 @@ static int execute_one(struct state_t *state)
     if (cycle <= 0 || cycle >= 20) {
         ABORT(("cycle number incorrect!\n"));
     }
-    total_cycles += cycle;
-    TRACE("cycle: %d/%llu\n", cycle, total_cycles);
+    state->total_cycles += cycle;
+    ++state->total_instructions;
+    STATS_COUNT(instruction, cycle, taken);
+    TRACE("cycle: %d/%llu\n", cycle, state->total_cycles);
 
     TRACE_STATE();
 
-    if (stop == 0) {
-        exit(1);
+    return cycle;
+}
+
+
+/*
+ * Table driven engine. Decodes every opcode once, in the same order as the
+ * if chain in execute_one(), into a handler built from the same
+ * instruction functions, so the two can be checked against each other in
+ * lockstep (see lockstep.c).
+ */
+struct op_t {
+    int (*handler)(struct state_t *state, unsigned char instr);
+    const char *name;
+    unsigned char cycles_taken;
+    unsigned char cycles_not_taken;
+};
+
+static struct op_t ops[256];
+
+/* Handlers that stop the machine return -1 */
+static int op_HLT(struct state_t *state, unsigned char instr) { fault(state, I8080_HALTED, 1); return -1; }
+static int op_MOV(struct state_t *state, unsigned char instr) { MOV(state, instr); return 1; }
+static int op_ADD(struct state_t *state, unsigned char instr) { ADD(state, instr, 0); return 1; }
+static int op_ADC(struct state_t *state, unsigned char instr) { ADD(state, instr, 1); return 1; }
+static int op_SUB(struct state_t *state, unsigned char instr) { SUB(state, instr, 0); return 1; }
+static int op_SBB(struct state_t *state, unsigned char instr) { SUB(state, instr, 1); return 1; }
+static int op_ANA(struct state_t *state, unsigned char instr) { ANA(state, instr); return 1; }
+static int op_XRA(struct state_t *state, unsigned char instr) { XRA(state, instr); return 1; }
+static int op_ORA(struct state_t *state, unsigned char instr) { ORA(state, instr); return 1; }
+static int op_CMP(struct state_t *state, unsigned char instr) { CMP(state, instr); return 1; }
+static int op_LXI(struct state_t *state, unsigned char instr) { LXI(state, instr); return 1; }
+static int op_INX(struct state_t *state, unsigned char instr) { INX(state, instr); return 1; }
+static int op_DCX(struct state_t *state, unsigned char instr) { DCX(state, instr); return 1; }
+static int op_DAD(struct state_t *state, unsigned char instr) { DAD(state, instr); return 1; }
+static int op_INR(struct state_t *state, unsigned char instr) { INR(state, instr, 1); return 1; }
+static int op_DCR(struct state_t *state, unsigned char instr) { INR(state, instr, 0); return 1; }
+static int op_CX(struct state_t *state, unsigned char instr) { return CX(state, instr); }
+static int op_JX(struct state_t *state, unsigned char instr) { return JX(state, instr); }
+static int op_MVI(struct state_t *state, unsigned char instr) { MVI(state, instr); return 1; }
+static int op_RX(struct state_t *state, unsigned char instr) { return RX(state, instr); }
+static int op_NOP(struct state_t *state, unsigned char instr) { NOP(state); return 1; }
+static int op_STAX_B(struct state_t *state, unsigned char instr) { STAX(state, state->bc); return 1; }
+static int op_STAX_D(struct state_t *state, unsigned char instr) { STAX(state, state->de); return 1; }
+static int op_LDAX_B(struct state_t *state, unsigned char instr) { LDAX(state, state->bc); return 1; }
+static int op_LDAX_D(struct state_t *state, unsigned char instr) { LDAX(state, state->de); return 1; }
+static int op_RLC(struct state_t *state, unsigned char instr) { RLC(state); return 1; }
+static int op_RRC(struct state_t *state, unsigned char instr) { RRC(state); return 1; }
+static int op_RAR(struct state_t *state, unsigned char instr) { RAR(state); return 1; }
+static int op_SHLD(struct state_t *state, unsigned char instr) { SHLD(state); return 1; }
+static int op_LHLD(struct state_t *state, unsigned char instr) { LHLD(state); return 1; }
+static int op_DAA(struct state_t *state, unsigned char instr) { DAA(state); return 1; }
+static int op_CMA(struct state_t *state, unsigned char instr) { CMA(state); return 1; }
+static int op_STA(struct state_t *state, unsigned char instr) { STA(state); return 1; }
+static int op_LDA(struct state_t *state, unsigned char instr) { LDA(state); return 1; }
+static int op_STC(struct state_t *state, unsigned char instr) { STC(state); return 1; }
+static int op_POP_B(struct state_t *state, unsigned char instr) { POP(state, &(state->bc)); return 1; }
+static int op_POP_D(struct state_t *state, unsigned char instr) { POP(state, &(state->de)); return 1; }
+static int op_POP_H(struct state_t *state, unsigned char instr) { POP(state, &(state->hl)); return 1; }
+static int op_PUSH_B(struct state_t *state, unsigned char instr) { PUSH(state, state->bc); return 1; }
+static int op_PUSH_D(struct state_t *state, unsigned char instr) { PUSH(state, state->de); return 1; }
+static int op_PUSH_H(struct state_t *state, unsigned char instr) { PUSH(state, state->hl); return 1; }
+static int op_POPPSW(struct state_t *state, unsigned char instr) { POPPSW(state); return 1; }
+static int op_PUSHPSW(struct state_t *state, unsigned char instr) { PUSHPSW(state); return 1; }
+static int op_JMP(struct state_t *state, unsigned char instr) { JMP(state); return 1; }
+static int op_CAL(struct state_t *state, unsigned char instr) { CAL(state); return 1; }
+static int op_RET(struct state_t *state, unsigned char instr) { RET(state); return 1; }
+static int op_PCHL(struct state_t *state, unsigned char instr) { PCHL(state); return 1; }
+static int op_XTHL(struct state_t *state, unsigned char instr) { XTHL(state); return 1; }
+static int op_XCHG(struct state_t *state, unsigned char instr) { XCHG(state); return 1; }
+static int op_ADI(struct state_t *state, unsigned char instr) { ADI(state); return 1; }
+static int op_SUI(struct state_t *state, unsigned char instr) { SUI(state); return 1; }
+static int op_SBI(struct state_t *state, unsigned char instr) { SBI(state); return 1; }
+static int op_ANI(struct state_t *state, unsigned char instr) { ANI(state); return 1; }
+static int op_ORI(struct state_t *state, unsigned char instr) { ORI(state); return 1; }
+static int op_CPI(struct state_t *state, unsigned char instr) { CPI(state); return 1; }
+static int op_IN(struct state_t *state, unsigned char instr) { IN(state); return 1; }
+static int op_OUT(struct state_t *state, unsigned char instr) { OUT(state); return 1; }
+static int op_EI(struct state_t *state, unsigned char instr) { EI(state); return 1; }
+
+static int op_ALT(struct state_t *state, unsigned char instr)
+{
+    fault(state, I8080_BAD_OPCODE, 1);
+    return -1;
+}
+
+static int op_BAD(struct state_t *state, unsigned char instr)
+{
+    fault(state, I8080_BAD_OPCODE, 1);
+    return -1;
+}
+
+#define OP(ins) ops[i].handler = op_##ins; ops[i].name = #ins
+
+static void build_ops()
+{
+    static const unsigned char misc[][2] = {
+        { 0x00, 0 }, { 0x02, 1 }, { 0x07, 2 }, { 0x0A, 3 }, { 0x0F, 4 }, { 0x12, 5 },
+        { 0x1A, 6 }, { 0x1F, 7 }, { 0x22, 8 }, { 0x27, 9 }, { 0x2A, 10 }, { 0x2F, 11 },
+        { 0x32, 12 }, { 0x37, 13 }, { 0x3A, 14 }, { 0xC1, 15 }, { 0xC3, 16 }, { 0xC5, 17 },
+        { 0xC6, 18 }, { 0xC9, 19 }, { 0xCD, 20 }, { 0xD1, 21 }, { 0xD3, 22 }, { 0xD5, 23 },
+        { 0xD6, 24 }, { 0xDB, 25 }, { 0xDE, 26 }, { 0xE1, 27 }, { 0xE3, 28 }, { 0xE5, 29 },
+        { 0xE6, 30 }, { 0xE9, 31 }, { 0xEB, 32 }, { 0xF1, 33 }, { 0xF5, 34 }, { 0xF6, 35 },
+        { 0xFB, 36 }, { 0xFE, 37 },
+    };
+    int i, j;
+
+    for (i = 0; i < 256; ++i) {
+        int cycle = cycles[i >> 4][i & 0x0F];
+
+        ops[i].cycles_taken = (cycle > 100) ? cycle - 100 : cycle;
+        ops[i].cycles_not_taken = (cycle > 100) ? cycle - 106 : cycle;
+
+        if ((i & 0xC0) == 0x40) {
+            if (i == 0x76) {
+                OP(HLT);
+            } else {
+                OP(MOV);
+            }
+        } else if ((i & 0xF8) == 0x80) {
+            OP(ADD);
+        } else if ((i & 0xF8) == 0x88) {
+            OP(ADC);
+        } else if ((i & 0xF8) == 0x90) {
+            OP(SUB);
+        } else if ((i & 0xF8) == 0x98) {
+            OP(SBB);
+        } else if ((i & 0xF8) == 0xA0) {
+            OP(ANA);
+        } else if ((i & 0xF8) == 0xA8) {
+            OP(XRA);
+        } else if ((i & 0xF8) == 0xB0) {
+            OP(ORA);
+        } else if ((i & 0xF8) == 0xB8) {
+            OP(CMP);
+        } else if ((i & 0xCF) == 0x01) {
+            OP(LXI);
+        } else if ((i & 0xCF) == 0x03) {
+            OP(INX);
+        } else if ((i & 0xCF) == 0x0B) {
+            OP(DCX);
+        } else if ((i & 0xCF) == 0x09) {
+            OP(DAD);
+        } else if ((i & 0xC7) == 0x04) {
+            OP(INR);
+        } else if ((i & 0xC7) == 0x05) {
+            OP(DCR);
+        } else if ((i & 0xC7) == 0xC4) {
+            OP(CX);
+        } else if ((i & 0xC7) == 0xC2) {
+            OP(JX);
+        } else if ((i & 0xC7) == 0x06) {
+            OP(MVI);
+        } else if ((i & 0xC7) == 0xC0) {
+            OP(RX);
+        } else {
+            OP(BAD);
+        }
+    }
+
+    for (j = 0; j < sizeof(misc) / sizeof(misc[0]); ++j) {
+        static int (*const handlers[])(struct state_t *, unsigned char) = {
+            op_NOP, op_STAX_B, op_RLC, op_LDAX_B, op_RRC, op_STAX_D, op_LDAX_D, op_RAR,
+            op_SHLD, op_DAA, op_LHLD, op_CMA, op_STA, op_STC, op_LDA, op_POP_B,
+            op_JMP, op_PUSH_B, op_ADI, op_RET, op_CAL, op_POP_D, op_OUT, op_PUSH_D,
+            op_SUI, op_IN, op_SBI, op_POP_H, op_XTHL, op_PUSH_H, op_ANI, op_PCHL,
+            op_XCHG, op_POPPSW, op_PUSHPSW, op_ORI, op_EI, op_CPI,
+        };
+        static const char *names[] = {
+            "NOP", "STAX", "RLC", "LDAX", "RRC", "STAX", "LDAX", "RAR",
+            "SHLD", "DAA", "LHLD", "CMA", "STA", "STC", "LDA", "POP",
+            "JMP", "PUSH", "ADI", "RET", "CAL", "POP", "OUT", "PUSH",
+            "SUI", "IN", "SBI", "POP", "XTHL", "PUSH", "ANI", "PCHL",
+            "XCHG", "POPPSW", "PUSHPSW", "ORI", "EI", "CPI",
+        };
+
+        ops[misc[j][0]].handler = handlers[misc[j][1]];
+        ops[misc[j][0]].name = names[misc[j][1]];
+    }
+
+    for (i = 0x08; i <= 0x38; i += 0x08) {
+        OP(ALT);
+    }
+    i = 0xCB; OP(ALT);
+    i = 0xD9; OP(ALT);
+    i = 0xDD; OP(ALT);
+    i = 0xED; OP(ALT);
+    i = 0xFD; OP(ALT);
+}
+
+/* Machines are built from any thread, the table is filled in once */
+static void init_ops()
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, build_ops);
+}
+
+static int execute_one_table(struct state_t *state)
+{
+    unsigned short start = state->pc;
+    unsigned char instruction;
+    const struct op_t *op;
+    int cycle;
+    int taken;
+
+    if (state->pc > state->program_size) {
+        return fault(state, I8080_PC_OUT_OF_ROM, 0);
+    }
+
+    instruction = state->program[state->pc];
+    ++(state->pc);
+
+    op = &ops[instruction];
+#ifdef ENABLE_STATS
+    state->stats.name[instruction] = op->name;
+#endif
+
+    taken = op->handler(state, instruction);
+    if (taken < 0) {
+        return FAULT_CYCLES;
+    }
+    if (state->error != I8080_OK) {
+        // A store to ROM, back to the start of the instruction
+        state->pc = start;
+        return FAULT_CYCLES;
+    }
+    if (taken) {
+        cycle = op->cycles_taken;
+    } else {
+        cycle = op->cycles_not_taken;
     }
+
+    state->total_cycles += cycle;
+    ++state->total_instructions;
+    STATS_COUNT(instruction, cycle, taken);
+
     return cycle;
 }
 
+static int step_one(struct state_t *state)
+{
+    if (state->engine == ENGINE_TABLE) {
+        return execute_one_table(state);
+    }
+
+    return execute_one(state);
+}
+
 void generate_intr(struct cpu_mem_t *machine, int intr_num)
 {
     struct state_t *state = (struct state_t *)machine->state;
 
+    // A stopped machine stays as it stopped
+    if (state->error != I8080_OK) {
+        return;
+    }
+
     if (!state->intr) {
         state->pending_intr = intr_num;
         return;
@@ -1211,30 +1753,306 @@ void generate_intr(struct cpu_mem_t *machine, int intr_num)
 
     state->intr = 0;
 
-    --state->sp; MEM_LOC(state->sp) = ((state->pc >> 8) & 0x00FF);
-    --state->sp; MEM_LOC(state->sp) = (state->pc & 0x00FF);
+    --state->sp; STORE(state->sp, ((state->pc >> 8) & 0x00FF));
+    --state->sp; STORE(state->sp, (state->pc & 0x00FF));
+
+    // Stopped by pushing into ROM, pc stays where the interrupt came
+    if (state->error != I8080_OK) {
+        return;
+    }
 
     state->pc = 0x08 * intr_num;
 }
 
-int execute(struct cpu_mem_t *machine, int cycles)
+static void save_regs(struct state_t *state, struct cpu_regs_t *regs)
+{
+    regs->pc = state->pc;
+    regs->sp = state->sp;
+    regs->bc = state->bc;
+    regs->de = state->de;
+    regs->hl = state->hl;
+    regs->shift_reg = state->shift_reg;
+    regs->a = state->a;
+    regs->f = state->f;
+    regs->intr = state->intr;
+    regs->pending_intr = state->pending_intr;
+    regs->shift_reg_offset = state->shift_reg_offset;
+}
+
+void get_regs(struct cpu_mem_t *machine, struct cpu_regs_t *regs)
+{
+    save_regs((struct state_t *)machine->state, regs);
+}
+
+void set_regs(struct cpu_mem_t *machine, const struct cpu_regs_t *regs)
 {
-    int cycle = 0;
     struct state_t *state = (struct state_t *)machine->state;
 
+    state->pc = regs->pc;
+    state->sp = regs->sp;
+    state->bc = regs->bc;
+    state->de = regs->de;
+    state->hl = regs->hl;
+    state->shift_reg = regs->shift_reg;
+    state->a = regs->a;
+    state->f = regs->f;
+    state->intr = regs->intr;
+    state->pending_intr = regs->pending_intr;
+    state->shift_reg_offset = regs->shift_reg_offset;
+    state->error = I8080_OK;
+}
+
+int write_ram(struct cpu_mem_t *machine, unsigned short offset, const unsigned char *src, unsigned short len)
+{
+    struct state_t *state = (struct state_t *)machine->state;
+
+    if (offset + len > RAM_SIZE) {
+        return -1;
+    }
+
+#ifdef ENABLE_STATE_HASH
+    {
+        unsigned char *ram = state->ram;
+        unsigned int i;
+
+        for (i = offset; i < offset + len; ++i) {
+            if (ram[i] != src[i - offset]) {
+                state->ram_hash ^= byte_key(i, ram[i]) ^ byte_key(i, src[i - offset]);
+            }
+        }
+    }
+#endif
+
+    memcpy(state->ram + offset, src, len);
+
+    return 0;
+}
+
+static unsigned long long regs_hash(struct state_t *state, unsigned long long h)
+{
+    h ^= hash_mix(state->pc | ((unsigned long long)state->sp << 16) |
+                  ((unsigned long long)state->bc << 32) | ((unsigned long long)state->de << 48));
+    h ^= hash_mix((state->hl | ((unsigned long long)state->shift_reg << 16) |
+                   ((unsigned long long)state->a << 32) | ((unsigned long long)state->f << 40) |
+                   ((unsigned long long)state->intr << 48) | ((unsigned long long)state->pending_intr << 56)) ^
+                  hash_mix(state->shift_reg_offset + 1));
+    return hash_mix(h);
+}
+
+unsigned long long state_hash(struct cpu_mem_t *machine)
+{
+    struct state_t *state = (struct state_t *)machine->state;
+
+#ifdef ENABLE_STATE_HASH
+    return regs_hash(state, state->ram_hash);
+#else
+    return regs_hash(state, ram_hash_full(state));
+#endif
+}
+
+unsigned long long state_hash_full(struct cpu_mem_t *machine)
+{
+    struct state_t *state = (struct state_t *)machine->state;
+
+    return regs_hash(state, ram_hash_full(state));
+}
+
+void get_counters(struct cpu_mem_t *machine, unsigned long long *cycles, unsigned long long *instructions)
+{
+    struct state_t *state = (struct state_t *)machine->state;
+
+    *cycles = state->total_cycles;
+    *instructions = state->total_instructions;
+}
+
+/*
+ * The instrumented twin of the loop in execute(). Kept separate so that
+ * the plain loop stays exactly as cheap as it is without tracing.
+ */
+static void execute_traced(struct state_t *state, int cycles)
+{
+    struct cpu_regs_t before, after;
+    unsigned char code[3];
+    int cycle = 0;
+    int c;
+
     while (cycle < cycles) {
-        /*
-        if (state->pc == 0x0b8d) {
-            //++stop_count;
+        save_regs(state, &before);
+        // Through MEM_LOC, pc may be anywhere when the instruction faults
+        code[0] = MEM_LOC(state->pc);
+        code[1] = MEM_LOC((unsigned short)(state->pc + 1));
+        code[2] = MEM_LOC((unsigned short)(state->pc + 2));
+
+        c = step_one(state);
+        save_regs(state, &after);
+        if (state->error != I8080_OK) {
+            // The instruction that stopped the machine, with no cycles
+            trace_record(state->trace, &before, code, 0, &after, state->total_cycles);
+            break;
         }
+        cycle += c;
+
+        trace_record(state->trace, &before, code, c, &after, state->total_cycles);
+    }
+}
 
-        if (stop_count == 1) {
-            return -1;
+/* Same again for coverage, which only needs the address of each instruction */
+static void execute_covered(struct state_t *state, int cycles)
+{
+    int cycle = 0;
+
+    while (cycle < cycles) {
+        coverage_hit(state->coverage, state->pc);
+        cycle += step_one(state);
+    }
+}
+
+int execute(struct cpu_mem_t *machine, int cycles)
+{
+    int cycle = 0;
+    struct state_t *state = (struct state_t *)machine->state;
+
+    if (state->error != I8080_OK) {
+        return -1;
+    }
+
+    if (state->trace != NULL) {
+        execute_traced(state, cycles);
+    } else if (state->coverage != NULL) {
+        execute_covered(state, cycles);
+    } else if (state->engine == ENGINE_TABLE) {
+        while (cycle < cycles) {
+            cycle += execute_one_table(state);
+        }
+    } else {
+        while (cycle < cycles) {
+            /*
+            if (state->pc == 0x0b8d) {
+                //++stop_count;
+            }
+
+            if (stop_count == 1) {
+                return -1;
+            }
+            */
+
+            cycle += execute_one(state);
         }
-        */
+    }
+
+    return state->error != I8080_OK ? -1 : 0;
+}
+
+void set_coverage(struct cpu_mem_t *machine, struct coverage_t *cov)
+{
+    ((struct state_t *)machine->state)->coverage = cov;
+}
+
+int step(struct cpu_mem_t *machine)
+{
+    struct state_t *state = (struct state_t *)machine->state;
+    int cycle;
+
+    if (state->error != I8080_OK) {
+        return -1;
+    }
+
+    cycle = step_one(state);
+
+    return state->error != I8080_OK ? -1 : cycle;
+}
+
+int machine_error(struct cpu_mem_t *machine)
+{
+    return ((struct state_t *)machine->state)->error;
+}
+
+const char *machine_error_name(int error)
+{
+    switch (error) {
+        case I8080_OK:
+            return "running";
+        case I8080_HALTED:
+            return "halted";
+        case I8080_BAD_OPCODE:
+            return "unsupported opcode";
+        case I8080_PC_OUT_OF_ROM:
+            return "pc out of ROM";
+        case I8080_ROM_WRITE:
+            return "store to ROM";
+        default:
+            return "unknown error";
+    }
+}
+
+int set_engine(struct cpu_mem_t *machine, int engine)
+{
+    struct state_t *state = (struct state_t *)machine->state;
 
-        cycle += execute_one(state);
+    if (engine != ENGINE_REFERENCE && engine != ENGINE_TABLE) {
+        return -1;
     }
 
+    state->engine = engine;
+
     return 0;
 }
+
+int engine_from_name(const char *name)
+{
+    if (strcmp(name, "reference") == 0) {
+        return ENGINE_REFERENCE;
+    }
+    if (strcmp(name, "table") == 0) {
+        return ENGINE_TABLE;
+    }
+
+    return -1;
+}
+
+int enable_trace(struct cpu_mem_t *machine, int size_kb, const char *dump_path)
+{
+    struct state_t *state = (struct state_t *)machine->state;
+
+    disable_trace(machine);
+
+    state->trace = trace_create(size_kb, dump_path);
+    if (state->trace == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void disable_trace(struct cpu_mem_t *machine)
+{
+    struct state_t *state = (struct state_t *)machine->state;
+
+    if (state->trace != NULL) {
+        trace_free(state->trace);
+        state->trace = NULL;
+    }
+}
+
+int dump_trace(struct cpu_mem_t *machine, const char *path)
+{
+    struct state_t *state = (struct state_t *)machine->state;
+
+    if (state->trace == NULL) {
+        return -1;
+    }
+
+    return trace_write(state->trace, path);
+}
+
+int dump_stats(struct cpu_mem_t *machine, const char *path)
+{
+#ifdef ENABLE_STATS
+    struct state_t *state = (struct state_t *)machine->state;
+
+    return write_stats(&state->stats, path);
+#else
+    printf("Statistics are not compiled in, rebuild with STATS=1\n");
+    return -1;
+#endif
+}
@@ -1,8 +1,29 @@
+#ifndef I8080E_H
+#define I8080E_H
+
+#include <stddef.h>
+
+/* Writable memory, the ROM sits below it */
+#define RAM_ADDRESS (0x2000)
+#define RAM_SIZE    (0x2000)
+/* The largest program */
+#define ROM_SIZE    (0x2000)
+
+/*
+ * The program is loaded once per process and shared read-only by every
+ * machine running it, a machine only owns its registers and RAM.
+ */
 struct cpu_mem_t {
-    unsigned char *mem;
+    // RAM_SIZE bytes, seen by the CPU from RAM_ADDRESS up
+    unsigned char *ram;
+    // The program, from address 0
+    const unsigned char *rom;
     void *state;
 };
 
+/* Pointer into the RAM of a machine for an address from RAM_ADDRESS up */
+#define MACHINE_RAM(machine, address) ((machine)->ram + ((address) - RAM_ADDRESS))
+
 struct keyboard_t {
     unsigned char coin;
     unsigned char p1_start;
@@ -15,10 +36,138 @@ struct keyboard_t {
     unsigned char p2_right;
 };
 
+struct cpu_regs_t {
+    unsigned short pc;
+    unsigned short sp;
+    unsigned short bc;
+    unsigned short de;
+    unsigned short hl;
+    unsigned short shift_reg;
+    unsigned char a;
+    unsigned char f;
+    unsigned char intr;
+    unsigned char pending_intr;
+    unsigned char shift_reg_offset;
+};
+
+/* Instruction engines, see set_engine() */
+#define ENGINE_REFERENCE (0)
+#define ENGINE_TABLE     (1)
+
+/*
+ * Why a machine stopped, see machine_error(). The core never exits the
+ * process: a machine that stops just returns -1 from execute() and
+ * step(), with pc on the instruction that stopped it, until set_regs()
+ * (or loading a state) puts it somewhere else. A store into the ROM is
+ * dropped and stops the machine with I8080_ROM_WRITE; what the
+ * instruction changed before the store, like sp for a push, stays.
+ */
+#define I8080_OK            (0)
+#define I8080_HALTED        (1)
+#define I8080_BAD_OPCODE    (2)
+#define I8080_PC_OUT_OF_ROM (3)
+#define I8080_ROM_WRITE     (4)
+
+/* Returns NULL if the ROM can't be read or is too big, or out of memory */
 struct cpu_mem_t *init_machine(const char *bin_name, struct keyboard_t *keyboard);
 
+/*
+ * Reads the program in bin_name into buffer, which has room for ROM_SIZE
+ * bytes. Returns its size, -1 if it can't be read or is too big.
+ */
+long load_program(const char *bin_name, unsigned char *buffer);
+
+/* Same as init_machine() with the program already in memory */
+struct cpu_mem_t *init_machine_rom(const unsigned char *rom, long size, struct keyboard_t *keyboard);
+
 void deinit_machine(struct cpu_mem_t *machine);
 
+/* Bytes of memory a machine has to itself, the shared program not counted */
+size_t machine_footprint();
+
+/*
+ * For allocators that keep machines in memory of their own (see arena.h).
+ * place_machine() builds a machine running the same program as like in
+ * the machine_footprint() bytes at memory, aligned to MACHINE_ALIGN, and
+ * allocates nothing. Such a machine is given up with release_machine(),
+ * which leaves the memory to the caller, instead of deinit_machine().
+ */
+#define MACHINE_ALIGN (64)
+
+struct cpu_mem_t *place_machine(void *memory, const struct cpu_mem_t *like, struct keyboard_t *keyboard);
+
+void release_machine(struct cpu_mem_t *machine);
+
+/* Back to how init_machine() left it, keys read from keyboard from now on */
+void reset_machine(struct cpu_mem_t *machine, struct keyboard_t *keyboard);
+
 void generate_intr(struct cpu_mem_t *machine, int intr_num);
 
+/* Returns -1 if the machine stopped */
 int execute(struct cpu_mem_t *machine, int cycles);
+
+/* Executes exactly one instruction and returns its cycles, -1 if the machine stopped */
+int step(struct cpu_mem_t *machine);
+
+int machine_error(struct cpu_mem_t *machine);
+
+const char *machine_error_name(int error);
+
+/*
+ * ENGINE_REFERENCE is the plain decoder in execute_one(), ENGINE_TABLE
+ * dispatches through a per-opcode handler table. Both must behave the
+ * same, lockstep checks that they do.
+ */
+int set_engine(struct cpu_mem_t *machine, int engine);
+
+/* "reference" or "table", -1 for anything else */
+int engine_from_name(const char *name);
+
+void get_regs(struct cpu_mem_t *machine, struct cpu_regs_t *regs);
+
+/* Also restarts a stopped machine */
+void set_regs(struct cpu_mem_t *machine, const struct cpu_regs_t *regs);
+
+/*
+ * Copies len bytes into RAM at RAM_ADDRESS + offset. Anything that
+ * rewrites RAM from outside the core (state loads, rewinds) goes through
+ * here. Returns -1 if that is past the end of RAM.
+ */
+int write_ram(struct cpu_mem_t *machine, unsigned short offset, const unsigned char *src, unsigned short len);
+
+/* Cycles and instructions executed since init_machine() */
+void get_counters(struct cpu_mem_t *machine, unsigned long long *cycles, unsigned long long *instructions);
+
+/*
+ * Switches the machine to the instrumented core, which records every
+ * instruction into a ring of size_kb KB (see trace.h). If dump_path is
+ * given the ring is also written there on a crash or ABORT.
+ */
+int enable_trace(struct cpu_mem_t *machine, int size_kb, const char *dump_path);
+
+void disable_trace(struct cpu_mem_t *machine);
+
+int dump_trace(struct cpu_mem_t *machine, const char *path);
+
+/*
+ * Records the code coverage of everything executed from now on into cov
+ * (see coverage.h), until it is set back to NULL. Tracing takes priority.
+ */
+struct coverage_t;
+
+void set_coverage(struct cpu_mem_t *machine, struct coverage_t *cov);
+
+/*
+ * Hash of the registers and RAM. A core built with ENABLE_STATE_HASH keeps
+ * the RAM part up to date on every store, which makes this O(1); without
+ * it the same value is computed from all of RAM. state_hash_full() always
+ * recomputes, to check the incremental one against.
+ */
+unsigned long long state_hash(struct cpu_mem_t *machine);
+
+unsigned long long state_hash_full(struct cpu_mem_t *machine);
+
+/* Only does something in a core built with ENABLE_STATS, see stats.h */
+int dump_stats(struct cpu_mem_t *machine, const char *path);
+
+#endif
@@ -0,0 +1,143 @@
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+/* The default huge page size on x86-64, what both kinds get mapped in */
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+struct arena_t {
+    const struct cpu_mem_t *like;
+    unsigned char *base;
+    size_t size;
+    size_t stride;
+    int pages;
+    int capacity;
+    // Records [0, built) hold a machine, the others were never touched
+    int built;
+    struct cpu_mem_t **machines;
+    // Machines put back, handed out again last in first out
+    struct cpu_mem_t **free;
+    int nfree;
+};
+
+/*
+ * size bytes starting on a huge page boundary. Only reserves the address
+ * space for anything but explicit huge pages, which the kernel has to
+ * find up front and otherwise makes mmap() fail.
+ */
+static unsigned char *map_records(size_t size, int *pages)
+{
+    unsigned char *p, *start;
+    size_t head;
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        *pages = ARENA_HUGETLB;
+        return p;
+    }
+
+    // Over map by a huge page and trim, so the records start on one
+    p = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+             -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    start = (unsigned char *)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    head = start - p;
+    if (head > 0) {
+        munmap(p, head);
+    }
+    munmap(start + size, HUGE_PAGE_SIZE - head);
+
+    *pages = madvise(start, size, MADV_HUGEPAGE) == 0 ? ARENA_TRANSPARENT : ARENA_SMALL_PAGES;
+    return start;
+}
+
+struct arena_t *arena_create(const struct cpu_mem_t *like, int capacity)
+{
+    struct arena_t *arena;
+
+    if (capacity < 1) {
+        return NULL;
+    }
+
+    arena = calloc(1, sizeof(*arena));
+    if (arena == NULL) {
+        return NULL;
+    }
+    arena->like = like;
+    arena->capacity = capacity;
+    arena->stride = (machine_footprint() + MACHINE_ALIGN - 1) & ~(size_t)(MACHINE_ALIGN - 1);
+    arena->size = (arena->stride * capacity + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    arena->machines = malloc(capacity * sizeof(*arena->machines));
+    arena->free = malloc(capacity * sizeof(*arena->free));
+    arena->base = map_records(arena->size, &arena->pages);
+    if (arena->machines == NULL || arena->free == NULL || arena->base == NULL) {
+        if (arena->base != NULL) {
+            munmap(arena->base, arena->size);
+        }
+        free(arena->machines);
+        free(arena->free);
+        free(arena);
+        return NULL;
+    }
+
+    return arena;
+}
+
+void arena_free(struct arena_t *arena)
+{
+    int i;
+
+    for (i = 0; i < arena->built; ++i) {
+        release_machine(arena->machines[i]);
+    }
+    munmap(arena->base, arena->size);
+    free(arena->machines);
+    free(arena->free);
+    free(arena);
+}
+
+struct cpu_mem_t *arena_get(struct arena_t *arena, struct keyboard_t *keyboard)
+{
+    struct cpu_mem_t *machine;
+
+    if (arena->nfree > 0) {
+        machine = arena->free[--arena->nfree];
+        reset_machine(machine, keyboard);
+        return machine;
+    }
+    if (arena->built == arena->capacity) {
+        return NULL;
+    }
+
+    // The first write to the record, which decides where its pages live
+    machine = place_machine(arena->base + arena->built * arena->stride, arena->like, keyboard);
+    arena->machines[arena->built++] = machine;
+
+    return machine;
+}
+
+void arena_put(struct arena_t *arena, struct cpu_mem_t *machine)
+{
+    arena->free[arena->nfree++] = machine;
+}
+
+int arena_pages(const struct arena_t *arena)
+{
+    return arena->pages;
+}
+
+const char *arena_pages_name(int pages)
+{
+    switch (pages) {
+        case ARENA_HUGETLB:
+            return "explicit huge pages";
+        case ARENA_TRANSPARENT:
+            return "transparent huge pages";
+        default:
+            return "small pages";
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "8080e.h"
+
+/*
+ * Fixed size pool of machines that all run one program. The records,
+ * registers and RAM of one machine each, sit back to back at cache line
+ * alignment in one mapping of huge pages: explicit ones if the system has
+ * some reserved, else transparent ones asked for with madvise(). Many
+ * machines so share few TLB entries.
+ *
+ * Nothing is written to a record before arena_get() first hands it out,
+ * so its pages land on the NUMA node of the thread that gets it. Give
+ * every worker thread an arena of its own and take the machines it steps
+ * from there. An arena is not safe to use from several threads at once.
+ *
+ * arena_get() and arena_put() are O(1) and allocate nothing: a machine
+ * that is put back is only reset to power on when it is handed out again.
+ */
+#define ARENA_SMALL_PAGES (0)
+#define ARENA_TRANSPARENT (1)
+#define ARENA_HUGETLB     (2)
+
+struct arena_t;
+
+/*
+ * Room for capacity machines running the program of like, which has to
+ * outlive the arena. Returns NULL if out of memory.
+ */
+struct arena_t *arena_create(const struct cpu_mem_t *like, int capacity);
+
+/* Releases every machine of the arena, whether it was put back or not */
+void arena_free(struct arena_t *arena);
+
+/* A machine at power on reading its keys from keyboard, NULL if all are out */
+struct cpu_mem_t *arena_get(struct arena_t *arena, struct keyboard_t *keyboard);
+
+void arena_put(struct arena_t *arena, struct cpu_mem_t *machine);
+
+/* One of ARENA_SMALL_PAGES, ARENA_TRANSPARENT and ARENA_HUGETLB */
+int arena_pages(const struct arena_t *arena);
+
+const char *arena_pages_name(int pages);
+
+#endif
@@ -0,0 +1,573 @@
+#include "8080e.h"
+#include "arena.h"
+#include "env.h"
+#include "gamefeatures.h"
+#include "frame.h"
+#include "input.h"
+#include "preprocess.h"
+#include "render.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Throughput benchmark. Runs the ROM headless with the canned demo input
+ * and a set of small synthetic programs, one per instruction class,
+ * writes the numbers as flat JSON and compares them against a baseline
+ * file written the same way.
+ */
+#define DEFAULT_FRAMES (6000)
+#define MICRO_CYCLES (20000000)
+#define MICRO_REPEAT (32)
+#define MAX_RESULTS (64)
+#define DEFAULT_ENVS (16)
+#define ENV_FRAMESKIP (4)
+#define PREPROCESS_FRAMES (600)
+#define PREPROCESS_REPEAT (5000)
+#define FEATURES_REPEAT (1000)
+#define FOOTPRINT_MACHINES (1024)
+#define CHURN_REPEAT (100000)
+
+struct options_t {
+    const char *bin_name;
+    const char *out_path;
+    const char *baseline_path;
+    int frames;
+    float tolerance;
+    int engine;
+    int envs;
+};
+
+struct result_t {
+    char name[64];
+    double value;
+    int higher_is_better;
+};
+
+/*
+ * Synthetic programs. body is repeated MICRO_REPEAT times after setup and
+ * followed by a jump back to the first copy. Programs with repeat == 0
+ * are complete and loop on their own.
+ */
+struct micro_t {
+    const char *name;
+    unsigned char setup[16];
+    int setup_len;
+    unsigned char body[32];
+    int body_len;
+    int repeat;
+};
+
+static const struct micro_t micros[] = {
+    { "mov", { 0 }, 0,
+      { 0x41, 0x4A, 0x53, 0x5C, 0x65, 0x6F, 0x78 }, 7, 1 },
+    { "alu", { 0 }, 0,
+      { 0x80, 0x89, 0x92, 0x9B, 0xA4, 0xAD, 0xB0, 0xB9, 0x3C, 0x05 }, 10, 1 },
+    { "immediate", { 0 }, 0,
+      { 0x3E, 0x12, 0xC6, 0x03, 0xD6, 0x01, 0xE6, 0x7F, 0xF6, 0x01, 0xFE, 0x05, 0xDE, 0x01 }, 14, 1 },
+    { "memory", { 0x21, 0x00, 0x21, 0x11, 0x00, 0x22 }, 6,
+      { 0x7E, 0x77, 0x1A, 0x12, 0x3A, 0x00, 0x23, 0x32, 0x01, 0x23,
+        0x22, 0x02, 0x23, 0x2A, 0x02, 0x23, 0x36, 0x05, 0x34 }, 19, 1 },
+    { "stack", { 0 }, 0,
+      { 0xC5, 0xD5, 0xE5, 0xF5, 0xF1, 0xE1, 0xD1, 0xC1, 0xE3, 0xE3 }, 10, 1 },
+    { "16bit", { 0 }, 0,
+      { 0x03, 0x1B, 0x09, 0x29, 0x23, 0x01, 0x34, 0x12, 0xEB, 0xEB }, 10, 1 },
+    // xra a; l: jnz 0; jz m; m: call s; cnz 0; jmp l; s: rnz; rz
+    { "branch", { 0 }, 0,
+      { 0xAF, 0xC2, 0x00, 0x00, 0xCA, 0x07, 0x00, 0xCD, 0x10, 0x00,
+        0xC4, 0x00, 0x00, 0xC3, 0x01, 0x00, 0xC0, 0xC8 }, 18, 0 },
+};
+
+static struct options_t options;
+static struct result_t results[MAX_RESULTS];
+static int nresults;
+static struct keyboard_t keyboard;
+static unsigned char rgb[RGB_SIZE];
+static unsigned long long render_ns;
+
+static unsigned long long get_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage()
+{
+    printf("Usage: spacebench [-f FRAMES] [-o RESULT FILE] [-b BASELINE FILE] [-t TOLERANCE %%] [-e ENGINE] [-n ENVS] <ROM FILE>\n");
+}
+
+static void parse_options(int argc, char **argv)
+{
+    int opt;
+
+    options.frames = DEFAULT_FRAMES;
+    options.tolerance = -1.0f;
+    options.envs = DEFAULT_ENVS;
+
+    while ((opt = getopt(argc, argv, "f:o:b:t:e:n:")) != -1) {
+        switch (opt) {
+            case 'f':
+                options.frames = atoi(optarg);
+                break;
+            case 'o':
+                options.out_path = optarg;
+                break;
+            case 'b':
+                options.baseline_path = optarg;
+                break;
+            case 't':
+                options.tolerance = atof(optarg);
+                break;
+            case 'e':
+                options.engine = engine_from_name(optarg);
+                break;
+            case 'n':
+                options.envs = atoi(optarg);
+                break;
+            default:
+                usage();
+                ABORT(("Invalid options.\n"));
+        }
+    }
+
+    if (optind >= argc || options.frames <= 0 || options.engine < 0) {
+        usage();
+        ABORT(("Invalid options.\n"));
+    }
+
+    options.bin_name = argv[optind];
+}
+
+static void add_result(const char *name, double value, int higher_is_better)
+{
+    if (nresults == MAX_RESULTS) {
+        ABORT(("too many results\n"));
+    }
+
+    snprintf(results[nresults].name, sizeof(results[nresults].name), "%s", name);
+    results[nresults].value = value;
+    results[nresults].higher_is_better = higher_is_better;
+    ++nresults;
+}
+
+static void render_frame(void *arg)
+{
+    struct cpu_mem_t *machine = arg;
+    unsigned long long then = get_ns();
+
+    render_rgb(MACHINE_RAM(machine, DISPLAY_ADDRESS), rgb);
+    render_ns += get_ns() - then;
+}
+
+static void bench_system()
+{
+    struct cpu_mem_t *machine;
+    unsigned long long then, total_ns, cycles, instructions;
+    double emu_ns;
+    int frame;
+
+    machine = init_machine(options.bin_name, &keyboard);
+    if (machine == NULL) {
+        ABORT(("can't load the program\n"));
+    }
+    set_engine(machine, options.engine);
+
+    then = get_ns();
+    for (frame = 0; frame < options.frames; ++frame) {
+        mask_to_keyboard(demo_keys(frame), &keyboard);
+        if (run_frame(machine, render_frame, machine) == -1) {
+            ABORT(("machine stopped at frame %d\n", frame));
+        }
+    }
+    total_ns = get_ns() - then;
+
+    get_counters(machine, &cycles, &instructions);
+    emu_ns = (double)(total_ns - render_ns);
+
+    add_result("system.emulated_mhz", cycles / emu_ns * 1000.0, 1);
+    add_result("system.ns_per_instruction", emu_ns / instructions, 0);
+    add_result("system.ns_per_frame_emulation", emu_ns / options.frames, 0);
+    add_result("system.ns_per_frame_render", (double)render_ns / options.frames, 0);
+    add_result("system.speed_vs_real_time", (double)options.frames * NS_PER_FRAME / total_ns, 1);
+
+    deinit_machine(machine);
+}
+
+static void bench_micro(const struct micro_t *micro)
+{
+    unsigned char program[1024];
+    struct cpu_mem_t *machine;
+    unsigned long long then, ns, cycles, instructions;
+    char name[64];
+    int len, i;
+
+    memcpy(program, micro->setup, micro->setup_len);
+    len = micro->setup_len;
+
+    if (micro->repeat) {
+        for (i = 0; i < MICRO_REPEAT; ++i) {
+            memcpy(program + len, micro->body, micro->body_len);
+            len += micro->body_len;
+        }
+        program[len++] = 0xC3;
+        program[len++] = micro->setup_len & 0xFF;
+        program[len++] = micro->setup_len >> 8;
+    } else {
+        memcpy(program + len, micro->body, micro->body_len);
+        len += micro->body_len;
+    }
+
+    machine = init_machine_rom(program, len, &keyboard);
+    if (machine == NULL) {
+        ABORT(("can't load the program\n"));
+    }
+    set_engine(machine, options.engine);
+
+    then = get_ns();
+    if (execute(machine, MICRO_CYCLES) == -1) {
+        ABORT(("micro %s stopped: %s\n", micro->name, machine_error_name(machine_error(machine))));
+    }
+    ns = get_ns() - then;
+
+    get_counters(machine, &cycles, &instructions);
+
+    snprintf(name, sizeof(name), "micro.%s.ns_per_instruction", micro->name);
+    add_result(name, (double)ns / instructions, 0);
+    snprintf(name, sizeof(name), "micro.%s.emulated_mhz", micro->name);
+    add_result(name, (double)cycles / ns * 1000.0, 1);
+
+    deinit_machine(machine);
+}
+
+/*
+ * Machines going away and new ones coming, like sessions of the server:
+ * from the heap with init_machine_rom() and deinit_machine(), against
+ * recycling them in an arena.
+ */
+static void bench_churn(struct cpu_mem_t *like)
+{
+    struct keyboard_t churn_keyboard;
+    struct cpu_mem_t *machine;
+    struct arena_t *arena;
+    unsigned char rom[ROM_SIZE];
+    unsigned long long then, ns;
+    long rom_size;
+    int i;
+
+    // The program as loaded, so every machine shares the ROM of like
+    rom_size = load_program(options.bin_name, rom);
+    if (rom_size <= 0) {
+        ABORT(("can't load the program\n"));
+    }
+
+    then = get_ns();
+    for (i = 0; i < CHURN_REPEAT; ++i) {
+        machine = init_machine_rom(rom, rom_size, &churn_keyboard);
+        if (machine == NULL) {
+            ABORT(("OOM\n"));
+        }
+        deinit_machine(machine);
+    }
+    ns = get_ns() - then;
+    add_result("churn.ns_per_init_deinit", (double)ns / CHURN_REPEAT, 0);
+
+    arena = arena_create(like, 1);
+    if (arena == NULL) {
+        ABORT(("OOM\n"));
+    }
+    then = get_ns();
+    for (i = 0; i < CHURN_REPEAT; ++i) {
+        arena_put(arena, arena_get(arena, &churn_keyboard));
+    }
+    ns = get_ns() - then;
+    add_result("churn.ns_per_arena_get_put", (double)ns / CHURN_REPEAT, 0);
+    arena_free(arena);
+}
+
+/* Resident memory of the process in bytes, 0 if it can't be told */
+static size_t resident_bytes()
+{
+    FILE *in = fopen("/proc/self/statm", "r");
+    unsigned long size, resident;
+
+    if (in == NULL) {
+        return 0;
+    }
+    if (fscanf(in, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(in);
+
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * What a machine costs in memory, as the core accounts it and as the
+ * resident set grows with FOOTPRINT_MACHINES of them running the same
+ * program, which they share. Then the same in an arena, which rounds up
+ * to whole huge pages.
+ */
+static void bench_footprint()
+{
+    struct cpu_mem_t **machines;
+    struct keyboard_t *keyboards;
+    struct arena_t *arena;
+    size_t before, after;
+    int i;
+
+    machines = malloc(FOOTPRINT_MACHINES * sizeof(*machines));
+    keyboards = malloc(FOOTPRINT_MACHINES * sizeof(*keyboards));
+    if (machines == NULL || keyboards == NULL) {
+        ABORT(("OOM\n"));
+    }
+
+    before = resident_bytes();
+    for (i = 0; i < FOOTPRINT_MACHINES; ++i) {
+        machines[i] = init_machine(options.bin_name, &keyboards[i]);
+        if (machines[i] == NULL) {
+            ABORT(("can't load the program\n"));
+        }
+    }
+    after = resident_bytes();
+
+    add_result("footprint.bytes_per_machine", machine_footprint(), 0);
+    if (before != 0 && after > before) {
+        add_result("footprint.resident_bytes_per_machine", (double)(after - before) / FOOTPRINT_MACHINES, 0);
+    }
+
+    arena = arena_create(machines[0], FOOTPRINT_MACHINES);
+    if (arena == NULL) {
+        ABORT(("OOM\n"));
+    }
+    before = resident_bytes();
+    for (i = 0; i < FOOTPRINT_MACHINES; ++i) {
+        arena_get(arena, &keyboards[i]);
+    }
+    after = resident_bytes();
+    if (before != 0 && after > before) {
+        add_result("footprint.arena_resident_bytes_per_machine", (double)(after - before) / FOOTPRINT_MACHINES, 0);
+    }
+    arena_free(arena);
+
+    for (i = 1; i < FOOTPRINT_MACHINES; ++i) {
+        deinit_machine(machines[i]);
+    }
+    bench_churn(machines[0]);
+    deinit_machine(machines[0]);
+    free(machines);
+    free(keyboards);
+}
+
+/* 84x84x4 observations from two consecutive in-game frames */
+static void bench_preprocess()
+{
+    struct cpu_mem_t *machine;
+    struct preprocess_t *pp;
+    unsigned char prev[DISPLAY_SIZE], *ring;
+    unsigned long long then, ns;
+    int frame;
+
+    machine = init_machine(options.bin_name, &keyboard);
+    if (machine == NULL) {
+        ABORT(("can't load the program\n"));
+    }
+    for (frame = 0; frame < PREPROCESS_FRAMES; ++frame) {
+        mask_to_keyboard(demo_keys(frame), &keyboard);
+        memcpy(prev, MACHINE_RAM(machine, DISPLAY_ADDRESS), DISPLAY_SIZE);
+        run_frame(machine, NULL, NULL);
+    }
+
+    pp = preprocess_create(84, 84, 4);
+    ring = malloc(preprocess_ring_size(pp));
+    if (ring == NULL) {
+        ABORT(("OOM\n"));
+    }
+
+    then = get_ns();
+    for (frame = 0; frame < PREPROCESS_REPEAT; ++frame) {
+        preprocess_frame(pp, MACHINE_RAM(machine, DISPLAY_ADDRESS), prev, ring, frame);
+    }
+    ns = get_ns() - then;
+
+    add_result("preprocess.us_per_frame", (double)ns / 1e3 / PREPROCESS_REPEAT, 0);
+
+    free(ring);
+    preprocess_free(pp);
+    deinit_machine(machine);
+}
+
+/* The batched RL environment stepping options.frames frames in total */
+static void bench_env()
+{
+    struct env_batch_t *batch;
+    unsigned char *obs, *done;
+    float *reward, *features;
+    int *actions;
+    unsigned long long then, ns;
+    int steps, step, i;
+
+    batch = env_batch_create(options.bin_name, options.envs, 0);
+    obs = malloc((size_t)options.envs * ENV_OBS_SIZE);
+    reward = malloc(options.envs * sizeof(*reward));
+    done = malloc(options.envs);
+    actions = malloc(options.envs * sizeof(*actions));
+    features = malloc(options.envs * FEATURES_COLUMNS * sizeof(*features));
+    if (batch == NULL || obs == NULL || reward == NULL || done == NULL || actions == NULL || features == NULL) {
+        ABORT(("OOM\n"));
+    }
+
+    env_batch_reset(batch, obs);
+
+    steps = options.frames / ENV_FRAMESKIP / options.envs + 1;
+    srand(1);
+
+    then = get_ns();
+    for (step = 0; step < steps; ++step) {
+        for (i = 0; i < options.envs; ++i) {
+            actions[i] = rand() % ENV_ACTIONS;
+        }
+        if (env_batch_step(batch, actions, ENV_FRAMESKIP, obs, reward, done) != 0) {
+            ABORT(("env step failed\n"));
+        }
+    }
+    ns = get_ns() - then;
+
+    add_result("env.frames_per_second", (double)steps * options.envs * ENV_FRAMESKIP / (ns / 1e9), 1);
+    add_result("env.us_per_step", (double)ns / 1e3 / steps, 0);
+
+    then = get_ns();
+    for (step = 0; step < FEATURES_REPEAT; ++step) {
+        if (env_batch_features(batch, features) != 0) {
+            ABORT(("no feature layout for this ROM\n"));
+        }
+    }
+    ns = get_ns() - then;
+
+    add_result("env.features_us_per_env", (double)ns / 1e3 / FEATURES_REPEAT / options.envs, 0);
+
+    env_batch_free(batch);
+    free(obs);
+    free(reward);
+    free(done);
+    free(actions);
+    free(features);
+}
+
+static void write_results(FILE *out)
+{
+    int i;
+
+    fprintf(out, "{\n");
+    for (i = 0; i < nresults; ++i) {
+        fprintf(out, "  \"%s\": %.3f%s\n", results[i].name, results[i].value, (i + 1 < nresults) ? "," : "");
+    }
+    fprintf(out, "}\n");
+}
+
+static int find_baseline(FILE *in, const char *name, double *value)
+{
+    char line[256], key[64];
+    double v;
+
+    rewind(in);
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (sscanf(line, " \"%63[^\"]\": %lf", key, &v) == 2 && strcmp(key, name) == 0) {
+            *value = v;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Returns the number of metrics that regressed by more than the tolerance. */
+static int compare_baseline()
+{
+    FILE *in;
+    int i, regressions = 0;
+
+    in = fopen(options.baseline_path, "r");
+    if (in == NULL) {
+        perror("fopen() failed");
+        return 0;
+    }
+
+    printf("\n%-40s %12s %12s %8s\n", "metric", "baseline", "current", "change");
+    for (i = 0; i < nresults; ++i) {
+        double base, change;
+
+        if (find_baseline(in, results[i].name, &base) != 0 || base == 0.0) {
+            printf("%-40s %12s %12.3f\n", results[i].name, "-", results[i].value);
+            continue;
+        }
+
+        // Positive is better
+        change = (results[i].value - base) / base * 100.0;
+        if (!results[i].higher_is_better) {
+            change = -change;
+        }
+
+        printf("%-40s %12.3f %12.3f %+7.1f%%", results[i].name, base, results[i].value, change);
+        if (options.tolerance >= 0.0f && change < -options.tolerance) {
+            printf("  REGRESSION");
+            ++regressions;
+        }
+        printf("\n");
+    }
+
+    fclose(in);
+
+    return regressions;
+}
+
+int main(int argc, char **argv)
+{
+    struct rusage usage;
+    FILE *out;
+    int i;
+
+    parse_options(argc, argv);
+
+    bench_system();
+
+    for (i = 0; i < sizeof(micros) / sizeof(micros[0]); ++i) {
+        bench_micro(&micros[i]);
+    }
+
+    bench_preprocess();
+
+    if (options.envs > 0) {
+        bench_env();
+    }
+
+    getrusage(RUSAGE_SELF, &usage);
+    add_result("peak_rss_kb", usage.ru_maxrss, 0);
+
+    // After peak_rss_kb, which would otherwise count all these machines
+    bench_footprint();
+
+    write_results(stdout);
+
+    if (options.out_path != NULL) {
+        out = fopen(options.out_path, "w");
+        if (out == NULL) {
+            perror("fopen() failed");
+            return 1;
+        }
+        write_results(out);
+        fclose(out);
+    }
+
+    if (options.baseline_path != NULL && compare_baseline() > 0) {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,307 @@
+#include "bus.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NAME_SIZE (256)
+
+struct bus_t {
+    char name[NAME_SIZE];
+    struct bus_header_t *header;
+    struct bus_frame_t *slots;
+    size_t size;
+};
+
+struct bus_client_t {
+    const struct bus_header_t *header;
+    const struct bus_frame_t *slots;
+    size_t size;
+    // The frame returned last and the one bus_next() looks for
+    unsigned long long current;
+    unsigned long long next;
+    unsigned long long dropped;
+};
+
+/* shm_open() wants exactly one leading slash */
+static void shm_name(char *out, const char *name)
+{
+    snprintf(out, NAME_SIZE, "/%s", name[0] == '/' ? name + 1 : name);
+}
+
+static size_t ring_size(int slots)
+{
+    return sizeof(struct bus_header_t) + (size_t)slots * sizeof(struct bus_frame_t);
+}
+
+/*
+ * Whether the ring at path was left by a publisher that is gone. Anything
+ * else there, a ring of a live one or not a ring at all, is not ours.
+ */
+static int ring_stale(const char *path)
+{
+    const struct bus_header_t *header;
+    struct stat st;
+    int fd, stale = 0;
+
+    fd = shm_open(path, O_RDONLY, 0);
+    if (fd == -1) {
+        // Gone already
+        return errno == ENOENT;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(*header)) {
+        close(fd);
+        return 0;
+    }
+    header = mmap(NULL, sizeof(*header), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        return 0;
+    }
+
+    if (memcmp(header->magic, BUS_MAGIC, 4) == 0 && header->version == BUS_VERSION) {
+        stale = kill(header->publisher, 0) == -1 && errno == ESRCH;
+    }
+    munmap((void *)header, sizeof(*header));
+
+    return stale;
+}
+
+struct bus_t *bus_create(const char *name, int slots, unsigned long long rom_hash)
+{
+    struct bus_t *bus;
+    void *p;
+    int fd, replaced = 0;
+
+    if (slots < 2) {
+        return NULL;
+    }
+
+    bus = calloc(1, sizeof(*bus));
+    if (bus == NULL) {
+        return NULL;
+    }
+    shm_name(bus->name, name);
+    bus->size = ring_size(slots);
+
+    // A new object, so clients of a dead publisher don't see it reused
+    while ((fd = shm_open(bus->name, O_CREAT | O_EXCL | O_RDWR, 0600)) == -1) {
+        if (errno != EEXIST) {
+            perror("shm_open() failed");
+            free(bus);
+            return NULL;
+        }
+        if (replaced || !ring_stale(bus->name)) {
+            printf("%s is in use\n", bus->name);
+            free(bus);
+            return NULL;
+        }
+        shm_unlink(bus->name);
+        replaced = 1;
+    }
+    if (ftruncate(fd, bus->size) != 0) {
+        perror("ftruncate() failed");
+        close(fd);
+        shm_unlink(bus->name);
+        free(bus);
+        return NULL;
+    }
+    p = mmap(NULL, bus->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror("mmap() failed");
+        shm_unlink(bus->name);
+        free(bus);
+        return NULL;
+    }
+
+    bus->header = p;
+    bus->slots = (struct bus_frame_t *)(bus->header + 1);
+    bus->header->version = BUS_VERSION;
+    bus->header->slots = slots;
+    bus->header->slot_size = sizeof(struct bus_frame_t);
+    bus->header->rom_hash = rom_hash;
+    bus->header->publisher = getpid();
+    // Clients check the magic last
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(bus->header->magic, BUS_MAGIC, 4);
+
+    return bus;
+}
+
+void bus_publish(struct bus_t *bus, struct cpu_mem_t *machine)
+{
+    unsigned long long n = bus->header->head;
+    struct bus_frame_t *slot = &bus->slots[n % bus->header->slots];
+    struct timespec ts;
+
+    __atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    slot->frame = n;
+    slot->ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    get_counters(machine, &slot->cycles, &slot->instructions);
+    memcpy(slot->ram, machine->ram, RAM_SIZE);
+
+    __atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&bus->header->head, n + 1, __ATOMIC_RELEASE);
+}
+
+void bus_free(struct bus_t *bus)
+{
+    munmap(bus->header, bus->size);
+    shm_unlink(bus->name);
+    free(bus);
+}
+
+struct bus_client_t *bus_attach(const char *name)
+{
+    struct bus_client_t *client;
+    char path[NAME_SIZE];
+    struct stat st;
+    void *p;
+    int fd;
+
+    shm_name(path, name);
+    fd = shm_open(path, O_RDONLY, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(struct bus_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+
+    client = calloc(1, sizeof(*client));
+    if (client == NULL) {
+        munmap(p, st.st_size);
+        return NULL;
+    }
+    client->header = p;
+    client->slots = (const struct bus_frame_t *)(client->header + 1);
+    client->size = st.st_size;
+
+    if (memcmp(client->header->magic, BUS_MAGIC, 4) != 0) {
+        bus_detach(client);
+        return NULL;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (client->header->version != BUS_VERSION || client->header->slot_size != sizeof(struct bus_frame_t) ||
+        client->header->slots < 2 || ring_size(client->header->slots) > client->size) {
+        bus_detach(client);
+        return NULL;
+    }
+
+    // Starts with what is published from now on
+    client->next = __atomic_load_n(&client->header->head, __ATOMIC_ACQUIRE);
+
+    return client;
+}
+
+void bus_detach(struct bus_client_t *client)
+{
+    munmap((void *)client->header, client->size);
+    free(client);
+}
+
+/* Frame n if it is still in its slot */
+static const struct bus_frame_t *get_frame(struct bus_client_t *client, unsigned long long n)
+{
+    const struct bus_frame_t *slot = &client->slots[n % client->header->slots];
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != 2 * n + 2) {
+        return NULL;
+    }
+
+    client->current = n;
+    client->next = n + 1;
+    return slot;
+}
+
+const struct bus_frame_t *bus_next(struct bus_client_t *client)
+{
+    unsigned int slots = client->header->slots;
+
+    for (;;) {
+        unsigned long long head = __atomic_load_n(&client->header->head, __ATOMIC_ACQUIRE);
+        const struct bus_frame_t *frame;
+
+        if (client->next >= head) {
+            return NULL;
+        }
+        // The slot of frame head is the one being written next
+        if (head - client->next >= slots) {
+            client->dropped += head - slots + 1 - client->next;
+            client->next = head - slots + 1;
+        }
+
+        frame = get_frame(client, client->next);
+        if (frame != NULL) {
+            return frame;
+        }
+        ++client->dropped;
+        ++client->next;
+    }
+}
+
+const struct bus_frame_t *bus_latest(struct bus_client_t *client)
+{
+    for (;;) {
+        unsigned long long head = __atomic_load_n(&client->header->head, __ATOMIC_ACQUIRE);
+        const struct bus_frame_t *frame;
+
+        if (client->next >= head) {
+            return NULL;
+        }
+        client->dropped += head - 1 - client->next;
+        client->next = head - 1;
+
+        frame = get_frame(client, client->next);
+        if (frame != NULL) {
+            return frame;
+        }
+        ++client->dropped;
+        ++client->next;
+    }
+}
+
+int bus_valid(struct bus_client_t *client)
+{
+    const struct bus_frame_t *slot = &client->slots[client->current % client->header->slots];
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == 2 * client->current + 2) {
+        return 1;
+    }
+
+    ++client->dropped;
+    return 0;
+}
+
+unsigned long long bus_published(const struct bus_client_t *client)
+{
+    return __atomic_load_n(&client->header->head, __ATOMIC_ACQUIRE);
+}
+
+unsigned long long bus_dropped(const struct bus_client_t *client)
+{
+    return client->dropped;
+}
+
+unsigned long long bus_rom_hash(const struct bus_client_t *client)
+{
+    return client->header->rom_hash;
+}
@@ -0,0 +1,88 @@
+#ifndef BUS_H
+#define BUS_H
+
+#include "8080e.h"
+#include "frame.h"
+
+/*
+ * Publishes finished frames of a machine to other local processes
+ * through a POSIX shared memory ring. Each slot holds a RAM snapshot,
+ * which VRAM is part of, and the counters at the end of the frame.
+ *
+ * There is one publisher and at most one client per ring. Publishing
+ * never waits: it overwrites the oldest slot, guarded by a sequence
+ * number that is odd while the slot is written. Clients read slots in
+ * place and check the sequence afterwards, so a client that is too slow
+ * only sees frames counted as dropped.
+ */
+#define BUS_MAGIC "I8BS"
+#define BUS_VERSION (2)
+#define BUS_DEFAULT_SLOTS (8)
+
+struct bus_frame_t {
+    // 2n + 1 while frame n is written, 2n + 2 once it is complete
+    unsigned long long seq;
+    unsigned long long frame;
+    unsigned long long cycles;
+    unsigned long long instructions;
+    // CLOCK_MONOTONIC when the frame was published
+    unsigned long long ns;
+    unsigned char ram[RAM_SIZE] __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+#define BUS_VRAM(f) ((f)->ram + DISPLAY_ADDRESS - RAM_ADDRESS)
+
+struct bus_header_t {
+    char magic[4];
+    unsigned int version;
+    unsigned int slots;
+    unsigned int slot_size;
+    unsigned long long rom_hash;
+    // The process publishing, the ring can be replaced once it is gone
+    int publisher;
+    // Frames published so far
+    unsigned long long head __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct bus_t;
+struct bus_client_t;
+
+/*
+ * Creates /name, replacing a stale one whose publisher is gone. Returns
+ * NULL if it can't, or if a live publisher or some other object has it.
+ */
+struct bus_t *bus_create(const char *name, int slots, unsigned long long rom_hash);
+
+/* Copies the RAM and counters of machine into the next slot */
+void bus_publish(struct bus_t *bus, struct cpu_mem_t *machine);
+
+/* Removes the ring, clients that are attached keep their mapping */
+void bus_free(struct bus_t *bus);
+
+/* Maps an existing ring read-only, NULL if there is none */
+struct bus_client_t *bus_attach(const char *name);
+
+void bus_detach(struct bus_client_t *client);
+
+/*
+ * The oldest frame not read yet, or NULL if there is no new one. Frames
+ * that were overwritten before they could be read count as dropped.
+ */
+const struct bus_frame_t *bus_next(struct bus_client_t *client);
+
+/* Like bus_next(), but skips to the newest frame */
+const struct bus_frame_t *bus_latest(struct bus_client_t *client);
+
+/*
+ * 1 if the frame returned last was not overwritten while it was read,
+ * otherwise it counts as dropped. Call it after reading the slot.
+ */
+int bus_valid(struct bus_client_t *client);
+
+unsigned long long bus_published(const struct bus_client_t *client);
+
+unsigned long long bus_dropped(const struct bus_client_t *client);
+
+unsigned long long bus_rom_hash(const struct bus_client_t *client);
+
+#endif
@@ -0,0 +1,140 @@
+#include "bus.h"
+#include "hash.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Example client of the frame bus (see bus.h). Follows a running space
+ * or replay, printing what it received once a second. -d makes it slow
+ * on purpose, to see frames being dropped rather than the emulator
+ * waiting.
+ */
+struct options_t {
+    const char *name;
+    int seconds;
+    int delay_us;
+    int latest;
+    int verbose;
+};
+
+static struct options_t options;
+
+static unsigned long long get_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage()
+{
+    printf("Usage: buswatch [-n SECONDS] [-d US] [-l] [-v] <BUS NAME>\n");
+    printf("  -n N      stop after N seconds (default: run until the bus goes away)\n");
+    printf("  -d US     spend US microseconds on every frame, like a slow consumer\n");
+    printf("  -l        always skip to the newest frame, like an overlay\n");
+    printf("  -v        print the VRAM hash of every frame\n");
+}
+
+static void parse_options(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:lv")) != -1) {
+        switch (opt) {
+            case 'n':
+                options.seconds = atoi(optarg);
+                break;
+            case 'd':
+                options.delay_us = atoi(optarg);
+                break;
+            case 'l':
+                options.latest = 1;
+                break;
+            case 'v':
+                options.verbose = 1;
+                break;
+            default:
+                usage();
+                ABORT(("Invalid options.\n"));
+        }
+    }
+
+    if (optind >= argc) {
+        usage();
+        ABORT(("Invalid options.\n"));
+    }
+
+    options.name = argv[optind];
+}
+
+int main(int argc, char **argv)
+{
+    struct bus_client_t *client;
+    unsigned long long start, report, now, received = 0, idle = 0, latency = 0;
+    unsigned long long last_published, last_received = 0;
+    struct timespec poll = { 0, 1000000 };
+
+    parse_options(argc, argv);
+
+    client = bus_attach(options.name);
+    if (client == NULL) {
+        ABORT(("nothing is publishing on %s\n", options.name));
+    }
+    printf("attached to %s, ROM %016llx\n", options.name, bus_rom_hash(client));
+
+    start = report = get_ns();
+    last_published = bus_published(client);
+    for (;;) {
+        const struct bus_frame_t *frame = options.latest ? bus_latest(client) : bus_next(client);
+
+        now = get_ns();
+        if (frame != NULL) {
+            unsigned long long frame_no = frame->frame, ns = frame->ns;
+            unsigned long long vram = hash_bytes(BUS_VRAM(frame), DISPLAY_SIZE, 0);
+
+            // Whatever was read only counts if the slot wasn't overwritten meanwhile
+            if (bus_valid(client)) {
+                ++received;
+                latency += now - ns;
+                if (options.verbose) {
+                    printf("%llu %016llx\n", frame_no, vram);
+                }
+            }
+            if (options.delay_us > 0) {
+                usleep(options.delay_us);
+            }
+            idle = 0;
+        } else {
+            // A publisher that went quiet for a second has probably exited
+            if (++idle > 1000) {
+                break;
+            }
+            nanosleep(&poll, NULL);
+        }
+
+        if (now - report >= 1000000000ULL) {
+            unsigned long long published = bus_published(client);
+
+            printf("published %llu received %llu dropped %llu, %.0f us behind\n",
+                   published - last_published, received - last_received, bus_dropped(client),
+                   received > last_received ? latency / 1e3 / (received - last_received) : 0.0);
+            last_published = published;
+            last_received = received;
+            latency = 0;
+            report = now;
+        }
+        if (options.seconds > 0 && now - start >= options.seconds * 1000000000ULL) {
+            break;
+        }
+    }
+
+    printf("received %llu frames, dropped %llu\n", received, bus_dropped(client));
+    bus_detach(client);
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef BYTES_H
+#define BYTES_H
+
+/*
+ * Little endian integers in files and on the wire, whatever the host's
+ * byte order. The put functions return the byte after the last written.
+ */
+static inline unsigned char *put16(unsigned char *p, unsigned short v)
+{
+    *p++ = v & 0xFF;
+    *p++ = v >> 8;
+    return p;
+}
+
+static inline unsigned char *put32(unsigned char *p, unsigned int v)
+{
+    p = put16(p, v & 0xFFFF);
+    return put16(p, v >> 16);
+}
+
+static inline unsigned char *put64(unsigned char *p, unsigned long long v)
+{
+    p = put32(p, v & 0xFFFFFFFF);
+    return put32(p, v >> 32);
+}
+
+static inline unsigned int get16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline unsigned int get32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static inline unsigned long long get64(const unsigned char *p)
+{
+    return get32(p) | ((unsigned long long)get32(p + 4) << 32);
+}
+
+#endif
@@ -0,0 +1,131 @@
+#include "checkpoint.h"
+#include "bytes.h"
+#include "hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct checkpoints_t *checkpoints_create(unsigned long long rom_hash, unsigned long long input_hash, int interval)
+{
+    struct checkpoints_t *cp;
+
+    if (interval < 1) {
+        return NULL;
+    }
+
+    cp = calloc(1, sizeof(*cp));
+    if (cp == NULL) {
+        return NULL;
+    }
+    cp->rom_hash = rom_hash;
+    cp->input_hash = input_hash;
+    cp->interval = interval;
+
+    return cp;
+}
+
+int checkpoints_add(struct checkpoints_t *cp, struct cpu_mem_t *machine)
+{
+    if (cp->count == cp->capacity) {
+        int capacity = cp->capacity ? cp->capacity * 2 : 64;
+        unsigned char *states = realloc(cp->states, (size_t)capacity * SAVESTATE_SIZE);
+
+        if (states == NULL) {
+            return -1;
+        }
+        cp->states = states;
+        cp->capacity = capacity;
+    }
+
+    savestate_write(machine, cp->states + (size_t)cp->count * SAVESTATE_SIZE);
+    ++cp->count;
+
+    return 0;
+}
+
+int checkpoints_save(const struct checkpoints_t *cp, const char *path)
+{
+    unsigned char header[CHECKPOINT_HEADER_SIZE];
+    size_t size = (size_t)cp->count * SAVESTATE_SIZE;
+    int res = 0;
+    FILE *out;
+
+    memcpy(header, CHECKPOINT_MAGIC, 4);
+    put32(put32(put64(put64(put16(put16(header + 4, CHECKPOINT_VERSION), 0), cp->rom_hash),
+                      cp->input_hash), cp->interval), cp->count);
+
+    out = fopen(path, "wb");
+    if (out == NULL) {
+        perror("fopen() failed");
+        return -1;
+    }
+
+    if (fwrite(header, 1, sizeof(header), out) != sizeof(header) ||
+        fwrite(cp->states, 1, size, out) != size) {
+        res = -1;
+    }
+    if (fclose(out) != 0) {
+        res = -1;
+    }
+
+    return res;
+}
+
+struct checkpoints_t *checkpoints_load(const char *path)
+{
+    unsigned char header[CHECKPOINT_HEADER_SIZE];
+    struct checkpoints_t *cp = NULL;
+    size_t size;
+    FILE *in;
+
+    in = fopen(path, "rb");
+    if (in == NULL) {
+        perror("fopen() failed");
+        return NULL;
+    }
+
+    if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+        memcmp(header, CHECKPOINT_MAGIC, 4) != 0 ||
+        get16(header + 4) != CHECKPOINT_VERSION) {
+        printf("%s is not a checkpoint file\n", path);
+        goto fail;
+    }
+
+    cp = checkpoints_create(get64(header + 8), get64(header + 16), get32(header + 24));
+    if (cp == NULL) {
+        printf("%s is corrupted\n", path);
+        goto fail;
+    }
+    cp->count = get32(header + 28);
+    cp->capacity = cp->count;
+    size = (size_t)cp->count * SAVESTATE_SIZE;
+
+    cp->states = malloc(size + 1);
+    if (cp->states == NULL || fread(cp->states, 1, size, in) != size) {
+        printf("%s is truncated\n", path);
+        goto fail;
+    }
+
+    fclose(in);
+    return cp;
+
+fail:
+    if (cp != NULL) {
+        checkpoints_free(cp);
+    }
+    fclose(in);
+
+    return NULL;
+}
+
+void checkpoints_free(struct checkpoints_t *cp)
+{
+    free(cp->states);
+    free(cp);
+}
+
+unsigned long long checkpoints_input_hash(const unsigned short *keys, int frames)
+{
+    return hash_bytes(keys, (size_t)frames * sizeof(*keys), frames);
+}
@@ -0,0 +1,51 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "savestate.h"
+
+#include <stddef.h>
+
+/*
+ * Machine states taken every interval frames of a run, so the run can be
+ * picked up at any of them, e.g. to replay its segments in parallel.
+ * Checkpoint i is the state right before frame i * interval, checkpoint
+ * 0 the state the run started from. input_hash identifies the inputs the
+ * run was driven by, see checkpoints_input_hash().
+ *
+ * File layout, little endian:
+ *   "I8CP", u16 version, u16 flags, u64 ROM hash, u64 input hash,
+ *   u32 interval, u32 checkpoints, savestates
+ */
+#define CHECKPOINT_MAGIC "I8CP"
+#define CHECKPOINT_VERSION (1)
+#define CHECKPOINT_HEADER_SIZE (32)
+
+struct checkpoints_t {
+    unsigned long long rom_hash;
+    unsigned long long input_hash;
+    int interval;
+    unsigned char *states;
+    int count;
+    int capacity;
+};
+
+struct checkpoints_t *checkpoints_create(unsigned long long rom_hash, unsigned long long input_hash, int interval);
+
+/* Appends the current state of machine, -1 when out of memory */
+int checkpoints_add(struct checkpoints_t *cp, struct cpu_mem_t *machine);
+
+static inline const unsigned char *checkpoint_state(const struct checkpoints_t *cp, int i)
+{
+    return cp->states + (size_t)i * SAVESTATE_SIZE;
+}
+
+int checkpoints_save(const struct checkpoints_t *cp, const char *path);
+
+struct checkpoints_t *checkpoints_load(const char *path);
+
+void checkpoints_free(struct checkpoints_t *cp);
+
+/* Hash of the keys of frames 0..frames) */
+unsigned long long checkpoints_input_hash(const unsigned short *keys, int frames);
+
+#endif
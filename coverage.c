@@ -0,0 +1,51 @@
+#include "coverage.h"
+
+#include <string.h>
+
+static int popcount(const unsigned char *bits, int len)
+{
+    int i, n = 0;
+
+    for (i = 0; i < len; ++i) {
+        n += __builtin_popcount(bits[i]);
+    }
+
+    return n;
+}
+
+static int merge_bits(unsigned char *dst, const unsigned char *src, int len)
+{
+    int i, n = 0;
+
+    for (i = 0; i < len; ++i) {
+        unsigned char fresh = src[i] & ~dst[i];
+
+        if (fresh != 0) {
+            n += __builtin_popcount(fresh);
+            dst[i] |= fresh;
+        }
+    }
+
+    return n;
+}
+
+void coverage_clear(struct coverage_t *cov)
+{
+    memset(cov, 0, sizeof(*cov));
+}
+
+int coverage_merge(struct coverage_t *dst, const struct coverage_t *src)
+{
+    return merge_bits(dst->addrs, src->addrs, sizeof(dst->addrs)) +
+           merge_bits(dst->edges, src->edges, sizeof(dst->edges));
+}
+
+int coverage_addrs(const struct coverage_t *cov)
+{
+    return popcount(cov->addrs, sizeof(cov->addrs));
+}
+
+int coverage_edges(const struct coverage_t *cov)
+{
+    return popcount(cov->edges, sizeof(cov->edges));
+}
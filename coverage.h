@@ -0,0 +1,38 @@
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+/*
+ * Code coverage of one run: a bit per executed ROM address and a bit per
+ * hashed edge between consecutive instructions, AFL style, so taken and
+ * not taken branches, calls, returns and interrupts all count.
+ */
+#define COVERAGE_ADDRS (0x2000)
+#define COVERAGE_EDGES (0x10000)
+
+struct coverage_t {
+    unsigned char addrs[COVERAGE_ADDRS / 8];
+    unsigned char edges[COVERAGE_EDGES / 8];
+    unsigned short prev;
+};
+
+static inline void coverage_hit(struct coverage_t *cov, unsigned short pc)
+{
+    unsigned short edge = (pc ^ cov->prev) & (COVERAGE_EDGES - 1);
+
+    if (pc < COVERAGE_ADDRS) {
+        cov->addrs[pc >> 3] |= 1 << (pc & 7);
+    }
+    cov->edges[edge >> 3] |= 1 << (edge & 7);
+    cov->prev = (pc >> 1) * 0x9E37;
+}
+
+void coverage_clear(struct coverage_t *cov);
+
+/* ORs src into dst and returns how many bits were new to dst */
+int coverage_merge(struct coverage_t *dst, const struct coverage_t *src);
+
+int coverage_addrs(const struct coverage_t *cov);
+
+int coverage_edges(const struct coverage_t *cov);
+
+#endif
@@ -0,0 +1,404 @@
+#include "env.h"
+#include "arena.h"
+#include "gamefeatures.h"
+#include "input.h"
+#include "preprocess.h"
+#include "savestate.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Coin at 60, start at 120, the ships are on screen by 240 */
+#define READY_FRAMES (240)
+
+/* See disasm: the player 1 score is BCD at 20F8, 20EF is 1 while playing */
+#define SCORE_ADDRESS (0x20F8)
+#define PLAYING_ADDRESS (0x20EF)
+
+#define JOB_RESET (0)
+#define JOB_STEP (1)
+#define JOB_QUIT (2)
+#define JOB_PLACE (3)
+
+/* Padded so envs stepped by different threads don't share cache lines */
+struct env_t {
+    struct cpu_mem_t *machine;
+    struct keyboard_t keyboard;
+    int score;
+    // Frames into the preprocessing ring and the frame before the last
+    unsigned long long t;
+    unsigned char *prev;
+} __attribute__((aligned(64)));
+
+struct env_batch_t {
+    struct env_t *envs;
+    int n;
+    // The same machines, contiguous for features_batch()
+    struct cpu_mem_t **machines;
+    // Boots the ready state, the envs run in an arena per thread
+    struct cpu_mem_t *program;
+    struct keyboard_t keyboard;
+    struct arena_t **arenas;
+    const struct features_layout_t *layout;
+    unsigned char ready[SAVESTATE_SIZE];
+    int ready_score;
+    struct preprocess_t *pp;
+    size_t obs_size;
+    pthread_t *threads;
+    int nthreads;
+    // Held while the workers are being started
+    pthread_mutex_t gate;
+    pthread_barrier_t start;
+    pthread_barrier_t end;
+    // The call being run
+    int job;
+    const int *actions;
+    int frameskip;
+    unsigned char *obs;
+    float *reward;
+    unsigned char *done;
+    int failed;
+};
+
+struct worker_t {
+    struct env_batch_t *batch;
+    int index;
+};
+
+static const unsigned short action_keys[ENV_ACTIONS] = {
+    0,
+    KEY_P1_SHOOT,
+    KEY_P1_RIGHT,
+    KEY_P1_LEFT,
+    KEY_P1_RIGHT | KEY_P1_SHOOT,
+    KEY_P1_LEFT | KEY_P1_SHOOT,
+};
+
+static int score(struct cpu_mem_t *machine)
+{
+    const unsigned char *p = MACHINE_RAM(machine, SCORE_ADDRESS);
+
+    return (p[1] >> 4) * 1000 + (p[1] & 0x0F) * 100 + (p[0] >> 4) * 10 + (p[0] & 0x0F);
+}
+
+static void reset_env(struct env_batch_t *batch, struct env_t *env, unsigned char *obs)
+{
+    const unsigned char *vram = MACHINE_RAM(env->machine, DISPLAY_ADDRESS);
+
+    savestate_read(env->machine, batch->ready);
+    env->score = batch->ready_score;
+
+    if (obs == NULL) {
+        return;
+    } else if (batch->pp != NULL) {
+        env->t = 0;
+        preprocess_reset(batch->pp, vram, obs);
+    } else {
+        memcpy(obs, vram, ENV_OBS_SIZE);
+    }
+}
+
+static int step_env(struct env_batch_t *batch, int i)
+{
+    struct env_t *env = &batch->envs[i];
+    unsigned char *obs = batch->obs ? batch->obs + i * batch->obs_size : NULL;
+    const unsigned char *vram = MACHINE_RAM(env->machine, DISPLAY_ADDRESS);
+    int action = batch->actions[i], frame, now, done = 0;
+
+    if (action < 0 || action >= ENV_ACTIONS) {
+        return -1;
+    }
+
+    mask_to_keyboard(action_keys[action], &env->keyboard);
+    for (frame = 0; frame < batch->frameskip && !done; ++frame) {
+        if (obs != NULL && batch->pp != NULL && frame == batch->frameskip - 1) {
+            memcpy(env->prev, vram, DISPLAY_SIZE);
+        }
+        if (run_frame(env->machine, NULL, NULL) == -1) {
+            return -1;
+        }
+        done = *MACHINE_RAM(env->machine, PLAYING_ADDRESS) == 0;
+    }
+
+    now = score(env->machine);
+    batch->reward[i] = now - env->score;
+    batch->done[i] = done;
+    env->score = now;
+
+    if (done) {
+        reset_env(batch, env, obs);
+    } else if (obs == NULL) {
+        return 0;
+    } else if (batch->pp != NULL) {
+        preprocess_frame(batch->pp, vram, env->prev, obs, ++env->t);
+    } else {
+        memcpy(obs, vram, ENV_OBS_SIZE);
+    }
+
+    return 0;
+}
+
+static void run_share(struct env_batch_t *batch, int index)
+{
+    int first = (long)batch->n * index / batch->nthreads;
+    int last = (long)batch->n * (index + 1) / batch->nthreads;
+    int i;
+
+    for (i = first; i < last; ++i) {
+        if (batch->job == JOB_PLACE) {
+            // Built by the thread that steps it, so its memory is local to that thread
+            batch->envs[i].machine = arena_get(batch->arenas[index], &batch->envs[i].keyboard);
+            batch->machines[i] = batch->envs[i].machine;
+        } else if (batch->job == JOB_RESET) {
+            reset_env(batch, &batch->envs[i], batch->obs ? batch->obs + i * batch->obs_size : NULL);
+        } else if (step_env(batch, i) != 0) {
+            __atomic_store_n(&batch->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void *worker(void *arg)
+{
+    struct worker_t *w = arg;
+    struct env_batch_t *batch = w->batch;
+
+    pthread_mutex_lock(&batch->gate);
+    pthread_mutex_unlock(&batch->gate);
+
+    for (;;) {
+        pthread_barrier_wait(&batch->start);
+        if (batch->job == JOB_QUIT) {
+            break;
+        }
+        run_share(batch, w->index);
+        pthread_barrier_wait(&batch->end);
+    }
+
+    free(w);
+    return NULL;
+}
+
+/* The calling thread takes share 0 and waits for the others */
+static void run_job(struct env_batch_t *batch, int job)
+{
+    batch->job = job;
+    pthread_barrier_wait(&batch->start);
+    run_share(batch, 0);
+    pthread_barrier_wait(&batch->end);
+}
+
+/* Frees what env_batch_create() got to, once no thread runs anymore */
+static void destroy(struct env_batch_t *batch)
+{
+    int i;
+
+    for (i = 0; i < batch->n; ++i) {
+        free(batch->envs[i].prev);
+    }
+    for (i = 0; batch->arenas != NULL && i < batch->nthreads; ++i) {
+        if (batch->arenas[i] != NULL) {
+            arena_free(batch->arenas[i]);
+        }
+    }
+    free(batch->arenas);
+    if (batch->program != NULL) {
+        deinit_machine(batch->program);
+    }
+    if (batch->pp != NULL) {
+        preprocess_free(batch->pp);
+    }
+    free(batch->threads);
+    free(batch->machines);
+    free(batch->envs);
+    free(batch);
+}
+
+struct env_batch_t *env_batch_create(const char *rom_path, int n, int threads)
+{
+    struct env_batch_t *batch;
+    int i, frame;
+
+    if (n < 1) {
+        return NULL;
+    }
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > n) {
+        threads = n;
+    }
+
+    batch = calloc(1, sizeof(*batch));
+    if (batch == NULL) {
+        return NULL;
+    }
+    if (posix_memalign((void **)&batch->envs, 64, n * sizeof(*batch->envs)) != 0) {
+        free(batch);
+        return NULL;
+    }
+    memset(batch->envs, 0, n * sizeof(*batch->envs));
+    batch->n = n;
+    batch->obs_size = ENV_OBS_SIZE;
+    batch->machines = malloc(n * sizeof(*batch->machines));
+    batch->threads = malloc(threads * sizeof(*batch->threads));
+    if (batch->machines == NULL || batch->threads == NULL) {
+        destroy(batch);
+        return NULL;
+    }
+
+    batch->program = init_machine(rom_path, &batch->keyboard);
+    if (batch->program == NULL) {
+        destroy(batch);
+        return NULL;
+    }
+    batch->layout = features_layout(batch->program);
+
+    // Every env starts from the same freshly started game
+    for (frame = 0; frame < READY_FRAMES; ++frame) {
+        mask_to_keyboard(demo_keys(frame), &batch->keyboard);
+        if (run_frame(batch->program, NULL, NULL) == -1) {
+            destroy(batch);
+            return NULL;
+        }
+    }
+    savestate_write(batch->program, batch->ready);
+    batch->ready_score = score(batch->program);
+
+    /*
+     * The workers wait at the gate until the barriers are set up for the
+     * threads that did start, so the batch makes do with fewer threads
+     * instead of failing when the system won't give it all of them.
+     */
+    pthread_mutex_init(&batch->gate, NULL);
+    pthread_mutex_lock(&batch->gate);
+    for (i = 1; i < threads; ++i) {
+        struct worker_t *w = malloc(sizeof(*w));
+
+        if (w == NULL) {
+            break;
+        }
+        w->batch = batch;
+        w->index = i;
+        if (pthread_create(&batch->threads[i], NULL, worker, w) != 0) {
+            free(w);
+            break;
+        }
+    }
+    batch->nthreads = i;
+    pthread_barrier_init(&batch->start, NULL, batch->nthreads);
+    pthread_barrier_init(&batch->end, NULL, batch->nthreads);
+    pthread_mutex_unlock(&batch->gate);
+
+    // An arena for each share of the envs, filled by the thread that steps them
+    batch->arenas = calloc(batch->nthreads, sizeof(*batch->arenas));
+    for (i = 0; batch->arenas != NULL && i < batch->nthreads; ++i) {
+        int share = (long)n * (i + 1) / batch->nthreads - (long)n * i / batch->nthreads;
+
+        batch->arenas[i] = arena_create(batch->program, share);
+        if (batch->arenas[i] == NULL) {
+            break;
+        }
+    }
+    if (batch->arenas == NULL || i < batch->nthreads) {
+        env_batch_free(batch);
+        return NULL;
+    }
+    run_job(batch, JOB_PLACE);
+
+    return batch;
+}
+
+void env_batch_free(struct env_batch_t *batch)
+{
+    int i;
+
+    batch->job = JOB_QUIT;
+    pthread_barrier_wait(&batch->start);
+    for (i = 1; i < batch->nthreads; ++i) {
+        pthread_join(batch->threads[i], NULL);
+    }
+    pthread_barrier_destroy(&batch->start);
+    pthread_barrier_destroy(&batch->end);
+    pthread_mutex_destroy(&batch->gate);
+
+    destroy(batch);
+}
+
+int env_batch_size(const struct env_batch_t *batch)
+{
+    return batch->n;
+}
+
+int env_batch_preprocess(struct env_batch_t *batch, int width, int height, int depth)
+{
+    struct preprocess_t *pp;
+    int i;
+
+    pp = preprocess_create(width, height, depth);
+    if (pp == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < batch->n; ++i) {
+        if (batch->envs[i].prev == NULL) {
+            batch->envs[i].prev = calloc(1, DISPLAY_SIZE);
+            if (batch->envs[i].prev == NULL) {
+                preprocess_free(pp);
+                return -1;
+            }
+        }
+    }
+
+    if (batch->pp != NULL) {
+        preprocess_free(batch->pp);
+    }
+    batch->pp = pp;
+    batch->obs_size = preprocess_ring_size(pp);
+
+    return 0;
+}
+
+size_t env_batch_obs_size(const struct env_batch_t *batch)
+{
+    return batch->obs_size;
+}
+
+const unsigned char *env_batch_stack(const struct env_batch_t *batch, const unsigned char *obs, int i)
+{
+    const unsigned char *ring = obs + i * batch->obs_size;
+
+    return batch->pp ? preprocess_stack(batch->pp, ring, batch->envs[i].t) : ring;
+}
+
+void env_batch_reset(struct env_batch_t *batch, unsigned char *obs)
+{
+    batch->obs = obs;
+    run_job(batch, JOB_RESET);
+}
+
+int env_batch_step(struct env_batch_t *batch, const int *actions, int frameskip,
+                   unsigned char *obs, float *reward, unsigned char *done)
+{
+    batch->actions = actions;
+    batch->frameskip = frameskip > 0 ? frameskip : 1;
+    batch->obs = obs;
+    batch->reward = reward;
+    batch->done = done;
+    batch->failed = 0;
+
+    run_job(batch, JOB_STEP);
+
+    return batch->failed ? -1 : 0;
+}
+
+int env_batch_features(const struct env_batch_t *batch, float *features)
+{
+    if (batch->layout == NULL) {
+        return -1;
+    }
+
+    features_batch(batch->layout, batch->machines, batch->n, features);
+    return 0;
+}
@@ -0,0 +1,79 @@
+#ifndef ENV_H
+#define ENV_H
+
+#include "frame.h"
+
+#include <stddef.h>
+
+/*
+ * Batched environment for reinforcement learning. Holds n machines that
+ * all start from the same state, a one player game that just started,
+ * and steps them on a pool of threads.
+ *
+ * Results are written straight into caller owned arrays indexed by env:
+ * obs is n * env_batch_obs_size() bytes, reward and done are n entries
+ * each. Nothing is allocated after env_batch_create() and
+ * env_batch_preprocess().
+ *
+ * By default an observation is the ENV_OBS_SIZE bytes of 1bpp VRAM.
+ * After env_batch_preprocess() it is the preprocessing ring of that env
+ * instead (see preprocess.h), and env_batch_stack() points at its stack
+ * of the latest pooled frames.
+ *
+ * obs may be NULL to skip observations altogether, for agents that only
+ * look at env_batch_features(). With preprocessing on, the stack is then
+ * stale until the next env_batch_reset() with an obs.
+ *
+ * An env whose game ends during a step is reset right away: done is set,
+ * reward covers the frames up to the end and obs is the first frame of
+ * the new game.
+ */
+#define ENV_OBS_SIZE (DISPLAY_SIZE)
+
+/* The minimal action set, like the ALE one */
+#define ENV_NOOP       (0)
+#define ENV_FIRE       (1)
+#define ENV_RIGHT      (2)
+#define ENV_LEFT       (3)
+#define ENV_RIGHT_FIRE (4)
+#define ENV_LEFT_FIRE  (5)
+#define ENV_ACTIONS    (6)
+
+struct env_batch_t;
+
+/* threads <= 0 uses one per core. Returns NULL on failure */
+struct env_batch_t *env_batch_create(const char *rom_path, int n, int threads);
+
+void env_batch_free(struct env_batch_t *batch);
+
+int env_batch_size(const struct env_batch_t *batch);
+
+/*
+ * Switches observations to width x height grayscale frames, max-pooled
+ * over the last two frames and stacked depth deep. Takes effect from the
+ * next env_batch_reset(). Returns -1 on bad sizes or out of memory.
+ */
+int env_batch_preprocess(struct env_batch_t *batch, int width, int height, int depth);
+
+size_t env_batch_obs_size(const struct env_batch_t *batch);
+
+/* Where the current observation of env i starts in obs */
+const unsigned char *env_batch_stack(const struct env_batch_t *batch, const unsigned char *obs, int i);
+
+/* Puts every env back to the start and writes its first observation, if obs isn't NULL */
+void env_batch_reset(struct env_batch_t *batch, unsigned char *obs);
+
+/*
+ * Plays actions[i] in env i for frameskip frames. reward is the score
+ * gained. Returns -1 if an action is out of range or a machine stopped.
+ */
+int env_batch_step(struct env_batch_t *batch, const int *actions, int frameskip,
+                   unsigned char *obs, float *reward, unsigned char *done);
+
+/*
+ * Writes the RAM features of every env as n rows of FEATURES_COLUMNS
+ * floats (see gamefeatures.h). Returns -1 if the ROM has no known layout.
+ */
+int env_batch_features(const struct env_batch_t *batch, float *features);
+
+#endif
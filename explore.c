@@ -0,0 +1,373 @@
+#include "8080e.h"
+#include "coverage.h"
+#include "frame.h"
+#include "input.h"
+#include "movie.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Coverage guided exploration. Every worker thread owns a machine and
+ * keeps forking it from a state in the corpus, plays a mutated stretch
+ * of input with coverage on and merges the result into the global
+ * address and edge bitmaps. Runs that reach something new join the
+ * corpus and can be written out as movies that replay from power on.
+ */
+#define DEFAULT_SECONDS (10)
+#define DEFAULT_FRAMES (300)
+#define MAX_HOLD_FRAMES (40)
+#define RECENT_FINDS (16)
+
+struct options_t {
+    const char *bin_name;
+    const char *out_dir;
+    const char *csv_path;
+    int threads;
+    int seconds;
+    int frames;
+    int engine;
+};
+
+/* A corpus entry: the inputs from power on and the state they lead to */
+struct find_t {
+    unsigned char state[SAVESTATE_SIZE];
+    unsigned short *keys;
+    int frames;
+};
+
+struct explorer_t {
+    pthread_mutex_t lock;
+    struct coverage_t total;
+    struct find_t **corpus;
+    int count;
+    int capacity;
+    unsigned long long runs;
+    unsigned long long frames;
+    struct movie_t *root;
+    volatile int stop;
+};
+
+static struct options_t options;
+static struct explorer_t explorer;
+
+/* Inputs worth holding for a while, anything else is rarely useful */
+static const unsigned short moves[] = {
+    0,
+    KEY_P1_LEFT,
+    KEY_P1_RIGHT,
+    KEY_P1_SHOOT,
+    KEY_P1_LEFT | KEY_P1_SHOOT,
+    KEY_P1_RIGHT | KEY_P1_SHOOT,
+    KEY_P2_LEFT | KEY_P2_SHOOT,
+    KEY_P2_RIGHT | KEY_P2_SHOOT,
+    KEY_COIN,
+    KEY_P1_START,
+    KEY_P2_START,
+};
+
+static unsigned long long get_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage()
+{
+    printf("Usage: explore [-j THREADS] [-s SECONDS] [-f FRAMES] [-o DIR] [-c CSV] [-e ENGINE] <ROM FILE>\n");
+    printf("  -j N      worker threads (default: one per core)\n");
+    printf("  -s N      explore for N seconds (default %d)\n", DEFAULT_SECONDS);
+    printf("  -f N      frames played per run (default %d)\n", DEFAULT_FRAMES);
+    printf("  -o DIR    write a movie for every run that found new coverage\n");
+    printf("  -c FILE   write coverage over time as CSV\n");
+}
+
+static void parse_options(int argc, char **argv)
+{
+    int opt;
+
+    options.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    options.seconds = DEFAULT_SECONDS;
+    options.frames = DEFAULT_FRAMES;
+
+    while ((opt = getopt(argc, argv, "j:s:f:o:c:e:")) != -1) {
+        switch (opt) {
+            case 'j':
+                options.threads = atoi(optarg);
+                break;
+            case 's':
+                options.seconds = atoi(optarg);
+                break;
+            case 'f':
+                options.frames = atoi(optarg);
+                break;
+            case 'o':
+                options.out_dir = optarg;
+                break;
+            case 'c':
+                options.csv_path = optarg;
+                break;
+            case 'e':
+                options.engine = engine_from_name(optarg);
+                break;
+            default:
+                usage();
+                ABORT(("Invalid options.\n"));
+        }
+    }
+
+    if (optind >= argc || options.engine < 0 || options.threads < 1 || options.frames < 1) {
+        usage();
+        ABORT(("Invalid options.\n"));
+    }
+
+    options.bin_name = argv[optind];
+}
+
+/* Called with the lock held */
+static void add_find(struct find_t *find)
+{
+    if (explorer.count == explorer.capacity) {
+        int capacity = explorer.capacity ? explorer.capacity * 2 : 64;
+        struct find_t **corpus = realloc(explorer.corpus, capacity * sizeof(*corpus));
+
+        if (corpus == NULL) {
+            ABORT(("OOM\n"));
+        }
+        explorer.corpus = corpus;
+        explorer.capacity = capacity;
+    }
+
+    explorer.corpus[explorer.count++] = find;
+}
+
+static void write_find(const struct find_t *find, int index)
+{
+    struct movie_t movie = *explorer.root;
+    char path[4096];
+
+    movie.keys = find->keys;
+    movie.frames = find->frames;
+
+    snprintf(path, sizeof(path), "%s/find-%05d.i8mv", options.out_dir, index);
+    if (movie_save(&movie, path) != 0) {
+        fprintf(stderr, "writing %s failed\n", path);
+    }
+}
+
+/* Half of the time one of the latest finds, they are the frontier */
+static const struct find_t *pick_parent(unsigned int *seed)
+{
+    int n = explorer.count;
+
+    if (n > RECENT_FINDS && rand_r(seed) % 2) {
+        return explorer.corpus[n - 1 - rand_r(seed) % RECENT_FINDS];
+    }
+
+    return explorer.corpus[rand_r(seed) % n];
+}
+
+/* Random moves held for random stretches, sometimes with a bit flipped */
+static void mutate(unsigned short *keys, int frames, unsigned int *seed)
+{
+    int frame = 0;
+
+    while (frame < frames) {
+        unsigned short move = moves[rand_r(seed) % (sizeof(moves) / sizeof(moves[0]))];
+        int hold = 1 + rand_r(seed) % MAX_HOLD_FRAMES;
+
+        if (rand_r(seed) % 8 == 0) {
+            move ^= 1 << (rand_r(seed) % 9);
+        }
+
+        while (hold-- > 0 && frame < frames) {
+            keys[frame++] = move;
+        }
+    }
+}
+
+static void *worker(void *arg)
+{
+    struct keyboard_t keyboard;
+    struct cpu_mem_t *machine;
+    struct coverage_t *run;
+    unsigned short *keys;
+    unsigned int seed = (unsigned int)(long)arg * 7919 + 1;
+    int frame;
+
+    machine = init_machine(options.bin_name, &keyboard);
+    if (machine == NULL) {
+        ABORT(("can't load %s\n", options.bin_name));
+    }
+    set_engine(machine, options.engine);
+
+    run = malloc(sizeof(*run));
+    keys = malloc(options.frames * sizeof(*keys));
+    if (run == NULL || keys == NULL) {
+        ABORT(("OOM\n"));
+    }
+
+    while (!explorer.stop) {
+        const struct find_t *parent;
+        struct find_t *find;
+        int fresh;
+
+        pthread_mutex_lock(&explorer.lock);
+        parent = pick_parent(&seed);
+        pthread_mutex_unlock(&explorer.lock);
+
+        savestate_read(machine, parent->state);
+        mutate(keys, options.frames, &seed);
+
+        coverage_clear(run);
+        set_coverage(machine, run);
+        for (frame = 0; frame < options.frames; ++frame) {
+            mask_to_keyboard(keys[frame], &keyboard);
+            if (run_frame(machine, NULL, NULL) == -1) {
+                break;
+            }
+        }
+        set_coverage(machine, NULL);
+
+        pthread_mutex_lock(&explorer.lock);
+        explorer.runs++;
+        explorer.frames += frame;
+        fresh = coverage_merge(&explorer.total, run);
+        pthread_mutex_unlock(&explorer.lock);
+
+        if (fresh == 0 || frame < options.frames) {
+            continue;
+        }
+
+        find = malloc(sizeof(*find));
+        if (find == NULL || (find->keys = malloc((parent->frames + frame) * sizeof(*keys))) == NULL) {
+            ABORT(("OOM\n"));
+        }
+        memcpy(find->keys, parent->keys, parent->frames * sizeof(*keys));
+        memcpy(find->keys + parent->frames, keys, frame * sizeof(*keys));
+        find->frames = parent->frames + frame;
+        savestate_write(machine, find->state);
+
+        pthread_mutex_lock(&explorer.lock);
+        add_find(find);
+        if (options.out_dir != NULL) {
+            write_find(find, explorer.count - 1);
+        }
+        pthread_mutex_unlock(&explorer.lock);
+    }
+
+    free(keys);
+    free(run);
+    deinit_machine(machine);
+
+    return NULL;
+}
+
+static void report(FILE *csv, double seconds, int rom_size)
+{
+    int addrs, edges, count;
+    unsigned long long runs, frames;
+
+    pthread_mutex_lock(&explorer.lock);
+    addrs = coverage_addrs(&explorer.total);
+    edges = coverage_edges(&explorer.total);
+    count = explorer.count;
+    runs = explorer.runs;
+    frames = explorer.frames;
+    pthread_mutex_unlock(&explorer.lock);
+
+    printf("%6.1fs runs %llu (%.0f frames/s) corpus %d rom %d/%d (%.1f%%) edges %d\n",
+           seconds, runs, frames / seconds, count, addrs, rom_size,
+           100.0 * addrs / rom_size, edges);
+    fflush(stdout);
+
+    if (csv != NULL) {
+        fprintf(csv, "%.1f,%llu,%llu,%d,%d,%d\n", seconds, runs, frames, count, addrs, edges);
+        fflush(csv);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct keyboard_t keyboard;
+    struct cpu_mem_t *machine;
+    struct find_t *boot;
+    pthread_t *threads;
+    FILE *csv = NULL;
+    unsigned long long start;
+    long i;
+
+    parse_options(argc, argv);
+
+    // The root of the corpus and of every movie is the machine at power on
+    machine = init_machine(options.bin_name, &keyboard);
+    if (machine == NULL) {
+        ABORT(("can't load %s\n", options.bin_name));
+    }
+    explorer.root = movie_create(machine);
+    boot = calloc(1, sizeof(*boot));
+    if (explorer.root == NULL || boot == NULL) {
+        ABORT(("OOM\n"));
+    }
+    savestate_write(machine, boot->state);
+    deinit_machine(machine);
+
+    pthread_mutex_init(&explorer.lock, NULL);
+    add_find(boot);
+
+    if (options.csv_path != NULL) {
+        csv = fopen(options.csv_path, "w");
+        if (csv == NULL) {
+            ABORT(("can't open %s\n", options.csv_path));
+        }
+        fprintf(csv, "seconds,runs,frames,corpus,rom_addresses,edges\n");
+    }
+
+    threads = malloc(options.threads * sizeof(*threads));
+    if (threads == NULL) {
+        ABORT(("OOM\n"));
+    }
+
+    start = get_ns();
+    for (i = 0; i < options.threads; ++i) {
+        if (pthread_create(&threads[i], NULL, worker, (void *)i) != 0) {
+            ABORT(("can't start worker %ld\n", i));
+        }
+    }
+
+    for (i = 1; i <= options.seconds; ++i) {
+        unsigned long long deadline = start + i * 1000000000ULL, now = get_ns();
+
+        if (deadline > now) {
+            usleep((deadline - now) / 1000);
+        }
+        report(csv, (get_ns() - start) / 1e9, COVERAGE_ADDRS);
+    }
+
+    explorer.stop = 1;
+    for (i = 0; i < options.threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    report(csv, (get_ns() - start) / 1e9, COVERAGE_ADDRS);
+
+    if (csv != NULL) {
+        fclose(csv);
+    }
+    for (i = 0; i < explorer.count; ++i) {
+        free(explorer.corpus[i]->keys);
+        free(explorer.corpus[i]);
+    }
+    free(explorer.corpus);
+    free(threads);
+    movie_free(explorer.root);
+    pthread_mutex_destroy(&explorer.lock);
+
+    return 0;
+}
@@ -0,0 +1,302 @@
+#include "export.h"
+#include "frame.h"
+#include "png.h"
+#include "render.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Power of two, about half a megabyte of VRAM */
+#define QUEUE_FRAMES (64)
+#define PIXELS (DISPLAY_WIDTH * DISPLAY_HEIGHT)
+#define Y4M_HEADER "YUV4MPEG2 W224 H256 F60000:1001 Ip A1:1 C444\n"
+
+/*
+ * Frame n goes into slot n % QUEUE_FRAMES. A slot whose seq is n is free
+ * for frame n, one whose seq is n + 1 holds it.
+ */
+struct slot_t {
+    unsigned long long seq;
+    unsigned char vram[DISPLAY_SIZE];
+} __attribute__((aligned(64)));
+
+struct export_t {
+    int format;
+    const char *path;
+    FILE *video;
+    unsigned char yuv[RENDER_COLORS][3];
+    struct slot_t *slots;
+    pthread_t *threads;
+    int nthreads;
+    // Only touched by the thread calling export_frame()
+    unsigned long long head;
+    unsigned long long stalls;
+    // Shared, atomics only
+    unsigned long long tail __attribute__((aligned(64)));
+    unsigned long long written;
+    unsigned long long end;
+    int failed;
+};
+
+/* Spins briefly, then sleeps, so a single core host still makes progress */
+static void backoff(int *spins)
+{
+    if (++*spins < 16) {
+        sched_yield();
+    } else {
+        struct timespec ts = { 0, 50000 };
+
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Limited range BT.601, what players assume for Y4M */
+static void palette_to_yuv(unsigned char yuv[RENDER_COLORS][3])
+{
+    int i;
+
+    for (i = 0; i < RENDER_COLORS; ++i) {
+        int r = render_palette[i][0], g = render_palette[i][1], b = render_palette[i][2];
+
+        yuv[i][0] = 16 + (65481 * r + 128553 * g + 24966 * b) / 255000;
+        yuv[i][1] = 128 + (-37797 * r - 74203 * g + 112000 * b) / 255000;
+        yuv[i][2] = 128 + (112000 * r - 93786 * g - 18214 * b) / 255000;
+    }
+}
+
+static int write_png(struct export_t *ex, const unsigned char *pixels, unsigned char *buf,
+                     unsigned long long n)
+{
+    char name[4096];
+    size_t size = png_encode(pixels, DISPLAY_WIDTH, DISPLAY_HEIGHT, render_palette, RENDER_COLORS, buf);
+    FILE *f;
+    int res = 0;
+
+    snprintf(name, sizeof(name), "%s/frame-%06llu.png", ex->path, n);
+    f = fopen(name, "wb");
+    if (size == 0 || f == NULL) {
+        if (f != NULL) {
+            fclose(f);
+        }
+        return -1;
+    }
+    if (fwrite(buf, 1, size, f) != size) {
+        res = -1;
+    }
+    if (fclose(f) != 0) {
+        res = -1;
+    }
+
+    return res;
+}
+
+/* Planes are converted before waiting for the turn of this frame */
+static int write_y4m(struct export_t *ex, const unsigned char *pixels, unsigned char *buf,
+                     unsigned long long n)
+{
+    int res = 0, spins = 0, plane, i;
+
+    for (plane = 0; plane < 3; ++plane) {
+        unsigned char *out = buf + plane * PIXELS;
+
+        for (i = 0; i < PIXELS; ++i) {
+            out[i] = ex->yuv[pixels[i]][plane];
+        }
+    }
+
+    while (__atomic_load_n(&ex->written, __ATOMIC_ACQUIRE) != n) {
+        backoff(&spins);
+    }
+    if (fputs("FRAME\n", ex->video) == EOF || fwrite(buf, 1, 3 * PIXELS, ex->video) != 3 * PIXELS) {
+        res = -1;
+    }
+    __atomic_store_n(&ex->written, n + 1, __ATOMIC_RELEASE);
+
+    return res;
+}
+
+static void *worker(void *arg)
+{
+    struct export_t *ex = arg;
+    unsigned char *pixels = malloc(PIXELS);
+    unsigned char *buf = malloc(ex->format == EXPORT_PNG ? PNG_BOUND(DISPLAY_WIDTH, DISPLAY_HEIGHT) : 3 * PIXELS);
+
+    for (;;) {
+        unsigned long long n = __atomic_fetch_add(&ex->tail, 1, __ATOMIC_RELAXED);
+        struct slot_t *slot = &ex->slots[n % QUEUE_FRAMES];
+        int spins = 0, res;
+
+        while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != n + 1) {
+            if (n >= __atomic_load_n(&ex->end, __ATOMIC_ACQUIRE)) {
+                free(pixels);
+                free(buf);
+                return NULL;
+            }
+            backoff(&spins);
+        }
+
+        // The slot is handed back as soon as the frame is out of it
+        if (pixels != NULL) {
+            render_indexed(slot->vram, pixels);
+        }
+        __atomic_store_n(&slot->seq, n + QUEUE_FRAMES, __ATOMIC_RELEASE);
+
+        if (pixels == NULL || buf == NULL) {
+            res = -1;
+            if (ex->format == EXPORT_Y4M) {
+                while (__atomic_load_n(&ex->written, __ATOMIC_ACQUIRE) != n) {
+                    backoff(&spins);
+                }
+                __atomic_store_n(&ex->written, n + 1, __ATOMIC_RELEASE);
+            }
+        } else if (ex->format == EXPORT_PNG) {
+            res = write_png(ex, pixels, buf, n);
+        } else {
+            res = write_y4m(ex, pixels, buf, n);
+        }
+
+        if (res != 0) {
+            __atomic_store_n(&ex->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+int export_format_from_path(const char *path)
+{
+    size_t len = strlen(path);
+
+    if (len >= 4 && strcmp(path + len - 4, ".y4m") == 0) {
+        return EXPORT_Y4M;
+    }
+
+    return EXPORT_PNG;
+}
+
+static void stop_workers(struct export_t *ex, int started)
+{
+    int i;
+
+    __atomic_store_n(&ex->end, ex->head, __ATOMIC_RELEASE);
+    for (i = 0; i < started; ++i) {
+        pthread_join(ex->threads[i], NULL);
+    }
+}
+
+static void destroy(struct export_t *ex)
+{
+    if (ex->video != NULL) {
+        fclose(ex->video);
+    }
+    free(ex->threads);
+    free(ex->slots);
+    free(ex);
+}
+
+struct export_t *export_create(const char *path, int format, int threads)
+{
+    struct export_t *ex;
+    int i;
+
+    if (format != EXPORT_PNG && format != EXPORT_Y4M) {
+        return NULL;
+    }
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    ex = calloc(1, sizeof(*ex));
+    if (ex == NULL) {
+        return NULL;
+    }
+    ex->format = format;
+    ex->path = path;
+    ex->end = ~0ULL;
+    palette_to_yuv(ex->yuv);
+
+    if (posix_memalign((void **)&ex->slots, 64, QUEUE_FRAMES * sizeof(*ex->slots)) != 0) {
+        ex->slots = NULL;
+        destroy(ex);
+        return NULL;
+    }
+    for (i = 0; i < QUEUE_FRAMES; ++i) {
+        ex->slots[i].seq = i;
+    }
+
+    if (format == EXPORT_PNG) {
+        if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+            destroy(ex);
+            return NULL;
+        }
+    } else {
+        ex->video = fopen(path, "wb");
+        if (ex->video == NULL || fputs(Y4M_HEADER, ex->video) == EOF) {
+            destroy(ex);
+            return NULL;
+        }
+    }
+
+    ex->threads = malloc(threads * sizeof(*ex->threads));
+    if (ex->threads == NULL) {
+        destroy(ex);
+        return NULL;
+    }
+    for (i = 0; i < threads; ++i) {
+        if (pthread_create(&ex->threads[i], NULL, worker, ex) != 0) {
+            stop_workers(ex, i);
+            destroy(ex);
+            return NULL;
+        }
+    }
+    ex->nthreads = threads;
+
+    return ex;
+}
+
+int export_frame(struct export_t *ex, const unsigned char *vram)
+{
+    struct slot_t *slot = &ex->slots[ex->head % QUEUE_FRAMES];
+    int spins = 0;
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ex->head) {
+        ++ex->stalls;
+        do {
+            backoff(&spins);
+        } while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ex->head);
+    }
+
+    memcpy(slot->vram, vram, DISPLAY_SIZE);
+    __atomic_store_n(&slot->seq, ex->head + 1, __ATOMIC_RELEASE);
+    ++ex->head;
+
+    return __atomic_load_n(&ex->failed, __ATOMIC_RELAXED) ? -1 : 0;
+}
+
+int export_close(struct export_t *ex, unsigned long long *frames, unsigned long long *stalls)
+{
+    int res;
+
+    stop_workers(ex, ex->nthreads);
+
+    res = ex->failed ? -1 : 0;
+    if (ex->video != NULL && fclose(ex->video) != 0) {
+        res = -1;
+    }
+    ex->video = NULL;
+
+    if (frames != NULL) {
+        *frames = ex->head;
+    }
+    if (stalls != NULL) {
+        *stalls = ex->stalls;
+    }
+
+    destroy(ex);
+    return res;
+}
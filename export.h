@@ -0,0 +1,35 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+/*
+ * Exports frames as a PNG sequence or a Y4M video without a GL context.
+ * export_frame() only copies the VRAM into a lock-free queue; worker
+ * threads encode it. When the workers fall behind export_frame() waits
+ * for a free slot, so no frame is ever dropped however fast the
+ * emulation runs.
+ *
+ * A PNG sequence is written as frame-000000.png, ... into a directory.
+ * A Y4M video is one 4:4:4 stream at the display rate, frames in order.
+ */
+#define EXPORT_PNG (0)
+#define EXPORT_Y4M (1)
+
+struct export_t;
+
+/* threads <= 0 uses one per core. Returns NULL if path can't be written */
+struct export_t *export_create(const char *path, int format, int threads);
+
+/* PNG for a directory, Y4M for a path ending in .y4m */
+int export_format_from_path(const char *path);
+
+/* Returns -1 if writing an earlier frame failed */
+int export_frame(struct export_t *ex, const unsigned char *vram);
+
+/*
+ * Waits for every queued frame to be written, then frees the exporter.
+ * Returns -1 if any write failed. frames and stalls, if not NULL, get
+ * the frames exported and how often export_frame() had to wait.
+ */
+int export_close(struct export_t *ex, unsigned long long *frames, unsigned long long *stalls);
+
+#endif
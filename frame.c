@@ -0,0 +1,24 @@
+#include "frame.h"
+
+#include <stddef.h>
+
+int run_frame(struct cpu_mem_t *machine, void (*vblank)(void *), void *arg)
+{
+    if (execute(machine, CYCLES_BEFORE_VBLANK) == -1) {
+        return -1;
+    }
+
+    generate_intr(machine, 1);
+
+    if (vblank != NULL) {
+        vblank(arg);
+    }
+
+    if (execute(machine, CYCLES_AFTER_VBLANK) == -1) {
+        return -1;
+    }
+
+    generate_intr(machine, 2);
+
+    return 0;
+}
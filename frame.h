@@ -0,0 +1,36 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "8080e.h"
+
+/*
+ * The display is 256*224 in portrait mode at 59.94Hz
+ * Monochrome, one bit per pixel, 32B per scan line.
+ *
+ * According to NTSC, among the 262 scan lines, 224 is used
+ * and the rest is vblank. It generates interrupt (1)
+ * before vblank and interrupt (2) after it. Combining this
+ * with the 2MHz frequency of the 8080, this gives us:
+ *
+ * ns per frame: 1e9/59.94 ~= 16683350ns
+ * cycles per frame: (1/59.94) / (1/2M) ~= 33367
+ * cycles before vblank: 33367 * (224/262) ~= 28527
+ */
+#define DISPLAY_ADDRESS (0x2400)
+#define DISPLAY_WIDTH  (224)
+#define DISPLAY_HEIGHT (256)
+#define BYTES_PER_SCANLINE (DISPLAY_HEIGHT / 8)
+#define DISPLAY_SIZE (DISPLAY_WIDTH * BYTES_PER_SCANLINE)
+#define CYCLES_BEFORE_VBLANK (28527)
+#define CYCLES_AFTER_VBLANK (4839)
+#define CYCLES_PER_FRAME (CYCLES_BEFORE_VBLANK + CYCLES_AFTER_VBLANK)
+#define NS_PER_FRAME (16683350)
+
+/*
+ * Runs one frame: the visible part, interrupt (1), vblank, interrupt (2).
+ * vblank is called right after interrupt (1), when the picture for this
+ * frame is complete, and may be NULL.
+ */
+int run_frame(struct cpu_mem_t *machine, void (*vblank)(void *), void *arg);
+
+#endif
@@ -0,0 +1,252 @@
+#include "framestore.h"
+#include "frame.h"
+#include "hash.h"
+#include "xrle.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_BUCKETS (1024)
+#define MIN_DATA (64 * 1024)
+
+struct blob_t {
+    unsigned long long hash;
+    size_t offset;
+    unsigned int size;
+};
+
+struct framestore_t {
+    int interval;
+    // Unique frames, each one a delta against the one before it
+    struct blob_t *blobs;
+    int unique;
+    int blob_capacity;
+    unsigned char *data;
+    size_t data_size;
+    size_t data_capacity;
+    // The blob of every frame added
+    int *frames;
+    int count;
+    int frame_capacity;
+    // Open addressing from hash to blob, -1 when empty
+    int *buckets;
+    int nbuckets;
+    // The last unique frame, what the next delta is against
+    unsigned char prev[DISPLAY_SIZE];
+    unsigned char delta[XRLE_BOUND(DISPLAY_SIZE)];
+};
+
+static const unsigned char black[DISPLAY_SIZE];
+
+static int grow(void **p, int *capacity, size_t size)
+{
+    int n = *capacity ? *capacity * 2 : 1024;
+    void *q = realloc(*p, n * size);
+
+    if (q == NULL) {
+        return -1;
+    }
+    *p = q;
+    *capacity = n;
+
+    return 0;
+}
+
+static int find_blob(const struct framestore_t *fs, unsigned long long hash)
+{
+    unsigned int mask = fs->nbuckets - 1, i;
+
+    for (i = hash & mask; fs->buckets[i] != -1; i = (i + 1) & mask) {
+        if (fs->blobs[fs->buckets[i]].hash == hash) {
+            return fs->buckets[i];
+        }
+    }
+
+    return -1;
+}
+
+static void insert_blob(struct framestore_t *fs, int blob)
+{
+    unsigned int mask = fs->nbuckets - 1, i;
+
+    for (i = fs->blobs[blob].hash & mask; fs->buckets[i] != -1; i = (i + 1) & mask) {
+    }
+    fs->buckets[i] = blob;
+}
+
+/* Keeps the table at most half full */
+static int grow_buckets(struct framestore_t *fs)
+{
+    int n = fs->nbuckets * 2, i;
+    int *buckets = malloc(n * sizeof(*buckets));
+
+    if (buckets == NULL) {
+        return -1;
+    }
+    memset(buckets, 0xFF, n * sizeof(*buckets));
+
+    free(fs->buckets);
+    fs->buckets = buckets;
+    fs->nbuckets = n;
+    for (i = 0; i < fs->unique; ++i) {
+        insert_blob(fs, i);
+    }
+
+    return 0;
+}
+
+struct framestore_t *framestore_create(int keyframe_interval)
+{
+    struct framestore_t *fs;
+
+    if (keyframe_interval < 1) {
+        return NULL;
+    }
+
+    fs = calloc(1, sizeof(*fs));
+    if (fs == NULL) {
+        return NULL;
+    }
+    fs->interval = keyframe_interval;
+    fs->nbuckets = MIN_BUCKETS;
+    fs->buckets = malloc(MIN_BUCKETS * sizeof(*fs->buckets));
+    if (fs->buckets == NULL) {
+        free(fs);
+        return NULL;
+    }
+    memset(fs->buckets, 0xFF, MIN_BUCKETS * sizeof(*fs->buckets));
+
+    return fs;
+}
+
+void framestore_free(struct framestore_t *fs)
+{
+    free(fs->blobs);
+    free(fs->data);
+    free(fs->frames);
+    free(fs->buckets);
+    free(fs);
+}
+
+void framestore_clear(struct framestore_t *fs)
+{
+    memset(fs->buckets, 0xFF, fs->nbuckets * sizeof(*fs->buckets));
+    fs->unique = 0;
+    fs->data_size = 0;
+    fs->count = 0;
+}
+
+static int add_blob(struct framestore_t *fs, const unsigned char *vram, unsigned long long hash)
+{
+    const unsigned char *base = (fs->unique % fs->interval == 0) ? black : fs->prev;
+    size_t size = xrle_encode(base, vram, DISPLAY_SIZE, fs->delta);
+    struct blob_t *blob;
+
+    if (fs->unique == fs->blob_capacity &&
+        grow((void **)&fs->blobs, &fs->blob_capacity, sizeof(*fs->blobs)) != 0) {
+        return -1;
+    }
+    if ((fs->unique + 1) * 2 > fs->nbuckets && grow_buckets(fs) != 0) {
+        return -1;
+    }
+    if (fs->data_size + size > fs->data_capacity) {
+        size_t n = fs->data_capacity ? fs->data_capacity * 2 : MIN_DATA;
+        unsigned char *data;
+
+        while (n < fs->data_size + size) {
+            n *= 2;
+        }
+        data = realloc(fs->data, n);
+        if (data == NULL) {
+            return -1;
+        }
+        fs->data = data;
+        fs->data_capacity = n;
+    }
+
+    memcpy(fs->data + fs->data_size, fs->delta, size);
+    blob = &fs->blobs[fs->unique];
+    blob->hash = hash;
+    blob->offset = fs->data_size;
+    blob->size = size;
+    fs->data_size += size;
+    memcpy(fs->prev, vram, DISPLAY_SIZE);
+
+    insert_blob(fs, fs->unique);
+    return fs->unique++;
+}
+
+int framestore_add(struct framestore_t *fs, const unsigned char *vram)
+{
+    unsigned long long hash = hash_bytes(vram, DISPLAY_SIZE, 0);
+    int blob = find_blob(fs, hash);
+
+    if (fs->count == fs->frame_capacity &&
+        grow((void **)&fs->frames, &fs->frame_capacity, sizeof(*fs->frames)) != 0) {
+        return -1;
+    }
+    if (blob == -1 && (blob = add_blob(fs, vram, hash)) == -1) {
+        return -1;
+    }
+
+    fs->frames[fs->count] = blob;
+    return fs->count++;
+}
+
+/* Applies the deltas of blobs first..last into buf */
+static void apply_chain(const struct framestore_t *fs, unsigned char *buf, int first, int last)
+{
+    int i;
+
+    for (i = first; i <= last; ++i) {
+        const struct blob_t *blob = &fs->blobs[i];
+
+        xrle_apply(buf, DISPLAY_SIZE, fs->data + blob->offset, blob->size);
+    }
+}
+
+int framestore_gather(const struct framestore_t *fs, const int *indices, int n, unsigned char *out)
+{
+    const unsigned char *last = NULL;
+    int last_blob = -1, i;
+
+    for (i = 0; i < n; ++i) {
+        unsigned char *buf = out + (size_t)i * DISPLAY_SIZE;
+        int blob, key;
+
+        if (indices[i] < 0 || indices[i] >= fs->count) {
+            return -1;
+        }
+        blob = fs->frames[indices[i]];
+        key = blob - blob % fs->interval;
+
+        if (last != NULL && last_blob >= key && last_blob <= blob) {
+            memcpy(buf, last, DISPLAY_SIZE);
+            apply_chain(fs, buf, last_blob + 1, blob);
+        } else {
+            memset(buf, 0, DISPLAY_SIZE);
+            apply_chain(fs, buf, key, blob);
+        }
+
+        last = buf;
+        last_blob = blob;
+    }
+
+    return 0;
+}
+
+int framestore_frames(const struct framestore_t *fs)
+{
+    return fs->count;
+}
+
+int framestore_unique(const struct framestore_t *fs)
+{
+    return fs->unique;
+}
+
+size_t framestore_bytes(const struct framestore_t *fs)
+{
+    return fs->data_size + fs->unique * sizeof(*fs->blobs) + fs->count * sizeof(*fs->frames) +
+           fs->nbuckets * sizeof(*fs->buckets) + sizeof(*fs);
+}
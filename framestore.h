@@ -0,0 +1,43 @@
+#ifndef FRAMESTORE_H
+#define FRAMESTORE_H
+
+#include <stddef.h>
+
+/*
+ * Compressed frame storage for experience replay. Frames are kept as the
+ * 1bpp VRAM, DISPLAY_SIZE bytes, and content addressed: a frame already
+ * in the store, found by its hash, is stored again as just an index.
+ * Every other frame is the XOR+RLE delta (see xrle.h) against the unique
+ * frame before it, and every keyframe_interval unique frames the chain
+ * starts over from an all black screen.
+ *
+ * The store only grows, framestore_clear() empties it.
+ */
+struct framestore_t;
+
+struct framestore_t *framestore_create(int keyframe_interval);
+
+void framestore_free(struct framestore_t *fs);
+
+void framestore_clear(struct framestore_t *fs);
+
+/* Returns the index of the frame, -1 when out of memory */
+int framestore_add(struct framestore_t *fs, const unsigned char *vram);
+
+/*
+ * Decodes frames indices[0..n) into out, DISPLAY_SIZE bytes each.
+ * Decoding walks the chain from its keyframe, or from the frame gathered
+ * just before when it is earlier in the same chain, so sorted indices are
+ * the fastest. Returns -1 if an index is out of range.
+ */
+int framestore_gather(const struct framestore_t *fs, const int *indices, int n, unsigned char *out);
+
+int framestore_frames(const struct framestore_t *fs);
+
+/* Frames that are not a repeat of one already stored */
+int framestore_unique(const struct framestore_t *fs);
+
+/* Memory used by deltas and indexes, not counting allocation slack */
+size_t framestore_bytes(const struct framestore_t *fs);
+
+#endif
@@ -0,0 +1,132 @@
+#include "gamefeatures.h"
+#include "savestate.h"
+
+#include <stddef.h>
+
+#define FIELD_BYTES (0)
+// Two bytes of BCD, least significant first
+#define FIELD_BCD (1)
+// The high byte of the address is the current player's page
+#define FIELD_PAGED (2)
+// The current player's page itself, stored as 0 or 1
+#define FIELD_PAGE (3)
+
+#define FIELD(name, address, count, kind) \
+    { offsetof(struct features_t, name) / sizeof(unsigned short), address, count, kind }
+
+struct feature_field_t {
+    unsigned short column;
+    unsigned short address;
+    unsigned short count;
+    unsigned short kind;
+};
+
+struct features_layout_t {
+    unsigned long long rom_hash;
+    const char *name;
+    // Holds the page of the current player, first_page for player 1
+    unsigned short page_address;
+    unsigned char first_page;
+    const struct feature_field_t *fields;
+    int count;
+};
+
+/*
+ * From the annotations in disasm. Player data lives on page 21 for
+ * player 1 and 22 for player 2, (2067) says which one is playing; the
+ * rack is reset to 0x01 at 2100 - 2136 by 01C0. The shot and alien shot
+ * addresses are the ones 03FC - 041B and 05B4 - 05ED keep the positions in.
+ */
+static const struct feature_field_t invaders_fields[] = {
+    FIELD(playing, 0x20EF, 1, FIELD_BYTES),
+    FIELD(player, 0x2067, 1, FIELD_PAGE),
+    FIELD(two_players, 0x20CE, 1, FIELD_BYTES),
+    FIELD(coins, 0x20EB, 1, FIELD_BYTES),
+    FIELD(player_alive, 0x2015, 1, FIELD_BYTES),
+    FIELD(player_x, 0x201B, 1, FIELD_BYTES),
+    FIELD(shot_state, 0x2025, 1, FIELD_BYTES),
+    FIELD(shot_x, 0x202A, 1, FIELD_BYTES),
+    FIELD(shot_y, 0x2029, 1, FIELD_BYTES),
+    FIELD(rack_x, 0x200A, 1, FIELD_BYTES),
+    FIELD(rack_y, 0x2009, 1, FIELD_BYTES),
+    FIELD(alien_shot_x, 0x207C, 1, FIELD_BYTES),
+    FIELD(alien_shot_y, 0x207B, 1, FIELD_BYTES),
+    FIELD(score[0], 0x20F8, 1, FIELD_BCD),
+    FIELD(score[1], 0x20FC, 1, FIELD_BCD),
+    FIELD(lives[0], 0x21FF, 1, FIELD_BYTES),
+    FIELD(lives[1], 0x22FF, 1, FIELD_BYTES),
+    FIELD(aliens, 0x2100, FEATURES_ALIENS, FIELD_PAGED),
+};
+
+static const struct features_layout_t layouts[] = {
+    {
+        0x333FBB8D1F3AD365ULL, "Space Invaders (Midway)", 0x2067, 0x21,
+        invaders_fields, sizeof(invaders_fields) / sizeof(invaders_fields[0]),
+    },
+};
+
+const struct features_layout_t *features_layout(struct cpu_mem_t *machine)
+{
+    unsigned long long hash = rom_hash(machine);
+    unsigned int i;
+
+    for (i = 0; i < sizeof(layouts) / sizeof(layouts[0]); ++i) {
+        if (layouts[i].rom_hash == hash) {
+            return &layouts[i];
+        }
+    }
+
+    return NULL;
+}
+
+const char *features_name(const struct features_layout_t *layout)
+{
+    return layout->name;
+}
+
+void features_extract(const struct features_layout_t *layout, const struct cpu_mem_t *machine,
+                      struct features_t *features)
+{
+    unsigned short *out = (unsigned short *)features;
+    unsigned char page = *MACHINE_RAM(machine, layout->page_address);
+    int i, j;
+
+    for (i = 0; i < layout->count; ++i) {
+        const struct feature_field_t *field = &layout->fields[i];
+        const unsigned char *p = MACHINE_RAM(machine, field->address);
+        unsigned short *value = out + field->column;
+
+        switch (field->kind) {
+            case FIELD_BCD:
+                *value = (p[1] >> 4) * 1000 + (p[1] & 0x0F) * 100 + (p[0] >> 4) * 10 + (p[0] & 0x0F);
+                break;
+            case FIELD_PAGE:
+                *value = (unsigned char)(*p - layout->first_page);
+                break;
+            case FIELD_PAGED:
+                // Masked into RAM like the CPU does, in case it is garbage
+                p = machine->ram + (((page << 8) | (field->address & 0xFF)) & (RAM_SIZE - 1));
+                // fallthrough
+            default:
+                for (j = 0; j < field->count; ++j) {
+                    value[j] = p[j];
+                }
+        }
+    }
+}
+
+void features_batch(const struct features_layout_t *layout, struct cpu_mem_t *const *machines, int n,
+                    float *matrix)
+{
+    struct features_t features;
+    const unsigned short *values = (const unsigned short *)&features;
+    unsigned int j;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        features_extract(layout, machines[i], &features);
+        for (j = 0; j < FEATURES_COLUMNS; ++j) {
+            *matrix++ = values[j];
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef GAMEFEATURES_H
+#define GAMEFEATURES_H
+
+#include "8080e.h"
+
+/*
+ * Game state read straight from RAM at a frame boundary, for agents that
+ * learn from state instead of pixels. Where each value lives depends on
+ * the program, so the addresses come from a table of known ROMs, looked
+ * up by rom_hash().
+ *
+ * Every value is widened to an unsigned short so the struct is a fixed
+ * array of FEATURES_COLUMNS values and a row of the feature matrix is
+ * the struct in declaration order.
+ */
+#define FEATURES_ALIENS (55)
+
+struct features_t {
+    unsigned short playing;
+    // 0 for player 1, 1 for player 2
+    unsigned short player;
+    unsigned short two_players;
+    unsigned short coins;
+    // 0xFF while alive, the explosion animation otherwise
+    unsigned short player_alive;
+    unsigned short player_x;
+    unsigned short shot_state;
+    unsigned short shot_x;
+    unsigned short shot_y;
+    // Position of the reference alien the rack is drawn from
+    unsigned short rack_x;
+    unsigned short rack_y;
+    // 0, 0 when no alien shot is tracked
+    unsigned short alien_shot_x;
+    unsigned short alien_shot_y;
+    unsigned short score[2];
+    unsigned short lives[2];
+    // Aliens of the current player, 1 if still standing
+    unsigned short aliens[FEATURES_ALIENS];
+};
+
+#define FEATURES_COLUMNS (sizeof(struct features_t) / sizeof(unsigned short))
+
+struct features_layout_t;
+
+/* The layout for the ROM in machine, NULL if it isn't a known one */
+const struct features_layout_t *features_layout(struct cpu_mem_t *machine);
+
+/* Name of the program a layout describes */
+const char *features_name(const struct features_layout_t *layout);
+
+void features_extract(const struct features_layout_t *layout, const struct cpu_mem_t *machine,
+                      struct features_t *features);
+
+/* Fills n rows of FEATURES_COLUMNS values, one per machine */
+void features_batch(const struct features_layout_t *layout, struct cpu_mem_t *const *machines, int n,
+                    float *matrix);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Fast non-cryptographic 64 bit hash for RAM, VRAM and state
+ * comparisons. Consumes 8 bytes per round.
+ */
+static inline unsigned long long hash_mix(unsigned long long h)
+{
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline unsigned long long hash_bytes(const void *data, size_t len, unsigned long long seed)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    unsigned long long h = seed ^ (len * 0x9E3779B97F4A7C15ULL);
+    unsigned long long w;
+
+    while (len >= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ hash_mix(w)) * 0x9E3779B97F4A7C15ULL;
+        p += 8;
+        len -= 8;
+    }
+
+    w = 0;
+    memcpy(&w, p, len);
+    h = (h ^ hash_mix(w)) * 0x9E3779B97F4A7C15ULL;
+
+    return hash_mix(h);
+}
+
+#endif
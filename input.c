@@ -0,0 +1,68 @@
+#include "input.h"
+
+unsigned short keyboard_to_mask(const struct keyboard_t *keyboard)
+{
+    unsigned short mask = 0;
+
+    mask |= keyboard->coin ? KEY_COIN : 0;
+    mask |= keyboard->p1_start ? KEY_P1_START : 0;
+    mask |= keyboard->p1_shoot ? KEY_P1_SHOOT : 0;
+    mask |= keyboard->p1_left ? KEY_P1_LEFT : 0;
+    mask |= keyboard->p1_right ? KEY_P1_RIGHT : 0;
+    mask |= keyboard->p2_start ? KEY_P2_START : 0;
+    mask |= keyboard->p2_shoot ? KEY_P2_SHOOT : 0;
+    mask |= keyboard->p2_left ? KEY_P2_LEFT : 0;
+    mask |= keyboard->p2_right ? KEY_P2_RIGHT : 0;
+
+    return mask;
+}
+
+void mask_to_keyboard(unsigned short mask, struct keyboard_t *keyboard)
+{
+    keyboard->coin = (mask & KEY_COIN) != 0;
+    keyboard->p1_start = (mask & KEY_P1_START) != 0;
+    keyboard->p1_shoot = (mask & KEY_P1_SHOOT) != 0;
+    keyboard->p1_left = (mask & KEY_P1_LEFT) != 0;
+    keyboard->p1_right = (mask & KEY_P1_RIGHT) != 0;
+    keyboard->p2_start = (mask & KEY_P2_START) != 0;
+    keyboard->p2_shoot = (mask & KEY_P2_SHOOT) != 0;
+    keyboard->p2_left = (mask & KEY_P2_LEFT) != 0;
+    keyboard->p2_right = (mask & KEY_P2_RIGHT) != 0;
+}
+
+unsigned short demo_keys(int frame)
+{
+    unsigned short keys = 0;
+
+    if (frame >= 60 && frame < 66) {
+        return KEY_COIN;
+    }
+    if (frame >= 120 && frame < 126) {
+        return KEY_P1_START;
+    }
+    if (frame < 240) {
+        return 0;
+    }
+
+    switch ((frame / 90) % 4) {
+        case 0:
+            keys |= KEY_P1_LEFT;
+            break;
+        case 2:
+            keys |= KEY_P1_RIGHT;
+            break;
+        default:
+            break;
+    }
+
+    if ((frame % 24) < 4) {
+        keys |= KEY_P1_SHOOT;
+    }
+
+    // Start the next game once this one is over
+    if ((frame % 1200) < 6) {
+        keys |= ((frame / 1200) % 2) ? KEY_P1_START : KEY_COIN;
+    }
+
+    return keys;
+}
@@ -0,0 +1,28 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include "8080e.h"
+
+/* keyboard_t packed into one bit per field, in declaration order */
+#define KEY_COIN     (0x001)
+#define KEY_P1_START (0x002)
+#define KEY_P1_SHOOT (0x004)
+#define KEY_P1_LEFT  (0x008)
+#define KEY_P1_RIGHT (0x010)
+#define KEY_P2_START (0x020)
+#define KEY_P2_SHOOT (0x040)
+#define KEY_P2_LEFT  (0x080)
+#define KEY_P2_RIGHT (0x100)
+#define KEY_MASK     (0x1FF)
+
+unsigned short keyboard_to_mask(const struct keyboard_t *keyboard);
+
+void mask_to_keyboard(unsigned short mask, struct keyboard_t *keyboard);
+
+/*
+ * A canned input script for headless runs: insert a coin, start a one
+ * player game and then keep walking left and right while shooting.
+ */
+unsigned short demo_keys(int frame);
+
+#endif
@@ -0,0 +1,368 @@
+#include "8080e.h"
+#include "frame.h"
+#include "hash.h"
+#include "input.h"
+#include "trace.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Differential validation. Runs a candidate engine and the reference
+ * interpreter side by side on the same ROM and input, one instruction
+ * at a time, and compares registers, flags and a RAM hash at the chosen
+ * granularity. On a mismatch it bisects from the last matching point to
+ * the first instruction whose result differs and dumps both machines.
+ */
+#define DEFAULT_FRAMES (3600)
+#define MAX_RAM_DIFFS (32)
+
+#define GRANULARITY_INSTRUCTION (0)
+#define GRANULARITY_BLOCK       (1)
+#define GRANULARITY_FRAME       (2)
+
+struct options_t {
+    const char *bin_name;
+    int engine;
+    int granularity;
+    int frames;
+};
+
+/* One machine plus where it is in the frame, like run_frame() tracks it */
+struct side_t {
+    const char *name;
+    struct cpu_mem_t *machine;
+    struct keyboard_t keyboard;
+    int phase;
+    int cycle;
+    int frame;
+};
+
+struct snapshot_t {
+    struct cpu_regs_t regs;
+    unsigned char ram[RAM_SIZE];
+    int phase;
+    int cycle;
+    int frame;
+};
+
+static const int phase_cycles[2] = { CYCLES_BEFORE_VBLANK, CYCLES_AFTER_VBLANK };
+
+static struct options_t options;
+static struct side_t ref, cand;
+static struct snapshot_t ref_snap, cand_snap;
+
+static void usage()
+{
+    printf("Usage: lockstep [-e ENGINE] [-g instruction|block|frame] [-f FRAMES] <ROM FILE>\n");
+}
+
+static void parse_options(int argc, char **argv)
+{
+    int opt;
+
+    options.engine = ENGINE_TABLE;
+    options.granularity = GRANULARITY_BLOCK;
+    options.frames = DEFAULT_FRAMES;
+
+    while ((opt = getopt(argc, argv, "e:g:f:")) != -1) {
+        switch (opt) {
+            case 'e':
+                options.engine = engine_from_name(optarg);
+                break;
+            case 'g':
+                if (strcmp(optarg, "instruction") == 0) {
+                    options.granularity = GRANULARITY_INSTRUCTION;
+                } else if (strcmp(optarg, "block") == 0) {
+                    options.granularity = GRANULARITY_BLOCK;
+                } else if (strcmp(optarg, "frame") == 0) {
+                    options.granularity = GRANULARITY_FRAME;
+                } else {
+                    options.granularity = -1;
+                }
+                break;
+            case 'f':
+                options.frames = atoi(optarg);
+                break;
+            default:
+                usage();
+                ABORT(("Invalid options.\n"));
+        }
+    }
+
+    if (optind >= argc || options.engine < 0 || options.granularity < 0) {
+        usage();
+        ABORT(("Invalid options.\n"));
+    }
+
+    options.bin_name = argv[optind];
+}
+
+static void init_side(struct side_t *side, const char *name, int engine)
+{
+    side->name = name;
+    side->machine = init_machine(options.bin_name, &side->keyboard);
+    if (side->machine == NULL) {
+        ABORT(("can't load %s\n", options.bin_name));
+    }
+    if (set_engine(side->machine, engine) != 0) {
+        ABORT(("unknown engine\n"));
+    }
+    side->phase = 0;
+    side->cycle = 0;
+    side->frame = 0;
+}
+
+/*
+ * Returns 1 if an interrupt was raised after the instruction, -1 if the
+ * machine stopped. Both stopping alike is a clean end, anything else a
+ * divergence.
+ */
+static int side_step(struct side_t *side)
+{
+    int cycle;
+
+    if (side->phase == 0 && side->cycle == 0) {
+        mask_to_keyboard(demo_keys(side->frame), &side->keyboard);
+    }
+
+    cycle = step(side->machine);
+    if (cycle == -1) {
+        return -1;
+    }
+
+    side->cycle += cycle;
+    if (side->cycle < phase_cycles[side->phase]) {
+        return 0;
+    }
+
+    generate_intr(side->machine, side->phase + 1);
+    side->cycle = 0;
+    side->phase ^= 1;
+    if (side->phase == 0) {
+        ++side->frame;
+    }
+
+    return 1;
+}
+
+static void save(struct side_t *side, struct snapshot_t *snap)
+{
+    get_regs(side->machine, &snap->regs);
+    memcpy(snap->ram, side->machine->ram, RAM_SIZE);
+    snap->phase = side->phase;
+    snap->cycle = side->cycle;
+    snap->frame = side->frame;
+}
+
+static void restore(struct side_t *side, const struct snapshot_t *snap)
+{
+    set_regs(side->machine, &snap->regs);
+    write_ram(side->machine, 0, snap->ram, RAM_SIZE);
+    side->phase = snap->phase;
+    side->cycle = snap->cycle;
+    side->frame = snap->frame;
+    mask_to_keyboard(demo_keys(side->frame), &side->keyboard);
+}
+
+static int same_regs(const struct cpu_regs_t *a, const struct cpu_regs_t *b)
+{
+    return a->pc == b->pc && a->sp == b->sp && a->bc == b->bc &&
+           a->de == b->de && a->hl == b->hl && a->a == b->a && a->f == b->f &&
+           a->intr == b->intr && a->pending_intr == b->pending_intr &&
+           a->shift_reg == b->shift_reg && a->shift_reg_offset == b->shift_reg_offset;
+}
+
+static int same_state()
+{
+    struct cpu_regs_t a, b;
+
+    get_regs(ref.machine, &a);
+    get_regs(cand.machine, &b);
+
+    return same_regs(&a, &b) &&
+           machine_error(ref.machine) == machine_error(cand.machine) &&
+           ref.phase == cand.phase && ref.cycle == cand.cycle &&
+           hash_bytes(ref.machine->ram, RAM_SIZE, 0) ==
+           hash_bytes(cand.machine->ram, RAM_SIZE, 0);
+}
+
+static void print_regs(const char *name, const struct side_t *side)
+{
+    struct cpu_regs_t r;
+
+    get_regs(side->machine, &r);
+
+    printf("%-10s pc=0x%04x sp=0x%04x a=0x%02x bc=0x%04x de=0x%04x hl=0x%04x "
+           "f=0x%02x [%c%c%c%c%c] intr=%d pending=%d shift=0x%04x/%d frame=%d phase=%d cycle=%d\n",
+           name, r.pc, r.sp, r.a, r.bc, r.de, r.hl, r.f,
+           (r.f & 0x80) ? 'S' : '-', (r.f & 0x40) ? 'Z' : '-', (r.f & 0x10) ? 'A' : '-',
+           (r.f & 0x04) ? 'P' : '-', (r.f & 0x01) ? 'C' : '-',
+           r.intr, r.pending_intr, r.shift_reg, r.shift_reg_offset,
+           side->frame, side->phase, side->cycle);
+    if (machine_error(side->machine) != I8080_OK) {
+        printf("%-10s stopped: %s\n", "", machine_error_name(machine_error(side->machine)));
+    }
+}
+
+/* A byte of code as the reference sees it, pc may have left the ROM */
+static unsigned char code_byte(unsigned short address)
+{
+    return address >= RAM_ADDRESS ? ref.machine->ram[address & (RAM_SIZE - 1)] : ref.machine->rom[address];
+}
+
+static void dump_divergence(unsigned long long index)
+{
+    const unsigned char *a = ref.machine->ram;
+    const unsigned char *b = cand.machine->ram;
+    struct cpu_regs_t r;
+    int i, diffs = 0;
+
+    get_regs(ref.machine, &r);
+
+    printf("\nLast matching state, before instruction %llu:\n", index);
+    print_regs("both", &ref);
+    printf("Instruction: 0x%04x %s", r.pc, trace_mnemonic(code_byte(r.pc)));
+    for (i = 0; i < trace_ins_length(code_byte(r.pc)); ++i) {
+        printf(" %02x", code_byte(r.pc + i));
+    }
+    printf("\n\nAfter it:\n");
+
+    side_step(&ref);
+    side_step(&cand);
+
+    print_regs(ref.name, &ref);
+    print_regs(cand.name, &cand);
+
+    for (i = 0; i < RAM_SIZE; ++i) {
+        if (a[i] != b[i]) {
+            if (diffs++ < MAX_RAM_DIFFS) {
+                printf("ram 0x%04x: %s=0x%02x %s=0x%02x\n", RAM_ADDRESS + i, ref.name, a[i], cand.name, b[i]);
+            }
+        }
+    }
+    if (diffs > MAX_RAM_DIFFS) {
+        printf("... %d RAM bytes differ\n", diffs);
+    }
+}
+
+/*
+ * Both sides matched in the snapshots and differ after count more
+ * instructions. Finds the first instruction whose result differs.
+ */
+static void bisect(unsigned long long base, unsigned long long count)
+{
+    unsigned long long lo = 0, hi = count, mid, i;
+
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+
+        restore(&ref, &ref_snap);
+        restore(&cand, &cand_snap);
+        for (i = 0; i < mid; ++i) {
+            side_step(&ref);
+            side_step(&cand);
+        }
+
+        if (same_state()) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    restore(&ref, &ref_snap);
+    restore(&cand, &cand_snap);
+    for (i = 0; i < lo; ++i) {
+        side_step(&ref);
+        side_step(&cand);
+    }
+
+    dump_divergence(base + lo + 1);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long long index = 0, synced = 0;
+    int boundary, stopped;
+
+    parse_options(argc, argv);
+
+    init_side(&ref, "reference", ENGINE_REFERENCE);
+    init_side(&cand, "candidate", options.engine);
+
+    save(&ref, &ref_snap);
+    save(&cand, &cand_snap);
+
+    while (ref.frame < options.frames) {
+        unsigned short pc;
+        unsigned char op;
+        int frame = ref.frame;
+        struct cpu_regs_t r;
+
+        get_regs(ref.machine, &r);
+        pc = r.pc;
+        op = code_byte(pc);
+
+        boundary = side_step(&ref);
+        stopped = boundary < 0;
+        stopped |= side_step(&cand) < 0;
+        ++index;
+
+        if (stopped) {
+            int ref_stopped = machine_error(ref.machine) != I8080_OK;
+            int cand_stopped = machine_error(cand.machine) != I8080_OK;
+
+            // Stopping the same way in the same state is agreeing
+            if (ref_stopped && cand_stopped && same_state()) {
+                printf("both stopped at instruction %llu (frame %d), identical: %s\n", index, ref.frame,
+                       machine_error_name(machine_error(ref.machine)));
+                deinit_machine(ref.machine);
+                deinit_machine(cand.machine);
+                return 0;
+            }
+
+            printf("%s stopped at instruction %llu (frame %d)\n",
+                   ref_stopped && cand_stopped ? "both" : ref_stopped ? ref.name : cand.name, index, ref.frame);
+            bisect(synced, index - synced);
+            return 1;
+        }
+
+        switch (options.granularity) {
+            case GRANULARITY_INSTRUCTION:
+                boundary = 1;
+                break;
+            case GRANULARITY_BLOCK:
+                get_regs(ref.machine, &r);
+                boundary |= (r.pc != (unsigned short)(pc + trace_ins_length(op)));
+                break;
+            default:
+                boundary = (ref.frame != frame);
+                break;
+        }
+
+        if (!boundary) {
+            continue;
+        }
+
+        if (!same_state()) {
+            printf("Divergence detected at instruction %llu (frame %d)\n", index, ref.frame);
+            bisect(synced, index - synced);
+            return 1;
+        }
+
+        save(&ref, &ref_snap);
+        save(&cand, &cand_snap);
+        synced = index;
+    }
+
+    printf("%d frames, %llu instructions identical\n", options.frames, index);
+
+    deinit_machine(ref.machine);
+    deinit_machine(cand.machine);
+
+    return 0;
+}
@@ -1,42 +1,63 @@
 #include "8080e.h"
+#include "bus.h"
+#include "frame.h"
+#include "input.h"
+#include "movie.h"
+#include "rewind.h"
+#include "trace.h"
 #include "utils.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <GL/gl.h>
 #include <GL/glut.h>
+#include <signal.h>
 #include <time.h>
 #include <unistd.h>
 
-#define DISPLAY_ADDRESS (0x2400)
-
 /*
- * The display is 256*224 in portrait mode at 59.94Hz
- * Monochrome, one bit per pixel, 32B per scan line.
- *
- * According to NTSC, among the 262 scan lines, 224 is used
- * and the rest is vblank. It generates interrupt (1)
- * before vblank and interrupt (2) after it. Combining this
- * with the 2MHz frequency of the 8080, this gives us:
- *
- * ns per frame: 1e9/59.94 ~= 16683350ns
- * cycles per frame: (1/59.94) / (1/2M) ~= 33367
- * cycles before vblank: 33367 * (224/262) ~= 28527
+ * Speed control. A speed of 0 means unthrottled: the machine runs flat
+ * out and the window is only refreshed at the display rate. When the
+ * host cannot keep up with real time we drop presentation (never
+ * emulation) for up to max_frameskip frames in a row. If we fall more
+ * than MAX_LAG_FRAMES behind we give up catching up and resync.
  */
-#define DISPLAY_WIDTH  (224)
-#define DISPLAY_HEIGHT (256)
-#define BYTES_PER_SCANLINE (DISPLAY_HEIGHT / 8)
-#define CYCLES_BEFORE_VBLANK (28527)
-#define CYCLES_AFTER_VBLANK (4839)
-#define NS_PER_FRAME (16683350)
+#define MIN_SPEED (0.25f)
+#define MAX_SPEED (16.0f)
+#define DEFAULT_FRAMESKIP (4)
+#define MAX_LAG_FRAMES (30)
+
+/* Rewind history, a full RAM copy every REWIND_KEYFRAMES frames */
+#define REWIND_KEYFRAMES (60)
+#define REWIND_BYTES_PER_SECOND (64 * 1024)
+#define KEY_BACKSPACE (0x08)
 
 struct options_t {
     const char *bin_name;
     float scale;
+    float speed;
+    int max_frameskip;
+    const char *stats_path;
+    const char *trace_path;
+    int engine;
+    const char *record_path;
+    const char *play_path;
+    int rewind_seconds;
+    const char *bus_name;
 };
 
 static unsigned char *display;
-static unsigned long long last_duration;
+static unsigned long long next_frame;
+static unsigned long long last_present;
+static int skipped;
+static volatile sig_atomic_t stats_requested;
+static struct movie_t *recording;
+static struct movie_t *playback;
+static int played;
+static struct rewind_t *history;
+static int rewinding;
 static struct cpu_mem_t *machine;
+static struct bus_t *bus;
 static struct options_t options;
 static struct keyboard_t keyboard;
 static int window;
@@ -51,25 +72,96 @@ static unsigned long long get_ns()
 
 static void usage()
 {
-    printf("Usage: a.out <ROM FILE>\n");
+    printf("Usage: a.out [-s SPEED] [-k MAX FRAMESKIP] [-S STATS FILE] [-T TRACE FILE] [-e ENGINE] [-r MOVIE] [-p MOVIE] [-R SECONDS] [-B NAME] <ROM FILE> [SCALE]\n");
+    printf("  -s SPEED  speed multiplier, 0 runs unthrottled (default 1)\n");
+    printf("  -k N      drop at most N frames in a row when behind (default %d)\n", DEFAULT_FRAMESKIP);
+    printf("  -S FILE   dump opcode statistics (CSV, or JSON for *.json) at exit\n");
+    printf("            and on SIGUSR1, needs a core built with STATS=1\n");
+    printf("  -T FILE   record a binary execution trace, written on a crash,\n");
+    printf("            ABORT or exit, decode it with tracedump\n");
+    printf("  -e NAME   instruction engine, reference (default) or table\n");
+    printf("  -r FILE   record the inputs of this session as a movie\n");
+    printf("  -p FILE   play the inputs of a movie, use replay to play it headless\n");
+    printf("  -R N      keep N seconds of rewind history, hold backspace to rewind\n");
+    printf("  -B NAME   publish frames, RAM and counters on the shared memory bus NAME\n");
+    printf("Keys: + / - change speed, 1 real time, t toggle unthrottled\n");
 }
 
 static void parse_options(int argc, char **argv)
 {
-    if (argc < 2) {
+    int opt;
+
+    options.scale = 1.0f;
+    options.speed = 1.0f;
+    options.max_frameskip = DEFAULT_FRAMESKIP;
+
+    while ((opt = getopt(argc, argv, "s:k:S:T:e:r:p:R:B:")) != -1) {
+        switch (opt) {
+            case 's':
+                options.speed = atof(optarg);
+                break;
+            case 'k':
+                options.max_frameskip = atoi(optarg);
+                break;
+            case 'S':
+                options.stats_path = optarg;
+                break;
+            case 'T':
+                options.trace_path = optarg;
+                break;
+            case 'e':
+                options.engine = engine_from_name(optarg);
+                if (options.engine < 0) {
+                    usage();
+                    ABORT(("Unknown engine %s.\n", optarg));
+                }
+                break;
+            case 'r':
+                options.record_path = optarg;
+                break;
+            case 'p':
+                options.play_path = optarg;
+                break;
+            case 'R':
+                options.rewind_seconds = atoi(optarg);
+                break;
+            case 'B':
+                options.bus_name = optarg;
+                break;
+            default:
+                usage();
+                ABORT(("Invalid options.\n"));
+        }
+    }
+
+    if (optind >= argc) {
         usage();
         ABORT(("Invalid options.\n"));
     }
 
-    options.bin_name = argv[1];
-    options.scale = 1.0f;
+    // Rewinding would desync a movie from the machine
+    if (options.rewind_seconds > 0 && (options.record_path || options.play_path)) {
+        usage();
+        ABORT(("-R can't be combined with -r or -p.\n"));
+    }
+
+    options.bin_name = argv[optind];
 
-    if (argc > 2) {
-        options.scale = atof(argv[2]);
+    if (argc > optind + 1) {
+        options.scale = atof(argv[optind + 1]);
     }
     if (options.scale < 0.5f) {
         options.scale = 0.5f;
     }
+    if (options.speed != 0.0f && options.speed < MIN_SPEED) {
+        options.speed = MIN_SPEED;
+    }
+    if (options.speed > MAX_SPEED) {
+        options.speed = MAX_SPEED;
+    }
+    if (options.max_frameskip < 0) {
+        options.max_frameskip = 0;
+    }
 }
 
 static void draw_ptr(int x, int y)
@@ -122,37 +214,114 @@ static void draw()
     glFlush();
 }
 
-static void display_loop()
+static void set_speed(float speed)
 {
-    unsigned long long now, then;
+    char title[64];
 
-    then = get_ns();
+    options.speed = speed;
+    next_frame = get_ns();
 
-    if (execute(machine, CYCLES_BEFORE_VBLANK) == -1) {
-        draw();
-        sleep(2);
-        exit(0);
+    if (speed == 0.0f) {
+        snprintf(title, sizeof(title), "Space Invaders (unthrottled)");
+    } else {
+        snprintf(title, sizeof(title), "Space Invaders (x%g)", speed);
+    }
+    glutSetWindowTitle(title);
+}
+
+static int should_present(unsigned long long now)
+{
+    if (options.speed == 0.0f || options.speed > 1.0f) {
+        // Faster than real time, decimate to the display rate
+        return (now - last_present >= NS_PER_FRAME);
     }
 
-    generate_intr(machine, 1);
+    // Real time or slower, skip presentation while we are behind
+    if (now > next_frame + NS_PER_FRAME && skipped < options.max_frameskip) {
+        return 0;
+    }
 
+    return 1;
+}
+
+static void draw_frame(void *arg)
+{
     draw();
+}
+
+static int run_frame_inputs(int present)
+{
+    // Inputs only change at frame boundaries while recording or playing
+    if (playback != NULL && played < playback->frames) {
+        mask_to_keyboard(playback->keys[played++], &keyboard);
+    }
+    if (recording != NULL && movie_record(recording, keyboard_to_mask(&keyboard)) != 0) {
+        ABORT(("OOM\n"));
+    }
+
+    if (run_frame(machine, present ? draw_frame : NULL, NULL) == -1) {
+        return -1;
+    }
+
+    if (history != NULL) {
+        rewind_push(history, machine);
+    }
+    if (bus != NULL) {
+        bus_publish(bus, machine);
+    }
+
+    return 0;
+}
+
+static void display_loop()
+{
+    unsigned long long now;
+    int present;
+
+    if (stats_requested) {
+        stats_requested = 0;
+        dump_stats(machine, options.stats_path);
+    }
+
+    now = get_ns();
+    if (next_frame == 0) {
+        next_frame = now;
+    }
+
+    present = should_present(now);
+
+    if (rewinding) {
+        if (rewind_step_back(history, machine) == 0 && present) {
+            draw();
+        }
+    } else if (run_frame_inputs(present) == -1) {
+        int error = machine_error(machine);
 
-    if (execute(machine, CYCLES_AFTER_VBLANK) == -1) {
+        printf("Machine stopped: %s\n", machine_error_name(error));
         draw();
         sleep(2);
-        exit(0);
+        exit(error == I8080_HALTED ? 0 : 1);
     }
 
-    generate_intr(machine, 2);
+    if (present) {
+        last_present = now;
+        skipped = 0;
+    } else {
+        ++skipped;
+    }
 
-    //printf("Last frame took %llu to render\n", last_duration);
+    if (options.speed == 0.0f) {
+        next_frame = get_ns();
+        return;
+    }
 
-    now = get_ns();
-    last_duration = now - then;
+    next_frame += (unsigned long long)(NS_PER_FRAME / options.speed);
 
-    if (last_duration < NS_PER_FRAME) {
-        usleep((NS_PER_FRAME - last_duration) / 1000);
+    now = get_ns();
+    if (now < next_frame) {
+        usleep((next_frame - now) / 1000);
+    } else if (now - next_frame > MAX_LAG_FRAMES * (unsigned long long)NS_PER_FRAME) {
+        next_frame = now;
     }
 }
 
@@ -184,10 +353,43 @@ static unsigned char *get_key(unsigned char encoding)
     return NULL;
 }
 
+static void speed_key(unsigned char key)
+{
+    float speed = (options.speed == 0.0f ? 1.0f : options.speed);
+
+    switch (key) {
+        case '+':
+        case '=':
+            if (speed * 2 <= MAX_SPEED) {
+                set_speed(speed * 2);
+            }
+            break;
+        case '-':
+            if (speed / 2 >= MIN_SPEED) {
+                set_speed(speed / 2);
+            }
+            break;
+        case '1':
+            set_speed(1.0f);
+            break;
+        case 't':
+            set_speed(options.speed == 0.0f ? 1.0f : 0.0f);
+            break;
+        default:
+            break;
+    }
+}
+
 static void keyPressed(unsigned char key, int x, int y)
 {
     unsigned char *p = get_key(key);
 
+    speed_key(key);
+
+    if (key == KEY_BACKSPACE && history != NULL) {
+        rewinding = 1;
+    }
+
     if (p != NULL) {
         *p = 1;
     }
@@ -201,6 +403,10 @@ static void keyUp(unsigned char key, int x, int y)
         exit(0);
     }
 
+    if (key == KEY_BACKSPACE) {
+        rewinding = 0;
+    }
+
     if (p != NULL) {
         *p = 0;
     }
@@ -216,13 +422,36 @@ static void start_gl_loop(int argc, char **argv)
     glutKeyboardFunc(keyPressed);
     glutKeyboardUpFunc(keyUp);
 
-    display = machine->mem + DISPLAY_ADDRESS;
+    display = MACHINE_RAM(machine, DISPLAY_ADDRESS);
+    set_speed(options.speed);
     glutIdleFunc(display_loop);
     glutMainLoop();
 }
 
+static void stats_signal(int sig)
+{
+    stats_requested = 1;
+}
+
 static void exit_handler(void)
 {
+    if (options.stats_path != NULL) {
+        dump_stats(machine, options.stats_path);
+    }
+    if (options.trace_path != NULL) {
+        dump_trace(machine, options.trace_path);
+    }
+    if (recording != NULL) {
+        movie_save(recording, options.record_path);
+    }
+    if (history != NULL) {
+        printf("Rewind history: %d frames in %zu KB, %zu KB per minute\n",
+               rewind_frames(history), rewind_bytes(history) / 1024,
+               rewind_bytes_per_minute(history) / 1024);
+    }
+    if (bus != NULL) {
+        bus_free(bus);
+    }
     deinit_machine(machine);
     glutDestroyWindow(window);
 }
@@ -234,9 +463,54 @@ int main(int argc, char **argv)
     parse_options(argc, argv);
 
     machine = init_machine(options.bin_name, &keyboard);
+    if (machine == NULL) {
+        ABORT(("can't load %s\n", options.bin_name));
+    }
+
+    set_engine(machine, options.engine);
+
+    if (options.play_path != NULL) {
+        playback = movie_load(options.play_path);
+        if (playback == NULL || movie_start(playback, machine) != 0) {
+            ABORT(("can't play %s\n", options.play_path));
+        }
+    }
+
+    if (options.rewind_seconds > 0) {
+        history = rewind_create(options.rewind_seconds * 60,
+                                (size_t)options.rewind_seconds * REWIND_BYTES_PER_SECOND + 4 * RAM_SIZE,
+                                REWIND_KEYFRAMES);
+        if (history == NULL) {
+            ABORT(("OOM\n"));
+        }
+        rewind_push(history, machine);
+    }
+
+    if (options.record_path != NULL) {
+        recording = movie_create(machine);
+        if (recording == NULL) {
+            ABORT(("OOM\n"));
+        }
+    }
+
+    if (options.bus_name != NULL) {
+        bus = bus_create(options.bus_name, BUS_DEFAULT_SLOTS, rom_hash(machine));
+        if (bus == NULL) {
+            ABORT(("can't publish on %s\n", options.bus_name));
+        }
+    }
+
+    if (options.trace_path != NULL &&
+        enable_trace(machine, TRACE_DEFAULT_KB, options.trace_path) != 0) {
+        ABORT(("enabling the trace failed\n"));
+    }
 
     atexit(exit_handler);
 
+    if (options.stats_path != NULL) {
+        signal(SIGUSR1, stats_signal);
+    }
+
     start_gl_loop(argc, argv);
 
     return 0;
@@ -0,0 +1,267 @@
+#include "memo.h"
+#include "frame.h"
+#include "hash.h"
+#include "xrle.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define NONE (-1)
+
+struct memo_entry_t {
+    unsigned long long key;
+    unsigned long long result;
+    struct cpu_regs_t regs;
+    unsigned int cycles;
+    unsigned int delta_size;
+    unsigned char *delta;
+    // Hash chain and LRU list, as indices into entries
+    int next;
+    int newer;
+    int older;
+};
+
+struct memo_t {
+    struct memo_entry_t *entries;
+    int *buckets;
+    int bucket_mask;
+    int capacity;
+    int count;
+    int free;
+    int newest;
+    int oldest;
+    size_t max_bytes;
+    int verify_every;
+    struct memo_stats_t stats;
+    unsigned char before[RAM_SIZE];
+    unsigned char ram[RAM_SIZE];
+    unsigned char scratch[XRLE_BOUND(RAM_SIZE)];
+};
+
+struct memo_t *memo_create(size_t max_entries, size_t max_bytes, int verify_every)
+{
+    struct memo_t *memo;
+    int i;
+
+    if (max_entries < 1 || max_entries > 0x10000000) {
+        return NULL;
+    }
+
+    memo = calloc(1, sizeof(*memo));
+    if (memo == NULL) {
+        return NULL;
+    }
+
+    for (memo->bucket_mask = 1; memo->bucket_mask < (int)max_entries; memo->bucket_mask <<= 1) {
+    }
+    --memo->bucket_mask;
+
+    memo->entries = calloc(max_entries, sizeof(*memo->entries));
+    memo->buckets = malloc((memo->bucket_mask + 1) * sizeof(*memo->buckets));
+    if (memo->entries == NULL || memo->buckets == NULL) {
+        memo_free(memo);
+        return NULL;
+    }
+
+    for (i = 0; i <= memo->bucket_mask; ++i) {
+        memo->buckets[i] = NONE;
+    }
+    for (i = 0; i < (int)max_entries; ++i) {
+        memo->entries[i].next = i + 1 < (int)max_entries ? i + 1 : NONE;
+    }
+
+    memo->capacity = max_entries;
+    memo->free = 0;
+    memo->newest = NONE;
+    memo->oldest = NONE;
+    memo->max_bytes = max_bytes;
+    memo->verify_every = verify_every;
+
+    return memo;
+}
+
+void memo_free(struct memo_t *memo)
+{
+    int i;
+
+    if (memo->entries != NULL) {
+        for (i = 0; i < memo->capacity; ++i) {
+            free(memo->entries[i].delta);
+        }
+    }
+    free(memo->entries);
+    free(memo->buckets);
+    free(memo);
+}
+
+static void unlink_lru(struct memo_t *memo, int i)
+{
+    struct memo_entry_t *e = &memo->entries[i];
+
+    if (e->newer != NONE) {
+        memo->entries[e->newer].older = e->older;
+    } else {
+        memo->newest = e->older;
+    }
+    if (e->older != NONE) {
+        memo->entries[e->older].newer = e->newer;
+    } else {
+        memo->oldest = e->newer;
+    }
+}
+
+static void push_newest(struct memo_t *memo, int i)
+{
+    struct memo_entry_t *e = &memo->entries[i];
+
+    e->newer = NONE;
+    e->older = memo->newest;
+    if (memo->newest != NONE) {
+        memo->entries[memo->newest].newer = i;
+    } else {
+        memo->oldest = i;
+    }
+    memo->newest = i;
+}
+
+static int lookup(struct memo_t *memo, unsigned long long key)
+{
+    int i;
+
+    for (i = memo->buckets[key & memo->bucket_mask]; i != NONE; i = memo->entries[i].next) {
+        if (memo->entries[i].key == key) {
+            return i;
+        }
+    }
+
+    return NONE;
+}
+
+static void evict_oldest(struct memo_t *memo)
+{
+    int i = memo->oldest;
+    struct memo_entry_t *e = &memo->entries[i];
+    int *link;
+
+    for (link = &memo->buckets[e->key & memo->bucket_mask]; *link != i; link = &memo->entries[*link].next) {
+    }
+    *link = e->next;
+
+    unlink_lru(memo, i);
+
+    memo->stats.bytes -= e->delta_size;
+    free(e->delta);
+    e->delta = NULL;
+
+    e->next = memo->free;
+    memo->free = i;
+    --memo->count;
+    ++memo->stats.evictions;
+}
+
+static void insert(struct memo_t *memo, unsigned long long key, struct cpu_mem_t *machine,
+                   unsigned int cycles)
+{
+    struct memo_entry_t *e;
+    size_t size;
+    int i;
+
+    size = xrle_encode(memo->before, machine->ram, RAM_SIZE, memo->scratch);
+    if (size > memo->max_bytes) {
+        return;
+    }
+
+    while (memo->free == NONE || memo->stats.bytes + size > memo->max_bytes) {
+        evict_oldest(memo);
+    }
+
+    i = memo->free;
+    e = &memo->entries[i];
+
+    e->delta = malloc(size ? size : 1);
+    if (e->delta == NULL) {
+        return;
+    }
+    memcpy(e->delta, memo->scratch, size);
+    memo->free = e->next;
+
+    e->key = key;
+    e->result = state_hash(machine);
+    get_regs(machine, &e->regs);
+    e->cycles = cycles;
+    e->delta_size = size;
+
+    e->next = memo->buckets[key & memo->bucket_mask];
+    memo->buckets[key & memo->bucket_mask] = i;
+    push_newest(memo, i);
+
+    memo->stats.bytes += size;
+    ++memo->count;
+}
+
+static int emulate(struct memo_t *memo, struct cpu_mem_t *machine, unsigned int *cycles)
+{
+    unsigned long long c0, c1, n;
+
+    get_counters(machine, &c0, &n);
+    if (run_frame(machine, NULL, NULL) == -1) {
+        return -1;
+    }
+    get_counters(machine, &c1, &n);
+    *cycles = c1 - c0;
+
+    return 0;
+}
+
+int memo_frame(struct memo_t *memo, struct cpu_mem_t *machine, unsigned short keys)
+{
+    unsigned long long key = hash_mix(state_hash(machine) ^ keys);
+    struct memo_entry_t *e;
+    unsigned int cycles;
+    int i;
+
+    i = lookup(memo, key);
+
+    if (i == NONE) {
+        ++memo->stats.misses;
+
+        memcpy(memo->before, machine->ram, RAM_SIZE);
+        if (emulate(memo, machine, &cycles) == -1) {
+            return -1;
+        }
+        insert(memo, key, machine, cycles);
+
+        return 0;
+    }
+
+    e = &memo->entries[i];
+    ++memo->stats.hits;
+    memo->stats.skipped_cycles += e->cycles;
+    unlink_lru(memo, i);
+    push_newest(memo, i);
+
+    if (memo->verify_every > 0 && memo->stats.hits % memo->verify_every == 0) {
+        ++memo->stats.verified;
+        if (emulate(memo, machine, &cycles) == -1) {
+            return -1;
+        }
+        memo->stats.skipped_cycles -= e->cycles;
+        if (state_hash(machine) != e->result || cycles != e->cycles) {
+            ++memo->stats.mismatches;
+        }
+        return 0;
+    }
+
+    memcpy(memo->ram, machine->ram, RAM_SIZE);
+    xrle_apply(memo->ram, RAM_SIZE, e->delta, e->delta_size);
+    write_ram(machine, 0, memo->ram, RAM_SIZE);
+    set_regs(machine, &e->regs);
+
+    return 0;
+}
+
+void memo_stats(const struct memo_t *memo, struct memo_stats_t *stats)
+{
+    *stats = memo->stats;
+    stats->entries = memo->count;
+}
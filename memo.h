@@ -0,0 +1,48 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include "8080e.h"
+
+#include <stddef.h>
+
+/*
+ * Frame memoization. A frame is a pure function of the machine state at
+ * the frame boundary and the keys held during it, so the cache maps
+ * (state_hash(), keys) to the registers after the frame and the XOR+RLE
+ * delta of RAM across it. A hit applies those instead of emulating.
+ *
+ * The cache is an LRU bounded by max_entries and by max_bytes of deltas.
+ * With verify_every set, every verify_every-th hit is emulated anyway and
+ * compared against the cached result.
+ *
+ * Hits don't advance the machine's cycle and instruction counters, the
+ * cycles they stood for are counted in memo_stats_t instead. state_hash()
+ * is O(1) only in a core built with ENABLE_STATE_HASH.
+ */
+struct memo_stats_t {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long verified;
+    unsigned long long mismatches;
+    unsigned long long skipped_cycles;
+    size_t entries;
+    size_t bytes;
+};
+
+struct memo_t;
+
+struct memo_t *memo_create(size_t max_entries, size_t max_bytes, int verify_every);
+
+void memo_free(struct memo_t *memo);
+
+/*
+ * Runs one frame, like run_frame() without a vblank callback. keys must
+ * be what the machine's keyboard is set to for this frame. Returns -1 if
+ * the machine stopped.
+ */
+int memo_frame(struct memo_t *memo, struct cpu_mem_t *machine, unsigned short keys);
+
+void memo_stats(const struct memo_t *memo, struct memo_stats_t *stats);
+
+#endif
@@ -0,0 +1,208 @@
+#include "movie.h"
+#include "bytes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned char *put_varint(unsigned char *p, unsigned int v)
+{
+    while (v >= 0x80) {
+        *p++ = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+struct movie_t *movie_create(struct cpu_mem_t *machine)
+{
+    struct movie_t *movie;
+
+    movie = calloc(1, sizeof(*movie));
+    if (movie == NULL) {
+        return NULL;
+    }
+
+    movie->rom_hash = rom_hash(machine);
+    movie->has_state = 1;
+    savestate_write(machine, movie->state);
+
+    return movie;
+}
+
+int movie_record(struct movie_t *movie, unsigned short keys)
+{
+    if (movie->frames == movie->capacity) {
+        int capacity = movie->capacity ? movie->capacity * 2 : 4096;
+        unsigned short *p = realloc(movie->keys, capacity * sizeof(*p));
+
+        if (p == NULL) {
+            return -1;
+        }
+        movie->keys = p;
+        movie->capacity = capacity;
+    }
+
+    movie->keys[movie->frames++] = keys;
+
+    return 0;
+}
+
+int movie_save(const struct movie_t *movie, const char *path)
+{
+    unsigned char header[MOVIE_HEADER_SIZE];
+    unsigned char *events, *p;
+    unsigned short prev = 0;
+    int i, last = 0, res = 0;
+    FILE *out;
+
+    // Worst case is one 3 byte gap and a 2 byte XOR per frame
+    events = malloc((size_t)movie->frames * 5 + 1);
+    if (events == NULL) {
+        return -1;
+    }
+
+    p = events;
+    for (i = 0; i < movie->frames; ++i) {
+        if (movie->keys[i] != prev) {
+            p = put_varint(p, i - last);
+            p = put16(p, movie->keys[i] ^ prev);
+            prev = movie->keys[i];
+            last = i;
+        }
+    }
+
+    memcpy(header, MOVIE_MAGIC, 4);
+    put32(put64(put16(put16(header + 4, MOVIE_VERSION), movie->has_state ? MOVIE_HAS_STATE : 0),
+                movie->rom_hash), movie->frames);
+    put32(header + 20, p - events);
+
+    out = fopen(path, "wb");
+    if (out == NULL) {
+        perror("fopen() failed");
+        free(events);
+        return -1;
+    }
+
+    if (fwrite(header, 1, sizeof(header), out) != sizeof(header) ||
+        (movie->has_state && fwrite(movie->state, 1, SAVESTATE_SIZE, out) != SAVESTATE_SIZE) ||
+        fwrite(events, 1, p - events, out) != (size_t)(p - events)) {
+        res = -1;
+    }
+
+    fclose(out);
+    free(events);
+
+    return res;
+}
+
+struct movie_t *movie_load(const char *path)
+{
+    unsigned char header[MOVIE_HEADER_SIZE];
+    struct movie_t *movie = NULL;
+    unsigned char *events = NULL, *p, *end;
+    unsigned short keys = 0;
+    unsigned int size;
+    int frame = 0, i;
+    FILE *in;
+
+    in = fopen(path, "rb");
+    if (in == NULL) {
+        perror("fopen() failed");
+        return NULL;
+    }
+
+    if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+        memcmp(header, MOVIE_MAGIC, 4) != 0 ||
+        get16(header + 4) != MOVIE_VERSION) {
+        printf("%s is not a movie\n", path);
+        goto fail;
+    }
+
+    movie = calloc(1, sizeof(*movie));
+    if (movie == NULL) {
+        goto fail;
+    }
+
+    movie->has_state = (header[6] & MOVIE_HAS_STATE) != 0;
+    movie->rom_hash = get64(header + 8);
+    movie->frames = get32(header + 16);
+    movie->capacity = movie->frames;
+    size = get32(header + 20);
+    if (movie->frames < 0) {
+        printf("%s is corrupted\n", path);
+        goto fail;
+    }
+
+    movie->keys = malloc((size_t)movie->frames * sizeof(*movie->keys) + 1);
+    events = malloc(size + 1);
+    if (movie->keys == NULL || events == NULL ||
+        (movie->has_state && fread(movie->state, 1, SAVESTATE_SIZE, in) != SAVESTATE_SIZE) ||
+        fread(events, 1, size, in) != size) {
+        printf("%s is truncated\n", path);
+        goto fail;
+    }
+
+    p = events;
+    end = events + size;
+    while (p < end) {
+        unsigned int gap = 0;
+        int shift = 0;
+
+        // A u32 takes at most 5 bytes
+        do {
+            gap |= (unsigned int)(*p & 0x7F) << shift;
+            shift += 7;
+        } while ((*p++ & 0x80) && p < end && shift < 35);
+
+        if ((p[-1] & 0x80) || end - p < 2 || gap > (unsigned int)(movie->frames - frame)) {
+            printf("%s is corrupted\n", path);
+            goto fail;
+        }
+
+        for (i = 0; i < gap; ++i) {
+            movie->keys[frame++] = keys;
+        }
+        keys ^= get16(p);
+        p += 2;
+    }
+
+    while (frame < movie->frames) {
+        movie->keys[frame++] = keys;
+    }
+
+    free(events);
+    fclose(in);
+
+    return movie;
+
+fail:
+    free(events);
+    if (movie != NULL) {
+        movie_free(movie);
+    }
+    fclose(in);
+
+    return NULL;
+}
+
+int movie_start(const struct movie_t *movie, struct cpu_mem_t *machine)
+{
+    if (movie->rom_hash != rom_hash(machine)) {
+        printf("movie was recorded with a different ROM\n");
+        return -1;
+    }
+
+    if (movie->has_state) {
+        savestate_read(machine, movie->state);
+    }
+
+    return 0;
+}
+
+void movie_free(struct movie_t *movie)
+{
+    free(movie->keys);
+    free(movie);
+}
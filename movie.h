@@ -0,0 +1,48 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include "savestate.h"
+
+/*
+ * Input movie: the keyboard bitmask (see input.h) for every frame plus
+ * the state the machine started from, so a run can be reproduced
+ * exactly. Keys for frame n are applied right before run_frame().
+ *
+ * File layout, little endian:
+ *   "I8MV", u16 version, u16 flags, u64 ROM hash, u32 frames,
+ *   u32 event bytes, savestate if MOVIE_HAS_STATE, events
+ *
+ * Each event is a varint number of frames since the previous event and
+ * a u16 XOR of the keys that changed. Frames without an event keep the
+ * keys of the frame before.
+ */
+#define MOVIE_MAGIC "I8MV"
+#define MOVIE_VERSION (1)
+#define MOVIE_HEADER_SIZE (24)
+#define MOVIE_HAS_STATE (0x0001)
+
+struct movie_t {
+    unsigned long long rom_hash;
+    int has_state;
+    unsigned char state[SAVESTATE_SIZE];
+    unsigned short *keys;
+    int frames;
+    int capacity;
+};
+
+/* Starts a recording from the current state of machine */
+struct movie_t *movie_create(struct cpu_mem_t *machine);
+
+/* Appends the keys of the next frame, -1 when out of memory */
+int movie_record(struct movie_t *movie, unsigned short keys);
+
+int movie_save(const struct movie_t *movie, const char *path);
+
+struct movie_t *movie_load(const char *path);
+
+/* Puts machine in the starting state, fails if the ROM does not match */
+int movie_start(const struct movie_t *movie, struct cpu_mem_t *machine);
+
+void movie_free(struct movie_t *movie);
+
+#endif
@@ -0,0 +1,250 @@
+#include "png.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define WINDOW (32768)
+#define HASH_BITS (13)
+#define MIN_MATCH (3)
+#define MAX_MATCH (258)
+
+struct bits_t {
+    unsigned char *p;
+    unsigned int acc;
+    int count;
+};
+
+static const unsigned short length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+
+static const unsigned char length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+static const unsigned short dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+
+static const unsigned char dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+/* Deflate fields go out least significant bit first */
+static void put_bits(struct bits_t *bits, unsigned int value, int count)
+{
+    bits->acc |= value << bits->count;
+    bits->count += count;
+    while (bits->count >= 8) {
+        *bits->p++ = bits->acc;
+        bits->acc >>= 8;
+        bits->count -= 8;
+    }
+}
+
+/* Huffman codes go out most significant bit first */
+static void put_code(struct bits_t *bits, unsigned int code, int count)
+{
+    unsigned int reversed = 0;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    put_bits(bits, reversed, count);
+}
+
+/* Fixed literal/length code of RFC 1951 3.2.6 */
+static void put_symbol(struct bits_t *bits, int symbol)
+{
+    if (symbol < 144) {
+        put_code(bits, 0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        put_code(bits, 0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        put_code(bits, symbol - 256, 7);
+    } else {
+        put_code(bits, 0xC0 + symbol - 280, 8);
+    }
+}
+
+static void put_match(struct bits_t *bits, int length, int distance)
+{
+    int i = 28, j = 29;
+
+    while (length_base[i] > length) {
+        --i;
+    }
+    put_symbol(bits, 257 + i);
+    put_bits(bits, length - length_base[i], length_extra[i]);
+
+    while (dist_base[j] > distance) {
+        --j;
+    }
+    put_code(bits, j, 5);
+    put_bits(bits, distance - dist_base[j], dist_extra[j]);
+}
+
+static unsigned int hash3(const unsigned char *p)
+{
+    return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* One final fixed Huffman block, returns the end of the output */
+static unsigned char *deflate(const unsigned char *in, size_t len, unsigned char *out)
+{
+    struct bits_t bits = { out, 0, 0 };
+    int *head = malloc((1 << HASH_BITS) * sizeof(*head));
+    size_t i = 0;
+
+    if (head == NULL) {
+        return NULL;
+    }
+    memset(head, 0xFF, (1 << HASH_BITS) * sizeof(*head));
+
+    put_bits(&bits, 1, 1);
+    put_bits(&bits, 1, 2);
+
+    while (i < len) {
+        int length = 0;
+
+        if (i + MIN_MATCH <= len) {
+            unsigned int h = hash3(in + i);
+            int candidate = head[h];
+
+            head[h] = i;
+            if (candidate >= 0 && i - candidate <= WINDOW) {
+                size_t max = len - i < MAX_MATCH ? len - i : MAX_MATCH;
+
+                while (length < max && in[candidate + length] == in[i + length]) {
+                    ++length;
+                }
+            }
+
+            if (length >= MIN_MATCH) {
+                size_t end = i + length;
+
+                put_match(&bits, length, i - candidate);
+                for (++i; i < end; ++i) {
+                    if (i + MIN_MATCH <= len) {
+                        head[hash3(in + i)] = i;
+                    }
+                }
+                continue;
+            }
+        }
+
+        put_symbol(&bits, in[i++]);
+    }
+
+    put_symbol(&bits, 256);
+    if (bits.count > 0) {
+        *bits.p++ = bits.acc;
+    }
+
+    free(head);
+    return bits.p;
+}
+
+static void put32(unsigned char *p, unsigned int v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static unsigned int crc32(const unsigned int *table, const unsigned char *p, size_t len)
+{
+    unsigned int crc = 0xFFFFFFFF;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc ^ 0xFFFFFFFF;
+}
+
+/* Chunk data has to be at p + 8 already, returns the end of the chunk */
+static unsigned char *finish_chunk(const unsigned int *table, unsigned char *p, const char *type, size_t len)
+{
+    put32(p, len);
+    memcpy(p + 4, type, 4);
+    put32(p + 8 + len, crc32(table, p + 4, len + 4));
+
+    return p + 12 + len;
+}
+
+size_t png_encode(const unsigned char *pixels, int width, int height,
+                  const unsigned char (*palette)[3], int colors, unsigned char *out)
+{
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    unsigned int table[256], adler_a = 1, adler_b = 0;
+    int stride = (width + 3) / 4 + 1, x, y, i;
+    unsigned char *raw, *p = out, *z;
+    size_t raw_size = (size_t)stride * height, k;
+
+    for (i = 0; i < 256; ++i) {
+        unsigned int c = i;
+        int j;
+
+        for (j = 0; j < 8; ++j) {
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+    }
+
+    // Scanlines of 2 bit pixels, each behind filter type 0
+    raw = calloc(1, raw_size);
+    if (raw == NULL) {
+        return 0;
+    }
+    for (y = 0; y < height; ++y) {
+        unsigned char *row = raw + (size_t)y * stride + 1;
+
+        for (x = 0; x < width; ++x) {
+            row[x / 4] |= (pixels[(size_t)y * width + x] & 3) << (6 - 2 * (x % 4));
+        }
+    }
+
+    memcpy(p, signature, sizeof(signature));
+    p += sizeof(signature);
+
+    put32(p + 8, width);
+    put32(p + 12, height);
+    p[16] = 2;
+    p[17] = 3;
+    p[18] = 0;
+    p[19] = 0;
+    p[20] = 0;
+    p = finish_chunk(table, p, "IHDR", 13);
+
+    memcpy(p + 8, palette, colors * 3);
+    p = finish_chunk(table, p, "PLTE", colors * 3);
+
+    // zlib stream: header, deflate, Adler-32 of the raw data
+    z = p + 8;
+    z[0] = 0x78;
+    z[1] = 0x01;
+    z = deflate(raw, raw_size, z + 2);
+    if (z == NULL) {
+        free(raw);
+        return 0;
+    }
+    for (k = 0; k < raw_size; ++k) {
+        adler_a = (adler_a + raw[k]) % 65521;
+        adler_b = (adler_b + adler_a) % 65521;
+    }
+    put32(z, adler_b << 16 | adler_a);
+    p = finish_chunk(table, p, "IDAT", z + 4 - (p + 8));
+
+    p = finish_chunk(table, p, "IEND", 0);
+
+    free(raw);
+    return p - out;
+}
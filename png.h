@@ -0,0 +1,20 @@
+#ifndef PNG_H
+#define PNG_H
+
+#include <stddef.h>
+
+/*
+ * Minimal PNG encoder for palette images with at most 4 colours, stored
+ * 2 bits per pixel. Compression is a built-in deflate: greedy LZ77 with
+ * the fixed Huffman codes, which is plenty for mostly black frames.
+ */
+#define PNG_BOUND(width, height) ((size_t)(height) * ((width) / 4 + 2) * 9 / 8 + 1024)
+
+/*
+ * pixels holds width * height palette indexes, top row first. Writes the
+ * whole file to out, at least PNG_BOUND() bytes, and returns its size.
+ */
+size_t png_encode(const unsigned char *pixels, int width, int height,
+                  const unsigned char (*palette)[3], int colors, unsigned char *out);
+
+#endif
@@ -0,0 +1,183 @@
+#include "preprocess.h"
+#include "frame.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define ROWS (DISPLAY_HEIGHT)
+
+struct preprocess_t {
+    int width;
+    int height;
+    int depth;
+    size_t frame_size;
+    // Scanlines [col_lo, col_hi) make output column c
+    unsigned short col_lo[DISPLAY_WIDTH];
+    unsigned short col_hi[DISPLAY_WIDTH];
+    // Bit positions within a scanline [bit_lo, bit_hi) make output row r
+    unsigned short bit_lo[ROWS];
+    unsigned short bit_hi[ROWS];
+    // 16.16 factor turning a count of lit pixels into 0-255, per output pixel
+    unsigned int *scale;
+};
+
+struct preprocess_t *preprocess_create(int width, int height, int depth)
+{
+    struct preprocess_t *pp;
+    int c, r;
+
+    if (width <= 0 || width > DISPLAY_WIDTH || height <= 0 || height > ROWS || depth <= 0) {
+        return NULL;
+    }
+
+    pp = calloc(1, sizeof(*pp));
+    if (pp == NULL) {
+        return NULL;
+    }
+
+    pp->scale = malloc(width * height * sizeof(*pp->scale));
+    if (pp->scale == NULL) {
+        free(pp);
+        return NULL;
+    }
+
+    pp->width = width;
+    pp->height = height;
+    pp->depth = depth;
+    pp->frame_size = (size_t)width * height;
+
+    for (c = 0; c < width; ++c) {
+        pp->col_lo[c] = c * DISPLAY_WIDTH / width;
+        pp->col_hi[c] = (c + 1) * DISPLAY_WIDTH / width;
+    }
+
+    // Row 0 is the top of the upright picture, which is the last bit
+    for (r = 0; r < height; ++r) {
+        pp->bit_lo[r] = ROWS - (r + 1) * ROWS / height;
+        pp->bit_hi[r] = ROWS - r * ROWS / height;
+    }
+
+    for (r = 0; r < height; ++r) {
+        for (c = 0; c < width; ++c) {
+            unsigned int area = (pp->col_hi[c] - pp->col_lo[c]) * (pp->bit_hi[r] - pp->bit_lo[r]);
+
+            pp->scale[r * width + c] = (255u << 16) / area;
+        }
+    }
+
+    return pp;
+}
+
+void preprocess_free(struct preprocess_t *pp)
+{
+    free(pp->scale);
+    free(pp);
+}
+
+size_t preprocess_ring_size(const struct preprocess_t *pp)
+{
+    return (2 * pp->depth - 1) * pp->frame_size;
+}
+
+/* Adds one to counts[p] for every bit p that is set in either scanline */
+static void count_scanline(const unsigned char *a, const unsigned char *b, unsigned char *counts)
+{
+#ifdef __SSE2__
+    const __m128i bits = _mm_set_epi8((char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+                                      (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+    __m128i *acc = (__m128i *)counts;
+    int half;
+
+    for (half = 0; half < BYTES_PER_SCANLINE / 16; ++half) {
+        __m128i v = _mm_or_si128(_mm_loadu_si128((const __m128i *)a + half),
+                                 _mm_loadu_si128((const __m128i *)b + half));
+        __m128i lo = _mm_unpacklo_epi8(v, v), hi = _mm_unpackhi_epi8(v, v);
+        __m128i q0 = _mm_unpacklo_epi16(lo, lo), q1 = _mm_unpackhi_epi16(lo, lo);
+        __m128i q2 = _mm_unpacklo_epi16(hi, hi), q3 = _mm_unpackhi_epi16(hi, hi);
+
+        // Every byte spread over 8 lanes, two bytes per vector, and the
+        // compare gives -1 where the bit is on
+#define COUNT(i, q) acc[half * 8 + (i)] = _mm_sub_epi8(acc[half * 8 + (i)], \
+                        _mm_cmpeq_epi8(_mm_and_si128((q), bits), bits))
+        COUNT(0, _mm_unpacklo_epi32(q0, q0));
+        COUNT(1, _mm_unpackhi_epi32(q0, q0));
+        COUNT(2, _mm_unpacklo_epi32(q1, q1));
+        COUNT(3, _mm_unpackhi_epi32(q1, q1));
+        COUNT(4, _mm_unpacklo_epi32(q2, q2));
+        COUNT(5, _mm_unpackhi_epi32(q2, q2));
+        COUNT(6, _mm_unpacklo_epi32(q3, q3));
+        COUNT(7, _mm_unpackhi_epi32(q3, q3));
+#undef COUNT
+    }
+#else
+    int i, j;
+
+    for (i = 0; i < BYTES_PER_SCANLINE; ++i) {
+        unsigned char v = a[i] | b[i];
+
+        for (j = 0; j < 8; ++j) {
+            counts[i * 8 + j] += (v >> j) & 1;
+        }
+    }
+#endif
+}
+
+static void store(const struct preprocess_t *pp, const unsigned char *vram, const unsigned char *prev,
+                  unsigned char *out, unsigned char *copy)
+{
+    unsigned char counts[ROWS] __attribute__((aligned(16)));
+    int c, r, l, p;
+
+    for (c = 0; c < pp->width; ++c) {
+        memset(counts, 0, sizeof(counts));
+        for (l = pp->col_lo[c]; l < pp->col_hi[c]; ++l) {
+            count_scanline(vram + l * BYTES_PER_SCANLINE, prev + l * BYTES_PER_SCANLINE, counts);
+        }
+
+        for (r = 0; r < pp->height; ++r) {
+            unsigned int lit = 0, v;
+            unsigned char px;
+
+            for (p = pp->bit_lo[r]; p < pp->bit_hi[r]; ++p) {
+                lit += counts[p];
+            }
+
+            v = (lit * pp->scale[r * pp->width + c] + 0x8000) >> 16;
+            px = v > 255 ? 255 : v;
+
+            out[r * pp->width + c] = px;
+            if (copy != NULL) {
+                copy[r * pp->width + c] = px;
+            }
+        }
+    }
+}
+
+void preprocess_reset(const struct preprocess_t *pp, const unsigned char *vram, unsigned char *ring)
+{
+    int slot;
+
+    store(pp, vram, vram, ring, NULL);
+    for (slot = 1; slot < 2 * pp->depth - 1; ++slot) {
+        memcpy(ring + slot * pp->frame_size, ring, pp->frame_size);
+    }
+}
+
+void preprocess_frame(const struct preprocess_t *pp, const unsigned char *vram, const unsigned char *prev,
+                      unsigned char *ring, unsigned long long t)
+{
+    int slot = t % pp->depth;
+
+    store(pp, vram, prev, ring + slot * pp->frame_size,
+          slot < pp->depth - 1 ? ring + (slot + pp->depth) * pp->frame_size : NULL);
+}
+
+const unsigned char *preprocess_stack(const struct preprocess_t *pp, const unsigned char *ring,
+                                      unsigned long long t)
+{
+    return ring + ((t + 1) % pp->depth) * pp->frame_size;
+}
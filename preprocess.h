@@ -0,0 +1,38 @@
+#ifndef PREPROCESS_H
+#define PREPROCESS_H
+
+#include <stddef.h>
+
+/*
+ * Observation preprocessing for learning agents, straight from 1bpp VRAM:
+ * the last two frames are max-pooled (an OR, the display being 1bpp),
+ * the upright 224x256 picture is box filtered down to width x height
+ * grayscale bytes, and the result is stacked depth frames deep.
+ *
+ * Stacking needs no copies because the caller owned ring holds 2*depth-1
+ * frames and every frame is stored at slot t % depth and, when that is
+ * below depth-1, again depth slots later. The depth frames ending with
+ * frame t are then always contiguous, oldest first, at
+ * preprocess_stack().
+ */
+struct preprocess_t;
+
+/* Returns NULL unless 0 < width <= 224, 0 < height <= 256 and 0 < depth */
+struct preprocess_t *preprocess_create(int width, int height, int depth);
+
+void preprocess_free(struct preprocess_t *pp);
+
+size_t preprocess_ring_size(const struct preprocess_t *pp);
+
+/* Fills the whole ring with vram, as frame 0 and everything before it */
+void preprocess_reset(const struct preprocess_t *pp, const unsigned char *vram, unsigned char *ring);
+
+/* Pools vram with prev, the frame before it, and stores the result as frame t */
+void preprocess_frame(const struct preprocess_t *pp, const unsigned char *vram, const unsigned char *prev,
+                      unsigned char *ring, unsigned long long t);
+
+/* depth * height * width bytes ending with frame t */
+const unsigned char *preprocess_stack(const struct preprocess_t *pp, const unsigned char *ring,
+                                      unsigned long long t);
+
+#endif
@@ -0,0 +1,243 @@
+#include "remote.h"
+#include "bytes.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct remote_t {
+    int fd;
+    // Request being sent, header and payload in one write
+    unsigned char *buf;
+    size_t capacity;
+};
+
+/* A server that went away is an error, not a SIGPIPE for the process */
+static int write_all(int fd, const unsigned char *p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int read_all(int fd, unsigned char *p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+struct remote_t *remote_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    struct remote_t *remote;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return NULL;
+    }
+
+    remote = calloc(1, sizeof(*remote));
+    if (remote == NULL) {
+        return NULL;
+    }
+    remote->capacity = REMOTE_HEADER_SIZE + SAVESTATE_SIZE;
+    remote->buf = malloc(remote->capacity);
+    remote->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (remote->buf == NULL || remote->fd == -1) {
+        if (remote->fd != -1) {
+            close(remote->fd);
+        }
+        free(remote->buf);
+        free(remote);
+        return NULL;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(remote->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        remote_close(remote);
+        return NULL;
+    }
+
+    return remote;
+}
+
+void remote_close(struct remote_t *remote)
+{
+    close(remote->fd);
+    free(remote->buf);
+    free(remote);
+}
+
+/* Room for the header and len bytes of payload */
+static unsigned char *request(struct remote_t *remote, size_t len)
+{
+    if (REMOTE_HEADER_SIZE + len > remote->capacity) {
+        unsigned char *buf = realloc(remote->buf, REMOTE_HEADER_SIZE + len);
+
+        if (buf == NULL) {
+            return NULL;
+        }
+        remote->buf = buf;
+        remote->capacity = REMOTE_HEADER_SIZE + len;
+    }
+
+    return remote->buf + REMOTE_HEADER_SIZE;
+}
+
+/*
+ * Sends the request in remote->buf and reads the response payload, which
+ * has to be exactly out_len bytes when the status is REMOTE_OK and at
+ * most that otherwise.
+ */
+static int call(struct remote_t *remote, int op, unsigned int session, size_t len,
+                unsigned int *out_session, unsigned char *out, size_t out_len)
+{
+    unsigned char header[REMOTE_HEADER_SIZE];
+    unsigned int size, status;
+
+    put32(put16(put16(put32(remote->buf, len), op), 0), session);
+    if (write_all(remote->fd, remote->buf, REMOTE_HEADER_SIZE + len) != 0 ||
+        read_all(remote->fd, header, sizeof(header)) != 0) {
+        return -1;
+    }
+
+    size = get32(header);
+    status = get16(header + 4);
+    if (get16(header + 6) != op || size > out_len || (status == REMOTE_OK && size != out_len) ||
+        read_all(remote->fd, out, size) != 0) {
+        return -1;
+    }
+    if (out_session != NULL) {
+        *out_session = get32(header + 8);
+    }
+
+    return status;
+}
+
+static int call_state(struct remote_t *remote, int op, unsigned int session, const unsigned char *state,
+                      unsigned int *out_session)
+{
+    unsigned char *p = request(remote, SAVESTATE_SIZE);
+
+    if (p == NULL) {
+        return -1;
+    }
+    if (state != NULL) {
+        memcpy(p, state, SAVESTATE_SIZE);
+    }
+
+    return call(remote, op, session, state ? SAVESTATE_SIZE : 0, out_session, NULL, 0);
+}
+
+int remote_create(struct remote_t *remote, const unsigned char *state, unsigned int *session)
+{
+    return call_state(remote, REMOTE_CREATE, 0, state, session);
+}
+
+int remote_reset(struct remote_t *remote, unsigned int session, const unsigned char *state)
+{
+    return call_state(remote, REMOTE_RESET, session, state, NULL);
+}
+
+int remote_step(struct remote_t *remote, unsigned int session, const unsigned short *keys, int frames,
+                int same_keys, int *frames_run, unsigned long long *vram_hash)
+{
+    int n = same_keys ? 1 : frames, i, res;
+    unsigned char *p = request(remote, 4 + 2 * n), out[12];
+
+    if (p == NULL || frames < 0) {
+        return -1;
+    }
+    p = put32(p, frames);
+    for (i = 0; i < n; ++i) {
+        p = put16(p, keys[i]);
+    }
+
+    memset(out, 0, sizeof(out));
+    res = call(remote, REMOTE_STEP, session, 4 + 2 * n, NULL, out, sizeof(out));
+    if (frames_run != NULL) {
+        *frames_run = get32(out);
+    }
+    if (vram_hash != NULL) {
+        *vram_hash = get64(out + 4);
+    }
+
+    return res;
+}
+
+int remote_frame(struct remote_t *remote, unsigned int session, unsigned char *vram)
+{
+    return call(remote, REMOTE_FRAME, session, 0, NULL, vram, DISPLAY_SIZE);
+}
+
+int remote_ram(struct remote_t *remote, unsigned int session, unsigned char *ram)
+{
+    return call(remote, REMOTE_RAM, session, 0, NULL, ram, RAM_SIZE);
+}
+
+int remote_hash(struct remote_t *remote, unsigned int session, unsigned long long *state_hash,
+                unsigned long long *vram_hash)
+{
+    unsigned char out[16];
+    int res = call(remote, REMOTE_HASH, session, 0, NULL, out, sizeof(out));
+
+    if (res == REMOTE_OK) {
+        *state_hash = get64(out);
+        *vram_hash = get64(out + 8);
+    }
+
+    return res;
+}
+
+int remote_save(struct remote_t *remote, unsigned int session, unsigned char *state)
+{
+    return call(remote, REMOTE_SAVE, session, 0, NULL, state, SAVESTATE_SIZE);
+}
+
+int remote_destroy(struct remote_t *remote, unsigned int session)
+{
+    return call(remote, REMOTE_DESTROY, session, 0, NULL, NULL, 0);
+}
+
+int remote_ping(struct remote_t *remote)
+{
+    return call(remote, REMOTE_PING, 0, 0, NULL, NULL, 0);
+}
+
+const char *remote_status_name(int status)
+{
+    switch (status) {
+        case REMOTE_OK:
+            return "ok";
+        case REMOTE_BAD_REQUEST:
+            return "bad request";
+        case REMOTE_NO_SESSION:
+            return "no such session";
+        case REMOTE_STOPPED:
+            return "machine stopped";
+        case REMOTE_NO_MEMORY:
+            return "out of memory";
+        default:
+            return "connection failed";
+    }
+}
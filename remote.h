@@ -0,0 +1,91 @@
+#ifndef REMOTE_H
+#define REMOTE_H
+
+#include "frame.h"
+#include "savestate.h"
+
+/*
+ * Protocol of the emulation server (see server.c) and the client side of
+ * it. Messages go over a Unix stream socket, little endian:
+ *
+ *   request:  u32 payload size, u16 op, u16 0, u32 session, payload
+ *   response: u32 payload size, u16 status, u16 op, u32 session, payload
+ *
+ * Requests on one connection are answered in order, so a client may send
+ * several before reading the responses. Sessions are not tied to the
+ * connection that created them.
+ *
+ *   CREATE   [savestate]           session in the response header; starts
+ *                                  from the state, or from power on
+ *   RESET    [savestate]           back to the state, or the one the
+ *                                  session was created from
+ *   STEP     u32 frames, keys      runs the frames, keys is one u16 for
+ *                                  all of them or one per frame; at most
+ *                                  REMOTE_MAX_FRAMES frames;
+ *                                  responds u32 frames run, u64 VRAM hash
+ *   FRAME                          responds the DISPLAY_SIZE bytes of VRAM
+ *   RAM                            responds the RAM_SIZE bytes of RAM
+ *   HASH                           responds u64 state hash, u64 VRAM hash
+ *   SAVE                           responds a savestate
+ *   DESTROY
+ *   PING                           nothing, to measure the round trip
+ *
+ * A session whose machine stopped answers STEP with REMOTE_STOPPED and
+ * the frames it got through, until it is reset.
+ */
+#define REMOTE_HEADER_SIZE (12)
+#define REMOTE_MAX_PAYLOAD (1 << 20)
+/* A minute of game, so one STEP can't hold a server thread for long */
+#define REMOTE_MAX_FRAMES (3600)
+
+#define REMOTE_CREATE  (1)
+#define REMOTE_RESET   (2)
+#define REMOTE_STEP    (3)
+#define REMOTE_FRAME   (4)
+#define REMOTE_RAM     (5)
+#define REMOTE_HASH    (6)
+#define REMOTE_SAVE    (7)
+#define REMOTE_DESTROY (8)
+#define REMOTE_PING    (9)
+
+#define REMOTE_OK          (0)
+#define REMOTE_BAD_REQUEST (1)
+#define REMOTE_NO_SESSION  (2)
+#define REMOTE_STOPPED     (3)
+#define REMOTE_NO_MEMORY   (4)
+
+struct remote_t;
+
+/* Returns NULL if nothing listens on path */
+struct remote_t *remote_connect(const char *path);
+
+void remote_close(struct remote_t *remote);
+
+/*
+ * The calls below send one request and wait for its response. They
+ * return the status, or -1 if the connection failed. state may be NULL.
+ */
+int remote_create(struct remote_t *remote, const unsigned char *state, unsigned int *session);
+
+int remote_reset(struct remote_t *remote, unsigned int session, const unsigned char *state);
+
+/* keys holds frames entries, or a single one when same_keys is set */
+int remote_step(struct remote_t *remote, unsigned int session, const unsigned short *keys, int frames,
+                int same_keys, int *frames_run, unsigned long long *vram_hash);
+
+int remote_frame(struct remote_t *remote, unsigned int session, unsigned char *vram);
+
+int remote_ram(struct remote_t *remote, unsigned int session, unsigned char *ram);
+
+int remote_hash(struct remote_t *remote, unsigned int session, unsigned long long *state_hash,
+                unsigned long long *vram_hash);
+
+int remote_save(struct remote_t *remote, unsigned int session, unsigned char *state);
+
+int remote_destroy(struct remote_t *remote, unsigned int session);
+
+int remote_ping(struct remote_t *remote);
+
+const char *remote_status_name(int status);
+
+#endif
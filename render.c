@@ -0,0 +1,75 @@
+#include "render.h"
+
+#include <string.h>
+
+const unsigned char render_palette[RENDER_COLORS][3] = {
+    { 0x00, 0x00, 0x00 },
+    { 0xFF, 0xFF, 0xFF },
+    { 0x00, 0xFF, 0x00 },
+    { 0xFF, 0x00, 0x00 },
+};
+
+#define WHITE (1)
+#define GREEN (2)
+#define RED   (3)
+
+/* Same bands as set_gl_color() in main.c */
+static int get_color(int x, int y)
+{
+    if (y < 2) {
+        if (x < 16 || x >= 134) {
+            return WHITE;
+        } else {
+            return GREEN;
+        }
+    } else if (y < 9) {
+        return GREEN;
+    } else if (y < 24) {
+        return WHITE;
+    }
+
+    return RED;
+}
+
+void render_rgb(const unsigned char *display, unsigned char *rgb)
+{
+    int i, j, l;
+
+    memset(rgb, 0, RGB_SIZE);
+
+    for (l = 0; l < DISPLAY_WIDTH; ++l) {
+        for (i = 0; i < BYTES_PER_SCANLINE; ++i) {
+            unsigned char b = display[l * BYTES_PER_SCANLINE + i];
+            const unsigned char *color = render_palette[get_color(l, i)];
+
+            for (j = 0; b != 0; ++j) {
+                if ((b & 0x01) != 0) {
+                    int row = DISPLAY_HEIGHT - 1 - (i * 8 + j);
+                    memcpy(rgb + (row * DISPLAY_WIDTH + l) * 3, color, 3);
+                }
+                b >>= 1;
+            }
+        }
+    }
+}
+
+void render_indexed(const unsigned char *display, unsigned char *pixels)
+{
+    int i, j, l;
+
+    memset(pixels, 0, DISPLAY_WIDTH * DISPLAY_HEIGHT);
+
+    for (l = 0; l < DISPLAY_WIDTH; ++l) {
+        for (i = 0; i < BYTES_PER_SCANLINE; ++i) {
+            unsigned char b = display[l * BYTES_PER_SCANLINE + i];
+            int color = get_color(l, i);
+
+            for (j = 0; b != 0; ++j) {
+                if ((b & 0x01) != 0) {
+                    pixels[(DISPLAY_HEIGHT - 1 - (i * 8 + j)) * DISPLAY_WIDTH + l] = color;
+                }
+                b >>= 1;
+            }
+        }
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "frame.h"
+
+#define RGB_SIZE (DISPLAY_WIDTH * DISPLAY_HEIGHT * 3)
+
+/*
+ * Software version of draw() in main.c for hosts without a GL context.
+ * Writes DISPLAY_WIDTH x DISPLAY_HEIGHT RGB888 pixels, upright, top row
+ * first, with the same colour overlay as the window.
+ */
+void render_rgb(const unsigned char *display, unsigned char *rgb);
+
+/* Black and the three overlay colours, as RGB */
+#define RENDER_COLORS (4)
+
+extern const unsigned char render_palette[RENDER_COLORS][3];
+
+/* Same picture as render_rgb(), one byte per pixel indexing render_palette */
+void render_indexed(const unsigned char *display, unsigned char *pixels);
+
+#endif
@@ -0,0 +1,907 @@
+#include "8080e.h"
+#include "bus.h"
+#include "checkpoint.h"
+#include "coverage.h"
+#include "export.h"
+#include "frame.h"
+#include "framestore.h"
+#include "hash.h"
+#include "input.h"
+#include "memo.h"
+#include "movie.h"
+#include "rewind.h"
+#include "snapshot.h"
+#include "utils.h"
+#include "video.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Headless replay. Drives the machine from an input movie (or the demo
+ * script) as fast as possible and prints a hash of VRAM, so two runs or
+ * two builds can be compared bit for bit.
+ */
+struct options_t {
+    const char *bin_name;
+    const char *movie_path;
+    const char *out_path;
+    int demo_frames;
+    int engine;
+    int verbose;
+    int rewind_seconds;
+    int snapshots;
+    int check_hash;
+    int memo_entries;
+    int memo_verify;
+    int loops;
+    int coverage;
+    int keyframes;
+    const char *export_path;
+    int export_threads;
+    const char *video_path;
+    const char *checkpoint_path;
+    int checkpoint_interval;
+    int parallel;
+    int threads;
+    const char *bus_name;
+};
+
+/* Where every finished frame goes, in order */
+struct outputs_t {
+    struct export_t *exporter;
+    struct video_writer_t *recorder;
+    struct framestore_t *frame_store;
+    unsigned long long *frame_hashes;
+    unsigned long long vram;
+    unsigned long long chain;
+};
+
+static struct options_t options;
+static struct keyboard_t keyboard;
+
+static unsigned long long get_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define CHECKPOINT_INTERVAL (600)
+
+static void usage()
+{
+    printf("Usage: replay [-m MOVIE | -d FRAMES] [-w OUT MOVIE] [-e ENGINE] [-R SECONDS] [-K] [-H] [-M ENTRIES [-V N]] [-L LOOPS] [-C] [-S N] [-x PATH [-j N]] [-r FILE] [-c FILE [-k N]] [-P THREADS] [-B NAME] [-v] <ROM FILE>\n");
+    printf("  -m MOVIE  play the inputs of MOVIE\n");
+    printf("  -d N      play N frames of the built-in demo input instead\n");
+    printf("  -w FILE   write the inputs that were played as a movie\n");
+    printf("  -R N      keep N seconds of rewind history, then time stepping back through it\n");
+    printf("  -K        snapshot every frame and branch from them, then check and report memory use\n");
+    printf("  -H        check the state hash against a full recompute every frame\n");
+    printf("  -M N      run frames through a memo cache of N entries\n");
+    printf("  -V N      emulate every Nth memo hit anyway and check it\n");
+    printf("  -L N      play the input N times from the same start, like repeated rollouts\n");
+    printf("  -C        report the ROM addresses and edges the run covered\n");
+    printf("  -S N      store every frame with a keyframe every N unique ones, then gather them back\n");
+    printf("  -x PATH   export every frame, as PNGs into directory PATH or as video if it ends in .y4m\n");
+    printf("  -j N      encode exported frames on N threads (default: one per core)\n");
+    printf("  -r FILE   record the frames as a VRAM video, then decode and seek through it\n");
+    printf("  -c FILE   write a checkpoint every -k frames to FILE, with -P replay from them\n");
+    printf("  -k N      frames between checkpoints (default: %d)\n", CHECKPOINT_INTERVAL);
+    printf("  -P N      replay segments between checkpoints on N threads (0: one per core) and stitch them\n");
+    printf("  -B NAME   publish every frame on the shared memory bus NAME, see buswatch\n");
+    printf("  -v        print the VRAM hash of every frame\n");
+}
+
+static void parse_options(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:d:w:e:R:KHM:V:L:CS:x:j:r:c:k:P:B:v")) != -1) {
+        switch (opt) {
+            case 'm':
+                options.movie_path = optarg;
+                break;
+            case 'd':
+                options.demo_frames = atoi(optarg);
+                break;
+            case 'w':
+                options.out_path = optarg;
+                break;
+            case 'e':
+                options.engine = engine_from_name(optarg);
+                break;
+            case 'R':
+                options.rewind_seconds = atoi(optarg);
+                break;
+            case 'K':
+                options.snapshots = 1;
+                break;
+            case 'H':
+                options.check_hash = 1;
+                break;
+            case 'M':
+                options.memo_entries = atoi(optarg);
+                break;
+            case 'V':
+                options.memo_verify = atoi(optarg);
+                break;
+            case 'L':
+                options.loops = atoi(optarg);
+                break;
+            case 'C':
+                options.coverage = 1;
+                break;
+            case 'S':
+                options.keyframes = atoi(optarg);
+                break;
+            case 'x':
+                options.export_path = optarg;
+                break;
+            case 'j':
+                options.export_threads = atoi(optarg);
+                break;
+            case 'r':
+                options.video_path = optarg;
+                break;
+            case 'c':
+                options.checkpoint_path = optarg;
+                break;
+            case 'k':
+                options.checkpoint_interval = atoi(optarg);
+                break;
+            case 'P':
+                options.parallel = 1;
+                options.threads = atoi(optarg);
+                break;
+            case 'B':
+                options.bus_name = optarg;
+                break;
+            case 'v':
+                options.verbose = 1;
+                break;
+            default:
+                usage();
+                ABORT(("Invalid options.\n"));
+        }
+    }
+
+    if (optind >= argc || options.engine < 0 ||
+        (options.movie_path == NULL) == (options.demo_frames <= 0)) {
+        usage();
+        ABORT(("Invalid options.\n"));
+    }
+
+    // The other checks follow a single pass
+    if (options.loops > 1 && (options.out_path || options.snapshots || options.rewind_seconds)) {
+        usage();
+        ABORT(("-L can't be combined with -w, -K or -R.\n"));
+    }
+    if (options.loops < 1) {
+        options.loops = 1;
+    }
+    if (options.checkpoint_interval <= 0) {
+        options.checkpoint_interval = CHECKPOINT_INTERVAL;
+    }
+
+    // Segments only produce frames, nothing that needs the state in between
+    if ((options.parallel || options.checkpoint_path) && options.loops > 1) {
+        usage();
+        ABORT(("-c and -P can't be combined with -L.\n"));
+    }
+    if (options.parallel && (options.out_path || options.snapshots || options.rewind_seconds ||
+                             options.check_hash || options.memo_entries || options.coverage || options.bus_name)) {
+        usage();
+        ABORT(("-P can't be combined with -w, -K, -R, -H, -M, -C or -B.\n"));
+    }
+
+    options.bin_name = argv[optind];
+}
+
+static unsigned long long ram_hash(struct cpu_mem_t *machine)
+{
+    return hash_bytes(machine->ram, RAM_SIZE, 0);
+}
+
+/* index counts frames over all loops, frame is the one within the input */
+static void output_frame(struct outputs_t *out, int index, int frame, const unsigned char *vram)
+{
+    out->vram = hash_bytes(vram, DISPLAY_SIZE, 0);
+    out->chain = hash_mix(out->chain ^ out->vram);
+
+    if (out->exporter != NULL && export_frame(out->exporter, vram) != 0) {
+        ABORT(("exporting frame %d failed\n", frame));
+    }
+    if (out->recorder != NULL && video_write(out->recorder, vram) != 0) {
+        ABORT(("recording frame %d failed\n", frame));
+    }
+    if (out->frame_store != NULL && framestore_add(out->frame_store, vram) == -1) {
+        ABORT(("OOM\n"));
+    }
+    if (out->frame_hashes != NULL) {
+        out->frame_hashes[index] = out->vram;
+    }
+
+    if (options.verbose) {
+        printf("%d %016llx\n", frame, out->vram);
+    }
+}
+
+/*
+ * Steps back through the whole history, checking every frame against the
+ * RAM hash it had when it was pushed.
+ */
+static void check_rewind(struct rewind_t *history, struct cpu_mem_t *machine,
+                         const unsigned long long *hashes, int frames)
+{
+    unsigned long long then, ns;
+    int held = rewind_frames(history), steps = 0, bad = 0;
+
+    printf("rewind %d frames in %zu KB, %zu KB per minute\n",
+           held, rewind_bytes(history) / 1024, rewind_bytes_per_minute(history) / 1024);
+
+    then = get_ns();
+    while (rewind_step_back(history, machine) == 0) {
+        ++steps;
+        bad += ram_hash(machine) != hashes[frames - steps];
+    }
+    ns = get_ns() - then;
+
+    printf("stepped back %d frames, %.2f us per frame, %d mismatched\n",
+           steps, steps ? ns / 1e3 / steps : 0.0, bad);
+
+    if (bad != 0) {
+        ABORT(("rewind restored the wrong state\n"));
+    }
+}
+
+#define MEMO_BYTES (64 * 1024 * 1024)
+
+static void print_memo(struct memo_t *memo)
+{
+    struct memo_stats_t stats;
+
+    memo_stats(memo, &stats);
+    printf("memo %llu hits %llu misses (%.1f%%), %llu evictions, %zu entries in %zu KB, "
+           "%llu cycles skipped, %llu verified %llu mismatched\n",
+           stats.hits, stats.misses, 100.0 * stats.hits / (stats.hits + stats.misses),
+           stats.evictions, stats.entries, stats.bytes / 1024,
+           stats.skipped_cycles, stats.verified, stats.mismatches);
+
+    if (stats.mismatches != 0) {
+        ABORT(("memo returned the wrong state\n"));
+    }
+}
+
+#define GATHER_BATCH (32)
+#define GATHER_BATCHES (2000)
+
+/*
+ * Gathers random batches of stored frames, like sampling from a replay
+ * buffer, and checks every frame against the VRAM hash it was stored with.
+ */
+static void check_framestore(struct framestore_t *fs, const unsigned long long *hashes)
+{
+    unsigned char *out;
+    int indices[GATHER_BATCH];
+    unsigned long long then, ns = 0;
+    int frames = framestore_frames(fs), i, j, bad = 0;
+
+    printf("framestore %d frames, %d unique, %zu KB, %.1f bytes per frame (%.0fx smaller than VRAM)\n",
+           frames, framestore_unique(fs), framestore_bytes(fs) / 1024,
+           (double)framestore_bytes(fs) / frames, (double)frames * DISPLAY_SIZE / framestore_bytes(fs));
+
+    out = malloc(GATHER_BATCH * DISPLAY_SIZE);
+    if (out == NULL) {
+        ABORT(("OOM\n"));
+    }
+
+    srand(1);
+    for (i = 0; i < GATHER_BATCHES; ++i) {
+        for (j = 0; j < GATHER_BATCH; ++j) {
+            indices[j] = rand() % frames;
+        }
+
+        then = get_ns();
+        if (framestore_gather(fs, indices, GATHER_BATCH, out) != 0) {
+            ABORT(("gather failed\n"));
+        }
+        ns += get_ns() - then;
+
+        for (j = 0; j < GATHER_BATCH; ++j) {
+            bad += hash_bytes(out + j * DISPLAY_SIZE, DISPLAY_SIZE, 0) != hashes[indices[j]];
+        }
+    }
+
+    printf("gathered %d frames, %.2f us per frame, %d mismatched\n",
+           GATHER_BATCH * GATHER_BATCHES, ns / 1e3 / (GATHER_BATCH * GATHER_BATCHES), bad);
+
+    free(out);
+    if (bad != 0) {
+        ABORT(("framestore returned the wrong frame\n"));
+    }
+}
+
+#define VIDEO_KEYFRAMES (300)
+#define VIDEO_SEEKS (2000)
+
+/*
+ * Decodes the whole recording, then seeks to random frames, checking
+ * every frame against the VRAM hash it was recorded with.
+ */
+static void check_video(const char *path, const unsigned long long *hashes)
+{
+    struct video_t *video = video_open(path);
+    unsigned char vram[DISPLAY_SIZE];
+    unsigned long long then, ns, seek_ns = 0;
+    struct stat st;
+    int frames, frame, i, bad = 0;
+
+    if (video == NULL || stat(path, &st) != 0) {
+        ABORT(("can't read back %s\n", path));
+    }
+    frames = video_frames(video);
+
+    then = get_ns();
+    while ((frame = video_read(video, vram)) != -1) {
+        bad += hash_bytes(vram, DISPLAY_SIZE, 0) != hashes[frame];
+    }
+    ns = get_ns() - then;
+
+    printf("video %d frames in %lld KB, %.1f bytes per frame, decoded at %.0f fps\n",
+           frames, (long long)st.st_size / 1024, (double)st.st_size / frames, frames / (ns / 1e9));
+
+    srand(1);
+    for (i = 0; i < VIDEO_SEEKS; ++i) {
+        int target = rand() % frames;
+
+        then = get_ns();
+        if (video_seek(video, target) != 0 || video_read(video, vram) != target) {
+            ABORT(("seeking to frame %d failed\n", target));
+        }
+        seek_ns += get_ns() - then;
+        bad += hash_bytes(vram, DISPLAY_SIZE, 0) != hashes[target];
+    }
+
+    printf("seeked %d times, %.2f us per seek with a keyframe every %d frames, %d mismatched\n",
+           VIDEO_SEEKS, seek_ns / 1e3 / VIDEO_SEEKS, video_keyframe_interval(video), bad);
+
+    video_free(video);
+    if (bad != 0) {
+        ABORT(("video returned the wrong frame\n"));
+    }
+}
+
+#define BRANCHES (1000)
+#define BRANCH_FRAMES (9)
+
+/*
+ * Forks what-if branches off random snapshots of the main line, playing
+ * other inputs for a few frames and snapshotting those too, and then
+ * restores every main line snapshot checking its RAM hash.
+ */
+static void check_snapshots(struct snapstore_t *store, struct snapshot_t **line,
+                            struct cpu_mem_t *machine, const unsigned long long *hashes, int frames)
+{
+    struct snapshot_t **branches, *current = NULL;
+    unsigned long long then, ns;
+    int taken = frames + 1, i, j, bad = 0;
+
+    branches = malloc(BRANCHES * BRANCH_FRAMES * sizeof(*branches));
+    if (branches == NULL) {
+        ABORT(("OOM\n"));
+    }
+
+    srand(1);
+    for (i = 0; i < BRANCHES; ++i) {
+        int from = rand() % (frames + 1);
+
+        snapshot_restore(store, line[from], machine, current);
+        current = line[from];
+
+        for (j = 0; j < BRANCH_FRAMES; ++j) {
+            mask_to_keyboard(demo_keys(from + j + 600), &keyboard);
+            run_frame(machine, NULL, NULL);
+
+            branches[i * BRANCH_FRAMES + j] = snapshot_take(store, machine, current);
+            if (branches[i * BRANCH_FRAMES + j] == NULL) {
+                ABORT(("OOM\n"));
+            }
+            current = branches[i * BRANCH_FRAMES + j];
+            ++taken;
+        }
+    }
+
+    printf("snapshots %d pages %zu in %zu KB, %zu KB as full copies\n",
+           taken, snapstore_pages(store), snapstore_bytes(store) / 1024,
+           (size_t)taken * SAVESTATE_SIZE / 1024);
+
+    then = get_ns();
+    for (i = 0; i <= frames; ++i) {
+        snapshot_restore(store, line[i], machine, current);
+        current = line[i];
+        bad += ram_hash(machine) != hashes[i];
+    }
+    ns = get_ns() - then;
+
+    printf("restored %d snapshots, %.2f us each, %d mismatched\n",
+           frames + 1, ns / 1e3 / (frames + 1), bad);
+
+    if (bad != 0) {
+        ABORT(("snapshot restored the wrong state\n"));
+    }
+
+    for (i = 0; i < BRANCHES * BRANCH_FRAMES; ++i) {
+        snapshot_release(store, branches[i]);
+    }
+    for (i = 0; i <= frames; ++i) {
+        snapshot_release(store, line[i]);
+    }
+    free(branches);
+}
+
+/*
+ * Parallel replay: segment s runs from checkpoint s for up to a
+ * checkpoint interval of frames on whichever thread claims it first. Its
+ * frames are kept in one of a ring of buffers until the main thread has
+ * passed them on in order, and workers don't run further ahead than the
+ * ring. Where a segment ends, the machine has to be in the state of the
+ * next checkpoint, otherwise the stitched run is not the original one.
+ */
+#define SEGMENTS_PER_THREAD (2)
+
+struct segment_t {
+    unsigned char *vram;
+    int done;
+    int error;
+    int boundary_ok;
+};
+
+struct parallel_t {
+    const struct checkpoints_t *cp;
+    const unsigned short *keys;
+    int frames;
+    int nsegments;
+    struct segment_t *ring;
+    int nring;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // Under lock
+    int claimed;
+    int consumed;
+};
+
+static void *segment_worker(void *arg)
+{
+    struct parallel_t *par = arg;
+    const struct checkpoints_t *cp = par->cp;
+    struct keyboard_t keys = { 0 };
+    struct cpu_mem_t *machine = init_machine(options.bin_name, &keys);
+    unsigned char end[SAVESTATE_SIZE];
+
+    if (machine == NULL) {
+        ABORT(("can't load %s\n", options.bin_name));
+    }
+    set_engine(machine, options.engine);
+
+    for (;;) {
+        struct segment_t *seg;
+        int s, first, last, frame;
+
+        pthread_mutex_lock(&par->lock);
+        s = par->claimed;
+        if (s < par->nsegments) {
+            ++par->claimed;
+        }
+        while (s < par->nsegments && s >= par->consumed + par->nring) {
+            pthread_cond_wait(&par->cond, &par->lock);
+        }
+        pthread_mutex_unlock(&par->lock);
+        if (s >= par->nsegments) {
+            break;
+        }
+
+        seg = &par->ring[s % par->nring];
+        first = s * cp->interval;
+        last = first + cp->interval < par->frames ? first + cp->interval : par->frames;
+
+        savestate_read(machine, checkpoint_state(cp, s));
+        seg->error = 0;
+        for (frame = first; frame < last; ++frame) {
+            mask_to_keyboard(par->keys[frame], &keys);
+            if (run_frame(machine, NULL, NULL) == -1) {
+                seg->error = machine_error(machine);
+                break;
+            }
+            memcpy(seg->vram + (size_t)(frame - first) * DISPLAY_SIZE, MACHINE_RAM(machine, DISPLAY_ADDRESS), DISPLAY_SIZE);
+        }
+
+        seg->boundary_ok = 1;
+        if (seg->error == 0 && s + 1 < cp->count && last == first + cp->interval) {
+            savestate_write(machine, end);
+            seg->boundary_ok = memcmp(end, checkpoint_state(cp, s + 1), SAVESTATE_SIZE) == 0;
+        }
+
+        pthread_mutex_lock(&par->lock);
+        seg->done = 1;
+        pthread_cond_broadcast(&par->cond);
+        pthread_mutex_unlock(&par->lock);
+    }
+
+    deinit_machine(machine);
+    return NULL;
+}
+
+static void run_parallel(struct outputs_t *out, const struct checkpoints_t *cp,
+                         const unsigned short *keys, int frames)
+{
+    struct parallel_t par = { cp, keys, frames };
+    pthread_t *threads;
+    int nthreads = options.threads > 0 ? options.threads : sysconf(_SC_NPROCESSORS_ONLN);
+    int s, i, frame, bad = 0;
+
+    par.nsegments = (frames + cp->interval - 1) / cp->interval;
+    if (par.nsegments > cp->count) {
+        ABORT(("%d checkpoints don't cover %d frames\n", cp->count, frames));
+    }
+    par.nring = nthreads * SEGMENTS_PER_THREAD;
+
+    threads = malloc(nthreads * sizeof(*threads));
+    par.ring = calloc(par.nring, sizeof(*par.ring));
+    if (threads == NULL || par.ring == NULL) {
+        ABORT(("OOM\n"));
+    }
+    for (i = 0; i < par.nring; ++i) {
+        par.ring[i].vram = malloc((size_t)cp->interval * DISPLAY_SIZE);
+        if (par.ring[i].vram == NULL) {
+            ABORT(("OOM\n"));
+        }
+    }
+    pthread_mutex_init(&par.lock, NULL);
+    pthread_cond_init(&par.cond, NULL);
+
+    for (i = 0; i < nthreads; ++i) {
+        if (pthread_create(&threads[i], NULL, segment_worker, &par) != 0) {
+            ABORT(("can't start thread %d\n", i));
+        }
+    }
+
+    // Stitches the segments back together in order
+    for (s = 0; s < par.nsegments; ++s) {
+        struct segment_t *seg = &par.ring[s % par.nring];
+        int first = s * cp->interval;
+        int last = first + cp->interval < frames ? first + cp->interval : frames;
+
+        pthread_mutex_lock(&par.lock);
+        while (!seg->done) {
+            pthread_cond_wait(&par.cond, &par.lock);
+        }
+        pthread_mutex_unlock(&par.lock);
+
+        if (seg->error != 0) {
+            ABORT(("machine stopped in segment %d: %s\n", s, machine_error_name(seg->error)));
+        }
+        for (frame = first; frame < last; ++frame) {
+            output_frame(out, frame, frame, seg->vram + (size_t)(frame - first) * DISPLAY_SIZE);
+        }
+        if (!seg->boundary_ok) {
+            printf("segment %d ends in a different state than checkpoint %d\n", s, s + 1);
+            ++bad;
+        }
+
+        pthread_mutex_lock(&par.lock);
+        seg->done = 0;
+        par.consumed = s + 1;
+        pthread_cond_broadcast(&par.cond);
+        pthread_mutex_unlock(&par.lock);
+    }
+
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("segments %d of %d frames on %d threads, %d boundaries checked, %d mismatched\n",
+           par.nsegments, cp->interval, nthreads, par.nsegments - 1, bad);
+    if (bad != 0) {
+        ABORT(("stitched replay differs from the original run\n"));
+    }
+
+    pthread_cond_destroy(&par.cond);
+    pthread_mutex_destroy(&par.lock);
+    for (i = 0; i < par.nring; ++i) {
+        free(par.ring[i].vram);
+    }
+    free(par.ring);
+    free(threads);
+}
+
+int main(int argc, char **argv)
+{
+    struct cpu_mem_t *machine;
+    struct movie_t *movie = NULL, *out = NULL;
+    struct rewind_t *history = NULL;
+    struct memo_t *memo = NULL;
+    struct coverage_t *coverage = NULL;
+    struct snapstore_t *store = NULL;
+    struct snapshot_t **line = NULL;
+    struct checkpoints_t *cp = NULL;
+    struct bus_t *bus = NULL;
+    struct outputs_t outputs = { 0 };
+    unsigned long long *hashes = NULL;
+    unsigned long long then, ns;
+    unsigned short *keys;
+    unsigned long long hash_ns = 0, full_ns = 0, state = 0;
+    unsigned char start[SAVESTATE_SIZE];
+    int frame, frames, loop;
+
+    parse_options(argc, argv);
+
+    machine = init_machine(options.bin_name, &keyboard);
+    if (machine == NULL) {
+        ABORT(("can't load %s\n", options.bin_name));
+    }
+    set_engine(machine, options.engine);
+
+    if (options.movie_path != NULL) {
+        movie = movie_load(options.movie_path);
+        if (movie == NULL || movie_start(movie, machine) != 0) {
+            ABORT(("can't play %s\n", options.movie_path));
+        }
+        frames = movie->frames;
+    } else {
+        frames = options.demo_frames;
+    }
+
+    keys = malloc((size_t)frames * sizeof(*keys) + 1);
+    if (keys == NULL) {
+        ABORT(("OOM\n"));
+    }
+    for (frame = 0; frame < frames; ++frame) {
+        keys[frame] = movie ? movie->keys[frame] : demo_keys(frame);
+    }
+
+    if (options.out_path != NULL) {
+        out = movie_create(machine);
+    }
+
+    if (options.rewind_seconds > 0 || options.snapshots) {
+        hashes = malloc((frames + 1) * sizeof(*hashes));
+        if (hashes == NULL) {
+            ABORT(("OOM\n"));
+        }
+        hashes[0] = ram_hash(machine);
+    }
+
+    if (options.rewind_seconds > 0) {
+        history = rewind_create(options.rewind_seconds * 60,
+                                (size_t)options.rewind_seconds * 64 * 1024 + 4 * RAM_SIZE, 60);
+        if (history == NULL) {
+            ABORT(("OOM\n"));
+        }
+        rewind_push(history, machine);
+    }
+
+    if (options.snapshots) {
+        store = snapstore_create();
+        line = malloc((frames + 1) * sizeof(*line));
+        if (store == NULL || line == NULL || (line[0] = snapshot_take(store, machine, NULL)) == NULL) {
+            ABORT(("OOM\n"));
+        }
+    }
+
+    if (options.memo_entries > 0) {
+        memo = memo_create(options.memo_entries, MEMO_BYTES, options.memo_verify);
+        if (memo == NULL) {
+            ABORT(("OOM\n"));
+        }
+    }
+
+    if (options.keyframes > 0 || options.video_path != NULL) {
+        outputs.frame_hashes = malloc((size_t)frames * options.loops * sizeof(*outputs.frame_hashes));
+        if (outputs.frame_hashes == NULL) {
+            ABORT(("OOM\n"));
+        }
+    }
+    if (options.keyframes > 0) {
+        outputs.frame_store = framestore_create(options.keyframes);
+        if (outputs.frame_store == NULL) {
+            ABORT(("OOM\n"));
+        }
+    }
+
+    if (options.video_path != NULL) {
+        outputs.recorder = video_create(options.video_path, VIDEO_KEYFRAMES, rom_hash(machine));
+        if (outputs.recorder == NULL) {
+            ABORT(("can't record to %s\n", options.video_path));
+        }
+    }
+
+    if (options.export_path != NULL) {
+        outputs.exporter = export_create(options.export_path, export_format_from_path(options.export_path),
+                                         options.export_threads);
+        if (outputs.exporter == NULL) {
+            ABORT(("can't export to %s\n", options.export_path));
+        }
+    }
+
+    if (options.bus_name != NULL) {
+        bus = bus_create(options.bus_name, BUS_DEFAULT_SLOTS, rom_hash(machine));
+        if (bus == NULL) {
+            ABORT(("can't publish on %s\n", options.bus_name));
+        }
+    }
+
+    if (options.coverage) {
+        coverage = calloc(1, sizeof(*coverage));
+        if (coverage == NULL) {
+            ABORT(("OOM\n"));
+        }
+        set_coverage(machine, coverage);
+    }
+
+    if (options.parallel && options.checkpoint_path != NULL) {
+        cp = checkpoints_load(options.checkpoint_path);
+        if (cp == NULL) {
+            ABORT(("can't read %s\n", options.checkpoint_path));
+        }
+        if (cp->rom_hash != rom_hash(machine) || cp->input_hash != checkpoints_input_hash(keys, frames)) {
+            ABORT(("%s was written for other inputs or another ROM\n", options.checkpoint_path));
+        }
+    } else if (options.parallel || options.checkpoint_path != NULL) {
+        cp = checkpoints_create(rom_hash(machine), checkpoints_input_hash(keys, frames), options.checkpoint_interval);
+        if (cp == NULL) {
+            ABORT(("OOM\n"));
+        }
+    }
+
+    // Without a checkpoint file the segments start from a first pass that only emulates
+    if (options.parallel && cp->count == 0) {
+        then = get_ns();
+        for (frame = 0; frame < frames; ++frame) {
+            if (frame % cp->interval == 0 && checkpoints_add(cp, machine) != 0) {
+                ABORT(("OOM\n"));
+            }
+            mask_to_keyboard(keys[frame], &keyboard);
+            if (run_frame(machine, NULL, NULL) == -1) {
+                ABORT(("machine stopped at frame %d: %s\n", frame, machine_error_name(machine_error(machine))));
+            }
+        }
+        printf("first pass took %d checkpoints (%.0f fps)\n", cp->count, frames / ((get_ns() - then) / 1e9));
+    }
+
+    savestate_write(machine, start);
+
+    then = get_ns();
+    for (loop = 0; loop < options.loops && options.parallel; ++loop) {
+        run_parallel(&outputs, cp, keys, frames);
+    }
+    for (loop = 0; loop < options.loops && !options.parallel; ++loop) {
+        if (loop > 0) {
+            savestate_read(machine, start);
+        }
+
+        for (frame = 0; frame < frames; ++frame) {
+            mask_to_keyboard(keys[frame], &keyboard);
+            if (out != NULL && movie_record(out, keys[frame]) != 0) {
+                ABORT(("OOM\n"));
+            }
+            if (cp != NULL && frame % cp->interval == 0 && checkpoints_add(cp, machine) != 0) {
+                ABORT(("OOM\n"));
+            }
+
+            if ((memo ? memo_frame(memo, machine, keys[frame]) : run_frame(machine, NULL, NULL)) == -1) {
+                ABORT(("machine stopped at frame %d: %s\n", frame, machine_error_name(machine_error(machine))));
+            }
+
+            if (options.check_hash) {
+                unsigned long long t0 = get_ns(), full;
+
+                state = state_hash(machine);
+                hash_ns += get_ns() - t0;
+                full = state_hash_full(machine);
+                full_ns += get_ns() - t0;
+
+                if (state != full) {
+                    ABORT(("state hash %016llx at frame %d, recomputed %016llx\n", state, frame, full));
+                }
+            }
+            if (hashes != NULL) {
+                hashes[frame + 1] = ram_hash(machine);
+            }
+            if (history != NULL) {
+                rewind_push(history, machine);
+            }
+            if (store != NULL) {
+                line[frame + 1] = snapshot_take(store, machine, line[frame]);
+                if (line[frame + 1] == NULL) {
+                    ABORT(("OOM\n"));
+                }
+            }
+
+            if (bus != NULL) {
+                bus_publish(bus, machine);
+            }
+            output_frame(&outputs, loop * frames + frame, frame, MACHINE_RAM(machine, DISPLAY_ADDRESS));
+        }
+    }
+    ns = get_ns() - then;
+
+    printf("frames %d vram %016llx chain %016llx (%.0f fps)\n",
+           frames, outputs.vram, outputs.chain, (double)frames * options.loops / (ns / 1e9));
+
+    if (cp != NULL) {
+        if (!options.parallel && checkpoints_save(cp, options.checkpoint_path) != 0) {
+            ABORT(("writing %s failed\n", options.checkpoint_path));
+        }
+        checkpoints_free(cp);
+    }
+
+    if (outputs.exporter != NULL) {
+        unsigned long long exported, stalls;
+
+        then = get_ns();
+        if (export_close(outputs.exporter, &exported, &stalls) != 0) {
+            ABORT(("writing %s failed\n", options.export_path));
+        }
+        printf("exported %llu frames to %s, waited for the encoders %llu times and %.1f s at the end\n",
+               exported, options.export_path, stalls, (get_ns() - then) / 1e9);
+    }
+
+    if (bus != NULL) {
+        bus_free(bus);
+    }
+    if (coverage != NULL) {
+        printf("coverage rom %d edges %d\n", coverage_addrs(coverage), coverage_edges(coverage));
+        free(coverage);
+    }
+    if (memo != NULL) {
+        print_memo(memo);
+        memo_free(memo);
+    }
+    if (options.check_hash) {
+        printf("state %016llx, state_hash %.0f ns, full recompute %.0f ns\n",
+               state, (double)hash_ns / frames / options.loops,
+               (double)(full_ns - hash_ns) / frames / options.loops);
+    }
+    if (store != NULL) {
+        check_snapshots(store, line, machine, hashes, frames);
+        snapstore_free(store);
+        free(line);
+    }
+    if (history != NULL) {
+        check_rewind(history, machine, hashes, frames);
+        rewind_free(history);
+    }
+    if (outputs.frame_store != NULL) {
+        check_framestore(outputs.frame_store, outputs.frame_hashes);
+        framestore_free(outputs.frame_store);
+    }
+    if (outputs.recorder != NULL) {
+        if (video_close(outputs.recorder) != 0) {
+            ABORT(("writing %s failed\n", options.video_path));
+        }
+        check_video(options.video_path, outputs.frame_hashes);
+    }
+    free(outputs.frame_hashes);
+    free(keys);
+    free(hashes);
+
+    if (out != NULL && movie_save(out, options.out_path) != 0) {
+        ABORT(("writing %s failed\n", options.out_path));
+    }
+
+    if (movie != NULL) {
+        movie_free(movie);
+    }
+    if (out != NULL) {
+        movie_free(out);
+    }
+    deinit_machine(machine);
+
+    return 0;
+}
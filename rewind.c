@@ -0,0 +1,222 @@
+#include "rewind.h"
+#include "xrle.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAMES_PER_MINUTE (60 * 60)
+
+struct entry_t {
+    size_t offset;
+    unsigned int delta_size;
+    int keyframe;
+    struct cpu_regs_t regs;
+};
+
+struct rewind_t {
+    unsigned char *arena;
+    size_t arena_size;
+    size_t write;
+    size_t used;
+    struct entry_t *entries;
+    int capacity;
+    int first;
+    int count;
+    int keyframe_interval;
+    int since_keyframe;
+    unsigned char last[RAM_SIZE];
+    unsigned char scratch[XRLE_BOUND(RAM_SIZE)];
+};
+
+static struct entry_t *entry(struct rewind_t *rw, int i)
+{
+    return &rw->entries[(rw->first + i) % rw->capacity];
+}
+
+static size_t entry_size(const struct entry_t *e)
+{
+    return e->delta_size + (e->keyframe ? RAM_SIZE : 0);
+}
+
+static void drop_oldest(struct rewind_t *rw)
+{
+    rw->used -= entry_size(entry(rw, 0));
+    rw->first = (rw->first + 1) % rw->capacity;
+    --rw->count;
+}
+
+static int overlaps(const struct entry_t *e, size_t start, size_t size)
+{
+    size_t end = e->offset + entry_size(e);
+
+    return e->offset < start + size && start < end;
+}
+
+struct rewind_t *rewind_create(int max_frames, size_t max_bytes, int keyframe_interval)
+{
+    struct rewind_t *rw;
+
+    if (max_bytes < 2 * (RAM_SIZE + XRLE_BOUND(RAM_SIZE)) || max_frames < 2 || keyframe_interval < 1) {
+        return NULL;
+    }
+
+    rw = calloc(1, sizeof(*rw));
+    if (rw == NULL) {
+        return NULL;
+    }
+
+    rw->arena = malloc(max_bytes);
+    rw->entries = malloc(max_frames * sizeof(*rw->entries));
+    if (rw->arena == NULL || rw->entries == NULL) {
+        rewind_free(rw);
+        return NULL;
+    }
+
+    rw->arena_size = max_bytes;
+    rw->capacity = max_frames;
+    rw->keyframe_interval = keyframe_interval;
+
+    return rw;
+}
+
+void rewind_free(struct rewind_t *rw)
+{
+    free(rw->arena);
+    free(rw->entries);
+    free(rw);
+}
+
+void rewind_push(struct rewind_t *rw, struct cpu_mem_t *machine)
+{
+    const unsigned char *ram = machine->ram;
+    struct entry_t *e;
+    size_t delta_size, size;
+    int keyframe;
+
+    keyframe = (rw->count == 0 || rw->since_keyframe + 1 >= rw->keyframe_interval);
+
+    // The first frame has nothing to be a delta against
+    delta_size = rw->count ? xrle_encode(rw->last, ram, RAM_SIZE, rw->scratch) : 0;
+    size = delta_size + (keyframe ? RAM_SIZE : 0);
+
+    if (rw->count == rw->capacity) {
+        drop_oldest(rw);
+    }
+
+    if (rw->write + size > rw->arena_size) {
+        // The oldest frames sit between here and the end, they go first
+        while (rw->count > 0 && entry(rw, 0)->offset >= rw->write) {
+            drop_oldest(rw);
+        }
+        rw->write = 0;
+    }
+    while (rw->count > 0 && overlaps(entry(rw, 0), rw->write, size)) {
+        drop_oldest(rw);
+    }
+
+    e = entry(rw, rw->count);
+    e->offset = rw->write;
+    e->delta_size = delta_size;
+    e->keyframe = keyframe;
+    get_regs(machine, &e->regs);
+
+    memcpy(rw->arena + e->offset, rw->scratch, delta_size);
+    if (keyframe) {
+        memcpy(rw->arena + e->offset + delta_size, ram, RAM_SIZE);
+        rw->since_keyframe = 0;
+    } else {
+        ++rw->since_keyframe;
+    }
+
+    rw->write += size;
+    rw->used += size;
+    ++rw->count;
+
+    memcpy(rw->last, ram, RAM_SIZE);
+}
+
+static void pop_newest(struct rewind_t *rw)
+{
+    rw->used -= entry_size(entry(rw, rw->count - 1));
+    --rw->count;
+    rw->write = entry(rw, rw->count)->offset;
+    rw->since_keyframe = rw->keyframe_interval;
+}
+
+int rewind_step_back(struct rewind_t *rw, struct cpu_mem_t *machine)
+{
+    struct entry_t *e;
+
+    if (rw->count < 2) {
+        return -1;
+    }
+
+    e = entry(rw, rw->count - 1);
+    xrle_apply(rw->last, RAM_SIZE, rw->arena + e->offset, e->delta_size);
+    pop_newest(rw);
+
+    write_ram(machine, 0, rw->last, RAM_SIZE);
+    set_regs(machine, &entry(rw, rw->count - 1)->regs);
+
+    return 0;
+}
+
+int rewind_seek(struct rewind_t *rw, struct cpu_mem_t *machine, int frames)
+{
+    int target, key, i;
+
+    if (frames > rw->count - 1) {
+        frames = rw->count - 1;
+    }
+    if (frames <= 0) {
+        return 0;
+    }
+
+    target = rw->count - 1 - frames;
+
+    for (key = target; key >= 0 && !entry(rw, key)->keyframe; --key) {
+    }
+
+    if (key < 0 || target - key > frames) {
+        // Walking back is cheaper, or the keyframe was already dropped
+        for (i = 0; i < frames; ++i) {
+            rewind_step_back(rw, machine);
+        }
+        return frames;
+    }
+
+    memcpy(rw->last, rw->arena + entry(rw, key)->offset + entry(rw, key)->delta_size, RAM_SIZE);
+    for (i = key + 1; i <= target; ++i) {
+        struct entry_t *e = entry(rw, i);
+
+        xrle_apply(rw->last, RAM_SIZE, rw->arena + e->offset, e->delta_size);
+    }
+
+    while (rw->count - 1 > target) {
+        pop_newest(rw);
+    }
+
+    write_ram(machine, 0, rw->last, RAM_SIZE);
+    set_regs(machine, &entry(rw, target)->regs);
+
+    return frames;
+}
+
+int rewind_frames(const struct rewind_t *rw)
+{
+    return rw->count;
+}
+
+size_t rewind_bytes(const struct rewind_t *rw)
+{
+    return rw->used + rw->count * sizeof(struct entry_t);
+}
+
+size_t rewind_bytes_per_minute(const struct rewind_t *rw)
+{
+    if (rw->count == 0) {
+        return 0;
+    }
+
+    return (size_t)((double)rewind_bytes(rw) / rw->count * FRAMES_PER_MINUTE);
+}
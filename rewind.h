@@ -0,0 +1,39 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include "8080e.h"
+
+#include <stddef.h>
+
+/*
+ * Rewind buffer. rewind_push() is called at every frame boundary and
+ * stores the registers plus the XOR+RLE delta of RAM against the frame
+ * before, with a full copy of RAM every keyframe_interval frames. All of
+ * it lives in one byte ring, the oldest frames are dropped when it or
+ * the frame limit is full.
+ *
+ * Stepping back one frame applies a single delta. Seeking further back
+ * starts from the closest keyframe and applies deltas forward.
+ */
+struct rewind_t;
+
+struct rewind_t *rewind_create(int max_frames, size_t max_bytes, int keyframe_interval);
+
+void rewind_free(struct rewind_t *rw);
+
+void rewind_push(struct rewind_t *rw, struct cpu_mem_t *machine);
+
+/* Returns -1 if there is no older frame left */
+int rewind_step_back(struct rewind_t *rw, struct cpu_mem_t *machine);
+
+/* Goes back up to frames frames, returns how many it went back */
+int rewind_seek(struct rewind_t *rw, struct cpu_mem_t *machine, int frames);
+
+int rewind_frames(const struct rewind_t *rw);
+
+size_t rewind_bytes(const struct rewind_t *rw);
+
+/* Average memory used for one minute of history at 60 frames/s */
+size_t rewind_bytes_per_minute(const struct rewind_t *rw);
+
+#endif
@@ -0,0 +1,63 @@
+#include "savestate.h"
+#include "bytes.h"
+#include "hash.h"
+
+#include <string.h>
+
+static unsigned char *put_state_regs(unsigned char *p, const struct cpu_regs_t *regs)
+{
+    p = put16(p, regs->pc);
+    p = put16(p, regs->sp);
+    p = put16(p, regs->bc);
+    p = put16(p, regs->de);
+    p = put16(p, regs->hl);
+    p = put16(p, regs->shift_reg);
+    *p++ = regs->a;
+    *p++ = regs->f;
+    *p++ = regs->intr;
+    *p++ = regs->pending_intr;
+    *p++ = regs->shift_reg_offset;
+
+    return p;
+}
+
+static const unsigned char *get_state_regs(const unsigned char *p, struct cpu_regs_t *regs)
+{
+    regs->pc = get16(p);
+    regs->sp = get16(p + 2);
+    regs->bc = get16(p + 4);
+    regs->de = get16(p + 6);
+    regs->hl = get16(p + 8);
+    regs->shift_reg = get16(p + 10);
+    p += 12;
+    regs->a = *p++;
+    regs->f = *p++;
+    regs->intr = *p++;
+    regs->pending_intr = *p++;
+    regs->shift_reg_offset = *p++;
+
+    return p;
+}
+
+void savestate_write(struct cpu_mem_t *machine, unsigned char *buf)
+{
+    struct cpu_regs_t regs;
+
+    get_regs(machine, &regs);
+    buf = put_state_regs(buf, &regs);
+    memcpy(buf, machine->ram, RAM_SIZE);
+}
+
+void savestate_read(struct cpu_mem_t *machine, const unsigned char *buf)
+{
+    struct cpu_regs_t regs;
+
+    buf = get_state_regs(buf, &regs);
+    set_regs(machine, &regs);
+    write_ram(machine, 0, buf, RAM_SIZE);
+}
+
+unsigned long long rom_hash(struct cpu_mem_t *machine)
+{
+    return hash_bytes(machine->rom, RAM_ADDRESS, 0);
+}
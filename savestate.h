@@ -0,0 +1,20 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include "8080e.h"
+
+/*
+ * Machine state at a frame boundary: the register file followed by the
+ * whole RAM, little endian, so it can be written to files as is.
+ */
+#define REGS_SIZE (17)
+#define SAVESTATE_SIZE (REGS_SIZE + RAM_SIZE)
+
+void savestate_write(struct cpu_mem_t *machine, unsigned char *buf);
+
+void savestate_read(struct cpu_mem_t *machine, const unsigned char *buf);
+
+/* Identifies the program a state or recording belongs to */
+unsigned long long rom_hash(struct cpu_mem_t *machine);
+
+#endif
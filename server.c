@@ -0,0 +1,1044 @@
+#include "8080e.h"
+#include "arena.h"
+#include "bytes.h"
+#include "frame.h"
+#include "hash.h"
+#include "input.h"
+#include "remote.h"
+#include "savestate.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Emulation server. Keeps sessions, each one a machine, in memory and
+ * serves the protocol in remote.h on a Unix socket until SIGINT or
+ * SIGTERM.
+ *
+ * All pool threads wait on one epoll set. A connection is armed one shot,
+ * so exactly one thread picks it up when it becomes readable; that thread
+ * reads everything the client sent, answers all complete requests in one
+ * write and arms it again. Clients that pipeline requests so get them
+ * handled as a batch.
+ *
+ * With -z it is a zygote instead: one process boots a machine to a ready
+ * state and then forks a child for every connection. The child serves
+ * just that connection, starting out with the booted machine already in
+ * its copy-on-write memory; its first CREATE without a state adopts that
+ * machine, later ones start new machines from the same ready state.
+ *
+ * -b runs clients against the server over loopback, checking every
+ * answer against a local machine and timing the round trips.
+ */
+#define MAX_EVENTS (16)
+#define READ_CHUNK (64 * 1024)
+#define DEFAULT_SESSIONS (4096)
+#define ZYGOTE_SESSIONS (16)
+/* A session id is its slot plus a generation, so stale ids don't match */
+#define SLOT_BITS (20)
+#define SLOT_MASK ((1 << SLOT_BITS) - 1)
+
+struct options_t {
+    const char *bin_name;
+    const char *socket_path;
+    int threads;
+    int sessions;
+    int bench_clients;
+    int bench_requests;
+    int zygote_frames;
+};
+
+struct session_t {
+    pthread_mutex_t lock;
+    // 0 while the slot is free
+    unsigned int id;
+    struct cpu_mem_t *machine;
+    struct keyboard_t keyboard;
+    int stopped;
+    unsigned char start[SAVESTATE_SIZE];
+} __attribute__((aligned(64)));
+
+struct conn_t {
+    int fd;
+    unsigned char *in;
+    size_t in_len;
+    size_t in_capacity;
+    unsigned char *out;
+    size_t out_len;
+    size_t out_capacity;
+    // Bytes of out already written, the rest waits for the client to read
+    size_t out_sent;
+};
+
+struct server_t {
+    unsigned char rom[ROM_SIZE];
+    long rom_size;
+    struct session_t *sessions;
+    int nsessions;
+    // The machines of the sessions, under table_lock
+    struct cpu_mem_t *program;
+    struct keyboard_t keyboard;
+    struct arena_t *arena;
+    // Free slots, a stack under table_lock
+    int *free_slots;
+    int nfree;
+    unsigned int generation;
+    pthread_mutex_t table_lock;
+    // What CREATE without a state starts from, power on unless has_ready
+    int has_ready;
+    unsigned char ready[SAVESTATE_SIZE];
+    // A booted session the next such CREATE hands out as is
+    unsigned int adopt;
+    int epfd;
+    int listen_fd;
+    int wake_fd;
+    int stop;
+    pthread_t *threads;
+    int nthreads;
+    unsigned long long requests;
+    unsigned long long batches;
+};
+
+static struct options_t options;
+static struct server_t server;
+
+static unsigned long long get_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage()
+{
+    printf("Usage: server [-s SOCKET] [-t THREADS | -z FRAMES] [-n SESSIONS] [-b CLIENTS [-r REQUESTS]] <ROM FILE>\n");
+    printf("  -s PATH   listen on the Unix socket PATH (default: i8080.sock)\n");
+    printf("  -t N      serve on N threads (default: one per core)\n");
+    printf("  -n N      allow N sessions at a time (default: %d, %d with -z)\n", DEFAULT_SESSIONS, ZYGOTE_SESSIONS);
+    printf("  -z N      boot to frame N of the demo, then fork a process with that machine per connection\n");
+    printf("  -b N      run N clients over loopback, check their answers and time them, then exit\n");
+    printf("  -r N      requests of each kind per client with -b (default: 10000)\n");
+    printf("            with -z, -b N forks N children one after the other and times their start\n");
+}
+
+static void parse_options(int argc, char **argv)
+{
+    int opt;
+
+    options.socket_path = "i8080.sock";
+    options.bench_requests = 10000;
+
+    while ((opt = getopt(argc, argv, "s:t:n:b:r:z:")) != -1) {
+        switch (opt) {
+            case 's':
+                options.socket_path = optarg;
+                break;
+            case 't':
+                options.threads = atoi(optarg);
+                break;
+            case 'n':
+                options.sessions = atoi(optarg);
+                break;
+            case 'b':
+                options.bench_clients = atoi(optarg);
+                break;
+            case 'r':
+                options.bench_requests = atoi(optarg);
+                break;
+            case 'z':
+                options.zygote_frames = atoi(optarg);
+                break;
+            default:
+                usage();
+                ABORT(("Invalid options.\n"));
+        }
+    }
+
+    // A child of the zygote needs few, and fork() is faster with a small table
+    if (options.sessions == 0) {
+        options.sessions = options.zygote_frames > 0 ? ZYGOTE_SESSIONS : DEFAULT_SESSIONS;
+    }
+
+    if (optind >= argc || options.sessions < 1 || options.sessions > SLOT_MASK ||
+        options.bench_requests < 1) {
+        usage();
+        ABORT(("Invalid options.\n"));
+    }
+    if (options.threads <= 0) {
+        options.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    options.bin_name = argv[optind];
+}
+
+/* The session locked, or NULL if id is not a live one */
+static struct session_t *lock_session(unsigned int id)
+{
+    struct session_t *s;
+
+    if ((id & SLOT_MASK) >= server.nsessions) {
+        return NULL;
+    }
+    s = &server.sessions[id & SLOT_MASK];
+
+    pthread_mutex_lock(&s->lock);
+    if (s->id != id || id == 0) {
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    }
+
+    return s;
+}
+
+static int create_session(const unsigned char *state, unsigned int *id)
+{
+    struct cpu_mem_t *machine;
+    struct session_t *s;
+    int slot;
+
+    pthread_mutex_lock(&server.table_lock);
+    if (state == NULL && server.adopt != 0) {
+        *id = server.adopt;
+        server.adopt = 0;
+        pthread_mutex_unlock(&server.table_lock);
+        return REMOTE_OK;
+    }
+    if (server.nfree == 0) {
+        pthread_mutex_unlock(&server.table_lock);
+        return REMOTE_NO_MEMORY;
+    }
+    slot = server.free_slots[--server.nfree];
+    s = &server.sessions[slot];
+    // The arena has a machine for every slot
+    machine = arena_get(server.arena, &s->keyboard);
+    server.generation = (server.generation + 1) & (0xFFFFFFFF >> SLOT_BITS);
+    // Generation 0 would let slot 0 have id 0, which means free
+    if (server.generation == 0) {
+        server.generation = 1;
+    }
+    *id = server.generation << SLOT_BITS | slot;
+    pthread_mutex_unlock(&server.table_lock);
+
+    pthread_mutex_lock(&s->lock);
+    s->machine = machine;
+    if (state != NULL || server.has_ready) {
+        savestate_read(s->machine, state ? state : server.ready);
+    }
+    savestate_write(s->machine, s->start);
+    s->stopped = 0;
+    s->id = *id;
+    pthread_mutex_unlock(&s->lock);
+
+    return REMOTE_OK;
+}
+
+static int destroy_session(unsigned int id)
+{
+    struct session_t *s = lock_session(id);
+    struct cpu_mem_t *machine;
+
+    if (s == NULL) {
+        return REMOTE_NO_SESSION;
+    }
+    machine = s->machine;
+    s->machine = NULL;
+    s->id = 0;
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_mutex_lock(&server.table_lock);
+    arena_put(server.arena, machine);
+    server.free_slots[server.nfree++] = id & SLOT_MASK;
+    pthread_mutex_unlock(&server.table_lock);
+
+    return REMOTE_OK;
+}
+
+/* Room for a response with len bytes of payload, NULL when out of memory */
+static unsigned char *respond(struct conn_t *conn, size_t len)
+{
+    size_t need = conn->out_len + REMOTE_HEADER_SIZE + len;
+
+    if (need > conn->out_capacity) {
+        size_t n = conn->out_capacity ? conn->out_capacity : READ_CHUNK;
+        unsigned char *out;
+
+        while (n < need) {
+            n *= 2;
+        }
+        out = realloc(conn->out, n);
+        if (out == NULL) {
+            return NULL;
+        }
+        conn->out = out;
+        conn->out_capacity = n;
+    }
+
+    return conn->out + conn->out_len + REMOTE_HEADER_SIZE;
+}
+
+static void finish_response(struct conn_t *conn, int status, int op, unsigned int session, size_t len)
+{
+    put32(put16(put16(put32(conn->out + conn->out_len, len), status), op), session);
+    conn->out_len += REMOTE_HEADER_SIZE + len;
+}
+
+static int step_session(struct session_t *s, const unsigned char *payload, unsigned int len,
+                        unsigned char *out)
+{
+    unsigned int frames, run = 0;
+    int same;
+
+    if (len < 6) {
+        return REMOTE_BAD_REQUEST;
+    }
+    frames = get32(payload);
+    if (frames > REMOTE_MAX_FRAMES) {
+        return REMOTE_BAD_REQUEST;
+    }
+    same = len == 6;
+    if (!same && len != 4 + 2ULL * frames) {
+        return REMOTE_BAD_REQUEST;
+    }
+
+    if (same) {
+        mask_to_keyboard(get16(payload + 4), &s->keyboard);
+    }
+    while (run < frames && !s->stopped) {
+        if (!same) {
+            mask_to_keyboard(get16(payload + 4 + 2 * run), &s->keyboard);
+        }
+        if (run_frame(s->machine, NULL, NULL) == -1) {
+            s->stopped = 1;
+        } else {
+            ++run;
+        }
+    }
+
+    put64(put32(out, run), hash_bytes(MACHINE_RAM(s->machine, DISPLAY_ADDRESS), DISPLAY_SIZE, 0));
+    return s->stopped ? REMOTE_STOPPED : REMOTE_OK;
+}
+
+/* Answers the request at p, whose payload is complete */
+static int handle_request(struct conn_t *conn, const unsigned char *p)
+{
+    unsigned int len = get32(p), op = get16(p + 4), id = get32(p + 8);
+    const unsigned char *payload = p + REMOTE_HEADER_SIZE;
+    struct session_t *s = NULL;
+    size_t out_len = 0;
+    unsigned char *out;
+    int status = REMOTE_OK;
+
+    // Big enough for any response
+    out = respond(conn, SAVESTATE_SIZE);
+    if (out == NULL) {
+        return -1;
+    }
+
+    if (op == REMOTE_CREATE) {
+        if (len != 0 && len != SAVESTATE_SIZE) {
+            status = REMOTE_BAD_REQUEST;
+        } else {
+            status = create_session(len ? payload : NULL, &id);
+        }
+        finish_response(conn, status, op, id, 0);
+        return 0;
+    }
+    if (op == REMOTE_PING) {
+        finish_response(conn, REMOTE_OK, op, id, 0);
+        return 0;
+    }
+    if (op == REMOTE_DESTROY) {
+        finish_response(conn, destroy_session(id), op, id, 0);
+        return 0;
+    }
+
+    s = lock_session(id);
+    if (s == NULL) {
+        finish_response(conn, REMOTE_NO_SESSION, op, id, 0);
+        return 0;
+    }
+
+    switch (op) {
+        case REMOTE_RESET:
+            if (len != 0 && len != SAVESTATE_SIZE) {
+                status = REMOTE_BAD_REQUEST;
+                break;
+            }
+            savestate_read(s->machine, len ? payload : s->start);
+            s->stopped = 0;
+            break;
+        case REMOTE_STEP:
+            status = step_session(s, payload, len, out);
+            out_len = status == REMOTE_BAD_REQUEST ? 0 : 12;
+            break;
+        case REMOTE_FRAME:
+            memcpy(out, MACHINE_RAM(s->machine, DISPLAY_ADDRESS), DISPLAY_SIZE);
+            out_len = DISPLAY_SIZE;
+            break;
+        case REMOTE_RAM:
+            memcpy(out, s->machine->ram, RAM_SIZE);
+            out_len = RAM_SIZE;
+            break;
+        case REMOTE_HASH:
+            put64(put64(out, state_hash(s->machine)),
+                  hash_bytes(MACHINE_RAM(s->machine, DISPLAY_ADDRESS), DISPLAY_SIZE, 0));
+            out_len = 16;
+            break;
+        case REMOTE_SAVE:
+            savestate_write(s->machine, out);
+            out_len = SAVESTATE_SIZE;
+            break;
+        default:
+            status = REMOTE_BAD_REQUEST;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    finish_response(conn, status, op, id, out_len);
+    return 0;
+}
+
+/*
+ * A connection with responses still to send waits for the client to read
+ * them, and sends no more requests our way until it has.
+ */
+static int arm(struct conn_t *conn, int fd, int op)
+{
+    struct epoll_event ev;
+
+    ev.events = (conn != NULL && conn->out_sent < conn->out_len ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    return epoll_ctl(server.epfd, op, fd, &ev);
+}
+
+static void close_conn(struct conn_t *conn)
+{
+    epoll_ctl(server.epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+static void accept_conns()
+{
+    for (;;) {
+        int fd = accept(server.listen_fd, NULL, NULL);
+        struct conn_t *conn;
+
+        if (fd == -1) {
+            break;
+        }
+        conn = calloc(1, sizeof(*conn));
+        if (conn == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        if (arm(conn, fd, EPOLL_CTL_ADD) != 0) {
+            close(fd);
+            free(conn);
+        }
+    }
+
+    arm(NULL, server.listen_fd, EPOLL_CTL_MOD);
+}
+
+/* Writes what the socket takes, whatever is left stays in conn->out */
+static int write_out(struct conn_t *conn)
+{
+    while (conn->out_sent < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+
+        if (n > 0) {
+            conn->out_sent += n;
+        } else if (n == -1 && errno == EAGAIN) {
+            return 0;
+        } else if (n == -1 && errno != EINTR) {
+            return -1;
+        }
+    }
+    conn->out_len = 0;
+    conn->out_sent = 0;
+
+    return 0;
+}
+
+/*
+ * Reads all there is, answers every complete request, -1 to close. While
+ * earlier responses are still unsent it only tries to send them.
+ */
+static int serve_conn(struct conn_t *conn)
+{
+    size_t offset = 0;
+    int closed = 0, handled = 0;
+
+    if (conn->out_sent < conn->out_len) {
+        return write_out(conn);
+    }
+
+    for (;;) {
+        ssize_t n;
+
+        if (conn->in_capacity - conn->in_len < READ_CHUNK) {
+            size_t capacity = conn->in_capacity ? conn->in_capacity * 2 : 2 * READ_CHUNK;
+            unsigned char *in = realloc(conn->in, capacity);
+
+            if (in == NULL) {
+                return -1;
+            }
+            conn->in = in;
+            conn->in_capacity = capacity;
+        }
+
+        n = read(conn->fd, conn->in + conn->in_len, conn->in_capacity - conn->in_len);
+        if (n > 0) {
+            conn->in_len += n;
+        } else if (n == 0) {
+            closed = 1;
+            break;
+        } else if (errno == EAGAIN) {
+            break;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    while (conn->in_len - offset >= REMOTE_HEADER_SIZE) {
+        unsigned int len = get32(conn->in + offset);
+
+        if (len > REMOTE_MAX_PAYLOAD) {
+            return -1;
+        }
+        if (conn->in_len - offset < REMOTE_HEADER_SIZE + len) {
+            break;
+        }
+        if (handle_request(conn, conn->in + offset) != 0) {
+            return -1;
+        }
+        offset += REMOTE_HEADER_SIZE + len;
+        ++handled;
+    }
+    memmove(conn->in, conn->in + offset, conn->in_len - offset);
+    conn->in_len -= offset;
+
+    if (handled > 0) {
+        __atomic_add_fetch(&server.requests, handled, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&server.batches, 1, __ATOMIC_RELAXED);
+    }
+    if (write_out(conn) != 0) {
+        return -1;
+    }
+
+    return closed ? -1 : 0;
+}
+
+static void *serve(void *arg)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!__atomic_load_n(&server.stop, __ATOMIC_ACQUIRE)) {
+        int n = epoll_wait(server.epfd, events, MAX_EVENTS, -1), i;
+
+        for (i = 0; i < n; ++i) {
+            struct conn_t *conn = events[i].data.ptr;
+
+            if (events[i].data.ptr == &server.wake_fd) {
+                continue;
+            } else if (conn == NULL) {
+                accept_conns();
+            } else if (serve_conn(conn) != 0) {
+                close_conn(conn);
+            } else {
+                arm(conn, conn->fd, EPOLL_CTL_MOD);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void start_server()
+{
+    struct sockaddr_un addr;
+    int i;
+
+    server.rom_size = load_program(options.bin_name, server.rom);
+    if (server.rom_size <= 0) {
+        ABORT(("can't load %s\n", options.bin_name));
+    }
+
+    server.program = init_machine_rom(server.rom, server.rom_size, &server.keyboard);
+    if (server.program == NULL) {
+        ABORT(("can't load %s\n", options.bin_name));
+    }
+
+    server.nsessions = options.sessions;
+    server.sessions = calloc(server.nsessions, sizeof(*server.sessions));
+    server.free_slots = malloc(server.nsessions * sizeof(*server.free_slots));
+    server.threads = malloc(options.threads * sizeof(*server.threads));
+    server.arena = arena_create(server.program, server.nsessions);
+    if (server.sessions == NULL || server.free_slots == NULL || server.threads == NULL || server.arena == NULL) {
+        ABORT(("OOM\n"));
+    }
+    // Handed out lowest slot first
+    for (i = 0; i < server.nsessions; ++i) {
+        pthread_mutex_init(&server.sessions[i].lock, NULL);
+        server.free_slots[i] = server.nsessions - 1 - i;
+    }
+    server.nfree = server.nsessions;
+    pthread_mutex_init(&server.table_lock, NULL);
+
+    if (strlen(options.socket_path) >= sizeof(addr.sun_path)) {
+        ABORT(("socket path %s is too long\n", options.socket_path));
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, options.socket_path);
+    unlink(options.socket_path);
+
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server.listen_fd == -1 || bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(server.listen_fd, SOMAXCONN) != 0) {
+        ABORT(("can't listen on %s: %s\n", options.socket_path, strerror(errno)));
+    }
+}
+
+static void start_threads()
+{
+    struct epoll_event ev;
+    int i;
+
+    server.epfd = epoll_create1(EPOLL_CLOEXEC);
+    server.wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (server.epfd == -1 || server.wake_fd == -1 || arm(NULL, server.listen_fd, EPOLL_CTL_ADD) != 0) {
+        ABORT(("epoll setup failed\n"));
+    }
+    // Level triggered: once written, it wakes every thread
+    ev.events = EPOLLIN;
+    ev.data.ptr = &server.wake_fd;
+    if (epoll_ctl(server.epfd, EPOLL_CTL_ADD, server.wake_fd, &ev) != 0) {
+        ABORT(("epoll setup failed\n"));
+    }
+
+    for (i = 0; i < options.threads; ++i) {
+        if (pthread_create(&server.threads[i], NULL, serve, NULL) != 0) {
+            ABORT(("can't start thread %d\n", i));
+        }
+    }
+    server.nthreads = options.threads;
+}
+
+static void stop_server()
+{
+    unsigned long long one = 1;
+    int i, live = 0;
+
+    __atomic_store_n(&server.stop, 1, __ATOMIC_RELEASE);
+    if (write(server.wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        ABORT(("can't wake the server threads\n"));
+    }
+    for (i = 0; i < server.nthreads; ++i) {
+        pthread_join(server.threads[i], NULL);
+    }
+
+    for (i = 0; i < server.nsessions; ++i) {
+        live += server.sessions[i].machine != NULL;
+        pthread_mutex_destroy(&server.sessions[i].lock);
+    }
+    printf("served %llu requests in %llu batches, %d sessions left\n",
+           server.requests, server.batches, live);
+
+    close(server.listen_fd);
+    close(server.wake_fd);
+    close(server.epfd);
+    unlink(options.socket_path);
+    arena_free(server.arena);
+    deinit_machine(server.program);
+    free(server.sessions);
+    free(server.free_slots);
+    free(server.threads);
+}
+
+struct client_t {
+    pthread_t thread;
+    int index;
+    unsigned long long ping_ns;
+    unsigned long long step_ns;
+    unsigned long long local_ns;
+    int bad;
+};
+
+/*
+ * One benchmark client: a session on the server and a local machine fed
+ * the same inputs. Every answer is compared with the local machine.
+ */
+static void *run_client(void *arg)
+{
+    struct client_t *client = arg;
+    struct remote_t *remote = remote_connect(options.socket_path);
+    struct keyboard_t keyboard = { 0 };
+    struct cpu_mem_t *local = init_machine_rom(server.rom, server.rom_size, &keyboard);
+    unsigned char state[SAVESTATE_SIZE], vram[DISPLAY_SIZE];
+    unsigned long long then, state_hash, vram_hash, restored;
+    unsigned int session;
+    int i, frames;
+
+    if (remote == NULL || local == NULL || remote_create(remote, NULL, &session) != REMOTE_OK) {
+        ABORT(("client %d can't start a session\n", client->index));
+    }
+
+    // Round trips that do nothing on the server, all overhead
+    then = get_ns();
+    for (i = 0; i < options.bench_requests; ++i) {
+        if (remote_ping(remote) != REMOTE_OK) {
+            ABORT(("client %d: PING failed\n", client->index));
+        }
+    }
+    client->ping_ns = get_ns() - then;
+
+    // Every client plays the demo from a different point
+    for (i = 0; i < options.bench_requests; ++i) {
+        unsigned short keys = demo_keys(i + client->index * 97);
+
+        then = get_ns();
+        if (remote_step(remote, session, &keys, 1, 1, &frames, &vram_hash) != REMOTE_OK || frames != 1) {
+            ABORT(("client %d: STEP failed\n", client->index));
+        }
+        client->step_ns += get_ns() - then;
+
+        then = get_ns();
+        mask_to_keyboard(keys, &keyboard);
+        run_frame(local, NULL, NULL);
+        client->local_ns += get_ns() - then;
+
+        client->bad += vram_hash != hash_bytes(MACHINE_RAM(local, DISPLAY_ADDRESS), DISPLAY_SIZE, 0);
+    }
+
+    if (remote_frame(remote, session, vram) != REMOTE_OK || remote_save(remote, session, state) != REMOTE_OK ||
+        remote_hash(remote, session, &state_hash, &vram_hash) != REMOTE_OK) {
+        ABORT(("client %d: FRAME, SAVE or HASH failed\n", client->index));
+    }
+    client->bad += memcmp(vram, MACHINE_RAM(local, DISPLAY_ADDRESS), DISPLAY_SIZE) != 0;
+    client->bad += state_hash != state_hash_full(local);
+
+    // Reset to power on, then back to the saved state and onto a second session
+    if (remote_reset(remote, session, NULL) != REMOTE_OK ||
+        remote_reset(remote, session, state) != REMOTE_OK ||
+        remote_hash(remote, session, &restored, &vram_hash) != REMOTE_OK) {
+        ABORT(("client %d: RESET failed\n", client->index));
+    }
+    client->bad += restored != state_hash;
+    if (remote_destroy(remote, session) != REMOTE_OK ||
+        remote_hash(remote, session, &restored, &vram_hash) != REMOTE_NO_SESSION ||
+        remote_create(remote, state, &session) != REMOTE_OK ||
+        remote_hash(remote, session, &restored, &vram_hash) != REMOTE_OK ||
+        remote_destroy(remote, session) != REMOTE_OK) {
+        ABORT(("client %d: recreating the session failed\n", client->index));
+    }
+    client->bad += restored != state_hash;
+
+    deinit_machine(local);
+    remote_close(remote);
+
+    return NULL;
+}
+
+static void run_bench()
+{
+    struct client_t *clients = calloc(options.bench_clients, sizeof(*clients));
+    unsigned long long then, ns, ping_ns = 0, step_ns = 0, local_ns = 0;
+    double requests = (double)options.bench_clients * options.bench_requests;
+    int i, bad = 0;
+
+    if (clients == NULL) {
+        ABORT(("OOM\n"));
+    }
+
+    then = get_ns();
+    for (i = 0; i < options.bench_clients; ++i) {
+        clients[i].index = i;
+        if (pthread_create(&clients[i].thread, NULL, run_client, &clients[i]) != 0) {
+            ABORT(("can't start client %d\n", i));
+        }
+    }
+    for (i = 0; i < options.bench_clients; ++i) {
+        pthread_join(clients[i].thread, NULL);
+        ping_ns += clients[i].ping_ns;
+        step_ns += clients[i].step_ns;
+        local_ns += clients[i].local_ns;
+        bad += clients[i].bad;
+    }
+    ns = get_ns() - then;
+
+    printf("%d clients, %d threads: PING %.2f us, STEP 1 frame %.2f us (%.2f us emulating locally), "
+           "%.0f requests/s, %d mismatched\n",
+           options.bench_clients, options.threads, ping_ns / 1e3 / requests, step_ns / 1e3 / requests,
+           local_ns / 1e3 / requests, requests * 2 / (ns / 1e9), bad);
+
+    free(clients);
+    if (bad != 0) {
+        ABORT(("the server answered differently than a local machine\n"));
+    }
+}
+
+static volatile sig_atomic_t zygote_stop;
+
+static void stop_signal(int sig)
+{
+    zygote_stop = 1;
+}
+
+/* Runs the demo input on a new session, which becomes the one to adopt */
+static void boot_ready()
+{
+    struct session_t *s;
+    unsigned int id;
+    int frame;
+
+    if (create_session(NULL, &id) != REMOTE_OK) {
+        ABORT(("OOM\n"));
+    }
+    s = &server.sessions[id & SLOT_MASK];
+    for (frame = 0; frame < options.zygote_frames; ++frame) {
+        mask_to_keyboard(demo_keys(frame), &s->keyboard);
+        if (run_frame(s->machine, NULL, NULL) == -1) {
+            ABORT(("machine stopped at frame %d: %s\n", frame, machine_error_name(machine_error(s->machine))));
+        }
+    }
+
+    savestate_write(s->machine, server.ready);
+    memcpy(s->start, server.ready, SAVESTATE_SIZE);
+    server.has_ready = 1;
+    server.adopt = id;
+}
+
+/* In a forked child: serves one connection until the client hangs up */
+static void serve_child(int fd)
+{
+    struct conn_t *conn = calloc(1, sizeof(*conn));
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    if (conn == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+        _exit(1);
+    }
+    conn->fd = fd;
+
+    for (;;) {
+        pfd.events = conn->out_sent < conn->out_len ? POLLOUT : POLLIN;
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            break;
+        }
+        if (serve_conn(conn) != 0) {
+            break;
+        }
+    }
+
+    _exit(0);
+}
+
+/*
+ * Forks the spare child, which waits in accept() itself and tells the
+ * zygote through the pipe as soon as it has a client. The fork so happens
+ * before a client asks, not while it waits.
+ */
+static pid_t fork_spare(int notify)
+{
+    pid_t pid = fork();
+    int fd;
+
+    if (pid != 0) {
+        return pid;
+    }
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    do {
+        fd = accept(server.listen_fd, NULL, NULL);
+    } while (fd == -1 && errno == EINTR);
+    if (fd == -1 || write(notify, "", 1) != 1) {
+        _exit(1);
+    }
+    close(notify);
+    close(server.listen_fd);
+    serve_child(fd);
+
+    return 0;
+}
+
+/* Keeps a spare child forked until SIGINT or SIGTERM */
+static void run_zygote()
+{
+    struct sigaction sa;
+    unsigned long long forked = 0;
+    int notify[2];
+    pid_t spare;
+    char c;
+
+    // No SA_RESTART, so the signal gets accept() out of its wait
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // Children are never waited for
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    fcntl(server.listen_fd, F_SETFL, 0);
+    if (pipe(notify) != 0) {
+        ABORT(("pipe() failed\n"));
+    }
+
+    spare = fork_spare(notify[1]);
+    while (!zygote_stop && spare != -1) {
+        if (read(notify[0], &c, 1) == 1) {
+            ++forked;
+            spare = fork_spare(notify[1]);
+        }
+    }
+    if (spare == -1) {
+        perror("fork() failed");
+    } else {
+        kill(spare, SIGTERM);
+    }
+
+    printf("forked %llu children\n", forked);
+    close(notify[0]);
+    close(notify[1]);
+    close(server.listen_fd);
+    unlink(options.socket_path);
+}
+
+#define COLD_STARTS (20)
+#define SPAWN_GAP_US (5000)
+
+/*
+ * Times children of the zygote from connect() to the answer of their
+ * first HASH, against starting a machine from scratch in this process.
+ */
+static void run_zygote_bench()
+{
+    struct cpu_mem_t *ready = server.sessions[server.adopt & SLOT_MASK].machine;
+    unsigned long long ready_hash = state_hash_full(ready);
+    unsigned long long then, spawn_ns = 0, cold_ns = 0, init_ns = 0;
+    int i, frame, bad = 0;
+
+    for (i = 0; i < options.bench_clients; ++i) {
+        unsigned long long hash, vram_hash;
+        struct remote_t *remote;
+        unsigned int session;
+
+        then = get_ns();
+        remote = remote_connect(options.socket_path);
+        if (remote == NULL || remote_create(remote, NULL, &session) != REMOTE_OK ||
+            remote_hash(remote, session, &hash, &vram_hash) != REMOTE_OK) {
+            ABORT(("child %d didn't answer\n", i));
+        }
+        spawn_ns += get_ns() - then;
+
+        bad += hash != ready_hash;
+        remote_close(remote);
+
+        // Clients come and go, give the zygote time to fork the next spare
+        usleep(SPAWN_GAP_US);
+    }
+
+    for (i = 0; i < COLD_STARTS; ++i) {
+        struct keyboard_t keyboard = { 0 };
+        struct cpu_mem_t *machine;
+
+        then = get_ns();
+        machine = init_machine(options.bin_name, &keyboard);
+        if (machine == NULL) {
+            ABORT(("can't load %s\n", options.bin_name));
+        }
+        init_ns += get_ns() - then;
+        for (frame = 0; frame < options.zygote_frames; ++frame) {
+            mask_to_keyboard(demo_keys(frame), &keyboard);
+            run_frame(machine, NULL, NULL);
+        }
+        cold_ns += get_ns() - then;
+
+        bad += state_hash_full(machine) != ready_hash;
+        deinit_machine(machine);
+    }
+
+    printf("zygote: %d children ready %.0f us after connect(), a cold start takes %.0f us "
+           "(%.0f us init_machine(), the rest booting %d frames), %d mismatched\n",
+           options.bench_clients, spawn_ns / 1e3 / options.bench_clients, cold_ns / 1e3 / COLD_STARTS,
+           init_ns / 1e3 / COLD_STARTS, options.zygote_frames, bad);
+
+    if (bad != 0) {
+        ABORT(("a child didn't start from the ready state\n"));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    sigset_t signals;
+    int sig;
+
+    parse_options(argc, argv);
+
+    if (options.zygote_frames > 0) {
+        start_server();
+        boot_ready();
+        if (options.bench_clients == 0) {
+            printf("zygote for %s ready after %d frames on %s\n",
+                   options.bin_name, options.zygote_frames, options.socket_path);
+            fflush(stdout);
+            run_zygote();
+        } else {
+            pid_t pid = fork();
+
+            if (pid == 0) {
+                run_zygote();
+                _exit(0);
+            }
+            if (pid == -1) {
+                ABORT(("fork() failed\n"));
+            }
+            run_zygote_bench();
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+        }
+        return 0;
+    }
+
+    // Only the main thread takes the signals that stop the server
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    start_server();
+    start_threads();
+
+    if (options.bench_clients > 0) {
+        run_bench();
+    } else {
+        printf("serving %s on %s with %d threads\n", options.bin_name, options.socket_path, options.threads);
+        fflush(stdout);
+        sigwait(&signals, &sig);
+    }
+
+    stop_server();
+
+    return 0;
+}
@@ -0,0 +1,338 @@
+#include "snapshot.h"
+#include "hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_PAGE (0xFFFFFFFFu)
+
+#define LEAF (0)
+#define NODE (1)
+#define FREE (2)
+
+struct page_t {
+    unsigned int refs;
+    // Next page in the bucket, or in the free list
+    unsigned int next;
+    unsigned char data[SNAP_PAGE_SIZE];
+    unsigned char kind;
+};
+
+struct snapstore_t {
+    struct page_t *pages;
+    unsigned int capacity;
+    unsigned int used;
+    unsigned int live;
+    unsigned int free;
+    unsigned int *buckets;
+    unsigned int bucket_mask;
+    size_t snapshots;
+};
+
+static unsigned int child(const struct snapstore_t *store, unsigned int id, int i)
+{
+    unsigned int v;
+
+    memcpy(&v, store->pages[id].data + i * sizeof(v), sizeof(v));
+    return v;
+}
+
+static unsigned int bucket(const struct snapstore_t *store, const unsigned char *data, int kind)
+{
+    return hash_bytes(data, SNAP_PAGE_SIZE, kind) & store->bucket_mask;
+}
+
+struct snapstore_t *snapstore_create(void)
+{
+    struct snapstore_t *store;
+
+    store = calloc(1, sizeof(*store));
+    if (store == NULL) {
+        return NULL;
+    }
+
+    store->free = NO_PAGE;
+    store->bucket_mask = 255;
+    store->buckets = malloc((store->bucket_mask + 1) * sizeof(*store->buckets));
+    if (store->buckets == NULL) {
+        free(store);
+        return NULL;
+    }
+    memset(store->buckets, 0xFF, (store->bucket_mask + 1) * sizeof(*store->buckets));
+
+    return store;
+}
+
+void snapstore_free(struct snapstore_t *store)
+{
+    free(store->pages);
+    free(store->buckets);
+    free(store);
+}
+
+static int grow_buckets(struct snapstore_t *store)
+{
+    unsigned int *buckets, i;
+
+    buckets = malloc((store->bucket_mask + 1) * 2 * sizeof(*buckets));
+    if (buckets == NULL) {
+        return -1;
+    }
+    memset(buckets, 0xFF, (store->bucket_mask + 1) * 2 * sizeof(*buckets));
+
+    free(store->buckets);
+    store->buckets = buckets;
+    store->bucket_mask = store->bucket_mask * 2 + 1;
+
+    for (i = 0; i < store->used; ++i) {
+        struct page_t *page = &store->pages[i];
+        unsigned int b;
+
+        if (page->kind == FREE) {
+            continue;
+        }
+        b = bucket(store, page->data, page->kind);
+        page->next = buckets[b];
+        buckets[b] = i;
+    }
+
+    return 0;
+}
+
+static unsigned int new_page(struct snapstore_t *store)
+{
+    unsigned int id;
+
+    if (store->free != NO_PAGE) {
+        id = store->free;
+        store->free = store->pages[id].next;
+        return id;
+    }
+
+    if (store->used == store->capacity) {
+        unsigned int capacity = store->capacity ? store->capacity + store->capacity / 2 : 256;
+        struct page_t *pages = realloc(store->pages, capacity * sizeof(*pages));
+
+        if (pages == NULL) {
+            return NO_PAGE;
+        }
+        store->pages = pages;
+        store->capacity = capacity;
+    }
+
+    return store->used++;
+}
+
+/*
+ * Finds the page holding data or adds it. The caller takes the reference
+ * to the page; a new node takes one on each of its children.
+ */
+static unsigned int intern(struct snapstore_t *store, const unsigned char *data, int kind)
+{
+    unsigned int id, b = bucket(store, data, kind);
+    struct page_t *page;
+    int i;
+
+    for (id = store->buckets[b]; id != NO_PAGE; id = store->pages[id].next) {
+        page = &store->pages[id];
+
+        if (page->kind == kind && memcmp(page->data, data, SNAP_PAGE_SIZE) == 0) {
+            return id;
+        }
+    }
+
+    if (store->live > store->bucket_mask) {
+        if (grow_buckets(store) != 0) {
+            return NO_PAGE;
+        }
+        b = bucket(store, data, kind);
+    }
+
+    id = new_page(store);
+    if (id == NO_PAGE) {
+        return NO_PAGE;
+    }
+
+    page = &store->pages[id];
+    page->refs = 0;
+    page->kind = kind;
+    memcpy(page->data, data, SNAP_PAGE_SIZE);
+    page->next = store->buckets[b];
+    store->buckets[b] = id;
+    ++store->live;
+
+    if (kind == NODE) {
+        for (i = 0; i < SNAP_FANOUT; ++i) {
+            ++store->pages[child(store, id, i)].refs;
+        }
+    }
+
+    return id;
+}
+
+static void unref(struct snapstore_t *store, unsigned int id)
+{
+    struct page_t *page = &store->pages[id];
+    unsigned int *link;
+    int i;
+
+    if (--page->refs != 0) {
+        return;
+    }
+
+    for (link = &store->buckets[bucket(store, page->data, page->kind)]; *link != id;
+         link = &store->pages[*link].next) {
+    }
+    *link = page->next;
+
+    if (page->kind == NODE) {
+        for (i = 0; i < SNAP_FANOUT; ++i) {
+            unref(store, child(store, id, i));
+        }
+    }
+
+    page->kind = FREE;
+    page->next = store->free;
+    store->free = id;
+    --store->live;
+}
+
+/*
+ * The leaves interned here are held until the node takes them, so that
+ * running out of memory halfway frees the ones nothing else uses.
+ */
+static unsigned int take_node(struct snapstore_t *store, const unsigned char *ram, unsigned int base)
+{
+    unsigned int ids[SNAP_FANOUT], id = NO_PAGE;
+    unsigned char held[SNAP_FANOUT] = { 0 };
+    int i;
+
+    for (i = 0; i < SNAP_FANOUT; ++i) {
+        const unsigned char *data = ram + i * SNAP_PAGE_SIZE;
+
+        // Untouched pages are shared with the base without hashing them
+        if (base != NO_PAGE) {
+            ids[i] = child(store, base, i);
+            if (memcmp(store->pages[ids[i]].data, data, SNAP_PAGE_SIZE) == 0) {
+                continue;
+            }
+        }
+
+        ids[i] = intern(store, data, LEAF);
+        if (ids[i] == NO_PAGE) {
+            break;
+        }
+        ++store->pages[ids[i]].refs;
+        held[i] = 1;
+    }
+
+    if (i == SNAP_FANOUT) {
+        id = intern(store, (const unsigned char *)ids, NODE);
+    }
+
+    while (--i >= 0) {
+        if (held[i]) {
+            unref(store, ids[i]);
+        }
+    }
+
+    return id;
+}
+
+struct snapshot_t *snapshot_take(struct snapstore_t *store, struct cpu_mem_t *machine,
+                                 const struct snapshot_t *base)
+{
+    const unsigned char *ram = machine->ram;
+    struct snapshot_t *snap;
+    int i;
+
+    snap = malloc(sizeof(*snap));
+    if (snap == NULL) {
+        return NULL;
+    }
+
+    get_regs(machine, &snap->regs);
+
+    for (i = 0; i < SNAP_NODES; ++i) {
+        snap->nodes[i] = take_node(store, ram + i * SNAP_FANOUT * SNAP_PAGE_SIZE,
+                                   base ? base->nodes[i] : NO_PAGE);
+        if (snap->nodes[i] == NO_PAGE) {
+            while (--i >= 0) {
+                unref(store, snap->nodes[i]);
+            }
+            free(snap);
+            return NULL;
+        }
+        ++store->pages[snap->nodes[i]].refs;
+    }
+
+    ++store->snapshots;
+
+    return snap;
+}
+
+void snapshot_restore(struct snapstore_t *store, const struct snapshot_t *snap,
+                      struct cpu_mem_t *machine, const struct snapshot_t *base)
+{
+    int i, j;
+
+    for (i = 0; i < SNAP_NODES; ++i) {
+        if (base != NULL && base->nodes[i] == snap->nodes[i]) {
+            continue;
+        }
+
+        for (j = 0; j < SNAP_FANOUT; ++j) {
+            unsigned int to = child(store, snap->nodes[i], j);
+
+            if (base == NULL || child(store, base->nodes[i], j) != to) {
+                write_ram(machine, (i * SNAP_FANOUT + j) * SNAP_PAGE_SIZE,
+                          store->pages[to].data, SNAP_PAGE_SIZE);
+            }
+        }
+    }
+
+    set_regs(machine, &snap->regs);
+}
+
+struct snapshot_t *snapshot_fork(struct snapstore_t *store, const struct snapshot_t *snap)
+{
+    struct snapshot_t *fork;
+    int i;
+
+    fork = malloc(sizeof(*fork));
+    if (fork == NULL) {
+        return NULL;
+    }
+
+    memcpy(fork, snap, sizeof(*fork));
+    for (i = 0; i < SNAP_NODES; ++i) {
+        ++store->pages[fork->nodes[i]].refs;
+    }
+    ++store->snapshots;
+
+    return fork;
+}
+
+void snapshot_release(struct snapstore_t *store, struct snapshot_t *snap)
+{
+    int i;
+
+    for (i = 0; i < SNAP_NODES; ++i) {
+        unref(store, snap->nodes[i]);
+    }
+    --store->snapshots;
+
+    free(snap);
+}
+
+size_t snapstore_pages(const struct snapstore_t *store)
+{
+    return store->live;
+}
+
+size_t snapstore_bytes(const struct snapstore_t *store)
+{
+    return (size_t)store->capacity * sizeof(struct page_t) +
+           (store->bucket_mask + 1) * sizeof(*store->buckets) +
+           store->snapshots * sizeof(struct snapshot_t);
+}
@@ -0,0 +1,50 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "8080e.h"
+
+#include <stddef.h>
+
+/*
+ * Copy on write snapshot store. RAM is split into SNAP_PAGE_SIZE pages
+ * which are grouped SNAP_FANOUT at a time under node pages holding their
+ * ids. Both kinds are hash-consed and refcounted, so a snapshot is only
+ * its registers plus SNAP_NODES node ids, and snapshots that share most
+ * of their RAM share the pages and most of the nodes too.
+ *
+ * Passing the snapshot the machine was last taken from or restored to
+ * as base lets take and restore skip the pages that didn't change.
+ */
+#define SNAP_PAGE_SIZE (64)
+#define SNAP_FANOUT (SNAP_PAGE_SIZE / 4)
+#define SNAP_NODES (RAM_SIZE / SNAP_PAGE_SIZE / SNAP_FANOUT)
+
+struct snapshot_t {
+    struct cpu_regs_t regs;
+    unsigned int nodes[SNAP_NODES];
+};
+
+struct snapstore_t;
+
+struct snapstore_t *snapstore_create(void);
+
+void snapstore_free(struct snapstore_t *store);
+
+/* Returns NULL when out of memory */
+struct snapshot_t *snapshot_take(struct snapstore_t *store, struct cpu_mem_t *machine,
+                                 const struct snapshot_t *base);
+
+void snapshot_restore(struct snapstore_t *store, const struct snapshot_t *snap,
+                      struct cpu_mem_t *machine, const struct snapshot_t *base);
+
+/* A second reference to the same state, to be released on its own */
+struct snapshot_t *snapshot_fork(struct snapstore_t *store, const struct snapshot_t *snap);
+
+void snapshot_release(struct snapstore_t *store, struct snapshot_t *snap);
+
+/* Distinct pages and nodes held, and the memory used by them and the snapshots */
+size_t snapstore_pages(const struct snapstore_t *store);
+
+size_t snapstore_bytes(const struct snapstore_t *store);
+
+#endif
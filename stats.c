@@ -0,0 +1,138 @@
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct class_stats_t {
+    const char *name;
+    unsigned long long count;
+    unsigned long long cycles;
+    unsigned long long taken;
+    unsigned long long not_taken;
+};
+
+static int by_cycles(const void *a, const void *b)
+{
+    const struct class_stats_t *x = a;
+    const struct class_stats_t *y = b;
+
+    if (x->cycles != y->cycles) {
+        return (x->cycles < y->cycles) ? 1 : -1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+static int collect_classes(const struct op_stats_t *stats, struct class_stats_t *classes)
+{
+    int i, j, n = 0;
+
+    for (i = 0; i < 256; ++i) {
+        if (stats->count[i] == 0) {
+            continue;
+        }
+
+        for (j = 0; j < n; ++j) {
+            if (strcmp(classes[j].name, stats->name[i]) == 0) {
+                break;
+            }
+        }
+
+        if (j == n) {
+            memset(&classes[n], 0, sizeof(classes[n]));
+            classes[n].name = stats->name[i];
+            ++n;
+        }
+
+        classes[j].count += stats->count[i];
+        classes[j].cycles += stats->cycles[i];
+        classes[j].taken += stats->taken[i];
+        classes[j].not_taken += stats->not_taken[i];
+    }
+
+    qsort(classes, n, sizeof(classes[0]), by_cycles);
+
+    return n;
+}
+
+static void write_csv(FILE *out, const struct op_stats_t *stats,
+                      const struct class_stats_t *classes, int n)
+{
+    int i;
+
+    fprintf(out, "kind,key,count,cycles,taken,not_taken\n");
+
+    for (i = 0; i < 256; ++i) {
+        if (stats->count[i] == 0) {
+            continue;
+        }
+        fprintf(out, "opcode,0x%02x,%llu,%llu,%llu,%llu\n", i,
+                stats->count[i], stats->cycles[i], stats->taken[i], stats->not_taken[i]);
+    }
+
+    for (i = 0; i < n; ++i) {
+        fprintf(out, "class,%s,%llu,%llu,%llu,%llu\n", classes[i].name,
+                classes[i].count, classes[i].cycles, classes[i].taken, classes[i].not_taken);
+    }
+}
+
+static void write_json(FILE *out, const struct op_stats_t *stats,
+                       const struct class_stats_t *classes, int n)
+{
+    unsigned long long count = 0, cycles = 0;
+    const char *sep = "";
+    int i;
+
+    for (i = 0; i < 256; ++i) {
+        count += stats->count[i];
+        cycles += stats->cycles[i];
+    }
+
+    fprintf(out, "{\n  \"instructions\": %llu,\n  \"cycles\": %llu,\n  \"opcodes\": [", count, cycles);
+
+    for (i = 0; i < 256; ++i) {
+        if (stats->count[i] == 0) {
+            continue;
+        }
+        fprintf(out, "%s\n    {\"opcode\": %d, \"class\": \"%s\", \"count\": %llu, \"cycles\": %llu, \"taken\": %llu, \"not_taken\": %llu}",
+                sep, i, stats->name[i], stats->count[i], stats->cycles[i], stats->taken[i], stats->not_taken[i]);
+        sep = ",";
+    }
+
+    fprintf(out, "\n  ],\n  \"classes\": [");
+    sep = "";
+
+    for (i = 0; i < n; ++i) {
+        fprintf(out, "%s\n    {\"class\": \"%s\", \"count\": %llu, \"cycles\": %llu, \"taken\": %llu, \"not_taken\": %llu}",
+                sep, classes[i].name, classes[i].count, classes[i].cycles, classes[i].taken, classes[i].not_taken);
+        sep = ",";
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+}
+
+int write_stats(const struct op_stats_t *stats, const char *path)
+{
+    struct class_stats_t classes[256];
+    size_t len = strlen(path);
+    FILE *out;
+    int n;
+
+    out = fopen(path, "w");
+    if (out == NULL) {
+        perror("fopen() failed");
+        return -1;
+    }
+
+    n = collect_classes(stats, classes);
+
+    if (len > 5 && strcmp(path + len - 5, ".json") == 0) {
+        write_json(out, stats, classes, n);
+    } else {
+        write_csv(out, stats, classes, n);
+    }
+
+    fclose(out);
+
+    return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef STATS_H
+#define STATS_H
+
+/*
+ * Per-opcode execution statistics, only collected when the core is
+ * built with ENABLE_STATS (make STATS=1). The class of an opcode is the
+ * mnemonic the decoder dispatched it as, so e.g. all 64 MOV encodings
+ * are folded together in the per-class view.
+ */
+struct op_stats_t {
+    unsigned long long count[256];
+    unsigned long long cycles[256];
+    unsigned long long taken[256];
+    unsigned long long not_taken[256];
+    const char *name[256];
+};
+
+/* Writes JSON if path ends in ".json", CSV otherwise. */
+int write_stats(const struct op_stats_t *stats, const char *path);
+
+#endif
@@ -0,0 +1,375 @@
+#include "trace.h"
+#include "bytes.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct trace_t {
+    unsigned char *blocks;
+    unsigned char *index;
+    int nblocks;
+    int cur;
+    int wrapped;
+    unsigned char *p;
+    unsigned char *end;
+    unsigned long long seq;
+    struct cpu_regs_t last;
+    const char *dump_path;
+    struct trace_t *next;
+};
+
+void (*abort_hook)(void);
+
+static struct trace_t *dump_list;
+
+static unsigned char *put8(unsigned char *p, unsigned char v)
+{
+    *p++ = v;
+    return p;
+}
+
+static unsigned char *put_regs(unsigned char *p, unsigned short mask, const struct cpu_regs_t *regs)
+{
+    if (mask & TR_PC) p = put16(p, regs->pc);
+    if (mask & TR_SP) p = put16(p, regs->sp);
+    if (mask & TR_A) p = put8(p, regs->a);
+    if (mask & TR_F) p = put8(p, regs->f);
+    if (mask & TR_BC) p = put16(p, regs->bc);
+    if (mask & TR_DE) p = put16(p, regs->de);
+    if (mask & TR_HL) p = put16(p, regs->hl);
+    if (mask & TR_INTR) p = put8(p, regs->intr);
+    if (mask & TR_PENDING) p = put8(p, regs->pending_intr);
+    if (mask & TR_SHIFT) p = put16(p, regs->shift_reg);
+    if (mask & TR_SHIFT_OFF) p = put8(p, regs->shift_reg_offset);
+
+    return p;
+}
+
+int trace_regs_size(unsigned short mask)
+{
+    static const unsigned char sizes[] = { 2, 2, 1, 1, 2, 2, 2, 1, 1, 2, 1 };
+    int size = 0, i;
+
+    for (i = 0; i < (int)sizeof(sizes); ++i) {
+        if (mask & (1 << i)) {
+            size += sizes[i];
+        }
+    }
+
+    return size;
+}
+
+const unsigned char *trace_get_regs(const unsigned char *p, unsigned short mask, struct cpu_regs_t *regs)
+{
+    if (mask & TR_PC) { regs->pc = get16(p); p += 2; }
+    if (mask & TR_SP) { regs->sp = get16(p); p += 2; }
+    if (mask & TR_A) { regs->a = *p++; }
+    if (mask & TR_F) { regs->f = *p++; }
+    if (mask & TR_BC) { regs->bc = get16(p); p += 2; }
+    if (mask & TR_DE) { regs->de = get16(p); p += 2; }
+    if (mask & TR_HL) { regs->hl = get16(p); p += 2; }
+    if (mask & TR_INTR) { regs->intr = *p++; }
+    if (mask & TR_PENDING) { regs->pending_intr = *p++; }
+    if (mask & TR_SHIFT) { regs->shift_reg = get16(p); p += 2; }
+    if (mask & TR_SHIFT_OFF) { regs->shift_reg_offset = *p++; }
+
+    return p;
+}
+
+static unsigned short diff_regs(const struct cpu_regs_t *a, const struct cpu_regs_t *b)
+{
+    unsigned short mask = 0;
+
+    if (a->pc != b->pc) mask |= TR_PC;
+    if (a->sp != b->sp) mask |= TR_SP;
+    if (a->a != b->a) mask |= TR_A;
+    if (a->f != b->f) mask |= TR_F;
+    if (a->bc != b->bc) mask |= TR_BC;
+    if (a->de != b->de) mask |= TR_DE;
+    if (a->hl != b->hl) mask |= TR_HL;
+    if (a->intr != b->intr) mask |= TR_INTR;
+    if (a->pending_intr != b->pending_intr) mask |= TR_PENDING;
+    if (a->shift_reg != b->shift_reg) mask |= TR_SHIFT;
+    if (a->shift_reg_offset != b->shift_reg_offset) mask |= TR_SHIFT_OFF;
+
+    return mask;
+}
+
+static unsigned char *block_at(struct trace_t *trace, int i)
+{
+    return trace->blocks + (size_t)i * TRACE_BLOCK_SIZE;
+}
+
+static void close_block(struct trace_t *trace)
+{
+    unsigned char *block = block_at(trace, trace->cur);
+    unsigned short used = trace->p - block;
+
+    put16(block + TRACE_BLOCK_HEADER_SIZE - 2, used);
+}
+
+static void open_block(struct trace_t *trace, const struct cpu_regs_t *regs, unsigned long long cycle)
+{
+    unsigned char *p;
+
+    if (trace->p != NULL) {
+        close_block(trace);
+
+        if (++trace->cur == trace->nblocks) {
+            trace->cur = 0;
+            trace->wrapped = 1;
+        }
+    }
+
+    p = block_at(trace, trace->cur);
+    p = put64(p, trace->seq);
+    p = put64(p, cycle);
+    p = put_regs(p, 0x07FF, regs);
+    p = put8(p, 0);
+    p = put16(p, 0);
+
+    trace->p = p;
+    trace->end = block_at(trace, trace->cur) + TRACE_BLOCK_SIZE;
+    trace->last = *regs;
+}
+
+static void crash_handler(int sig)
+{
+    trace_dump_all();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+struct trace_t *trace_create(int size_kb, const char *dump_path)
+{
+    static int handlers_installed;
+    struct trace_t *trace;
+
+    trace = calloc(1, sizeof(*trace));
+    if (trace == NULL) {
+        return NULL;
+    }
+
+    trace->nblocks = size_kb * 1024 / TRACE_BLOCK_SIZE;
+    if (trace->nblocks < 2) {
+        trace->nblocks = 2;
+    }
+
+    trace->blocks = malloc((size_t)trace->nblocks * TRACE_BLOCK_SIZE);
+    trace->index = malloc((size_t)trace->nblocks * TRACE_INDEX_SIZE);
+    if (trace->blocks == NULL || trace->index == NULL) {
+        trace_free(trace);
+        return NULL;
+    }
+
+    if (dump_path != NULL) {
+        trace->dump_path = dump_path;
+        trace->next = dump_list;
+        dump_list = trace;
+
+        if (!handlers_installed) {
+            signal(SIGSEGV, crash_handler);
+            signal(SIGBUS, crash_handler);
+            signal(SIGILL, crash_handler);
+            signal(SIGFPE, crash_handler);
+            abort_hook = trace_dump_all;
+            handlers_installed = 1;
+        }
+    }
+
+    return trace;
+}
+
+void trace_free(struct trace_t *trace)
+{
+    struct trace_t **p;
+
+    for (p = &dump_list; *p != NULL; p = &(*p)->next) {
+        if (*p == trace) {
+            *p = trace->next;
+            break;
+        }
+    }
+
+    free(trace->blocks);
+    free(trace->index);
+    free(trace);
+}
+
+void trace_record(struct trace_t *trace, const struct cpu_regs_t *before,
+                  const unsigned char *code, int cycles,
+                  const struct cpu_regs_t *after, unsigned long long cycle)
+{
+    unsigned short mask;
+    int len;
+
+    if (trace->p == NULL || trace->end - trace->p < 2 * TRACE_MAX_RECORD_SIZE) {
+        open_block(trace, before, cycle - cycles);
+    }
+
+    mask = diff_regs(&trace->last, before);
+    if (mask != 0) {
+        trace->p = put16(trace->p, mask | TR_SYNC);
+        trace->p = put_regs(trace->p, mask, before);
+    }
+
+    len = trace_ins_length(code[0]);
+
+    // pc is stored whenever it didn't just advance, even if it stayed put
+    mask = diff_regs(before, after) & ~TR_PC;
+    if (after->pc != (unsigned short)(before->pc + len)) {
+        mask |= TR_PC;
+    }
+
+    trace->p = put16(trace->p, mask);
+    memcpy(trace->p, code, len);
+    trace->p += len;
+    trace->p = put8(trace->p, cycles);
+    trace->p = put_regs(trace->p, mask, after);
+
+    trace->last = *after;
+    ++trace->seq;
+}
+
+static int write_all(int fd, const unsigned char *p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Only uses open()/write() as it also runs from the crash handler. */
+int trace_write(struct trace_t *trace, const char *path)
+{
+    unsigned char header[TRACE_FILE_HEADER_SIZE];
+    unsigned char *p;
+    unsigned long long offset;
+    int first, count, i, fd, res = 0;
+
+    if (trace->p == NULL) {
+        return 0;
+    }
+
+    close_block(trace);
+
+    first = trace->wrapped ? (trace->cur + 1) % trace->nblocks : 0;
+    count = trace->wrapped ? trace->nblocks : trace->cur + 1;
+
+    memcpy(header, TRACE_MAGIC, 4);
+    p = put16(header + 4, TRACE_VERSION);
+    p = put16(p, TRACE_BLOCK_SIZE);
+    p = put16(p, count);
+    p = put16(p, 0);
+
+    offset = TRACE_FILE_HEADER_SIZE + (unsigned long long)count * TRACE_INDEX_SIZE;
+    p = trace->index;
+    for (i = 0; i < count; ++i) {
+        unsigned char *block = block_at(trace, (first + i) % trace->nblocks);
+
+        // seq and cycle of the first record, straight from the block header
+        memcpy(p, block, 16);
+        p = put64(p + 16, offset);
+        offset += TRACE_BLOCK_SIZE;
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (write_all(fd, header, sizeof(header)) != 0 ||
+        write_all(fd, trace->index, (size_t)count * TRACE_INDEX_SIZE) != 0) {
+        res = -1;
+    }
+
+    for (i = 0; res == 0 && i < count; ++i) {
+        if (write_all(fd, block_at(trace, (first + i) % trace->nblocks), TRACE_BLOCK_SIZE) != 0) {
+            res = -1;
+        }
+    }
+
+    close(fd);
+
+    return res;
+}
+
+void trace_dump_all(void)
+{
+    struct trace_t *trace;
+
+    for (trace = dump_list; trace != NULL; trace = trace->next) {
+        trace_write(trace, trace->dump_path);
+    }
+}
+
+int trace_ins_length(unsigned char op)
+{
+    if ((op & 0xCF) == 0x01 ||      // LXI
+        (op & 0xE7) == 0x22 ||      // SHLD LHLD STA LDA
+        (op & 0xC7) == 0xC2 ||      // Jcc
+        (op & 0xC7) == 0xC4 ||      // Ccc
+        op == 0xC3 || op == 0xCB || // JMP
+        (op & 0xCF) == 0xCD) {      // CALL
+        return 3;
+    }
+
+    if ((op & 0xC7) == 0x06 ||      // MVI
+        (op & 0xC7) == 0xC6 ||      // immediate ALU
+        op == 0xD3 || op == 0xDB) { // OUT IN
+        return 2;
+    }
+
+    return 1;
+}
+
+/* The names TRACE_INS prints in execute_one(). */
+const char *trace_mnemonic(unsigned char op)
+{
+    static const char *misc[256] = {
+        [0x00] = "NOP", [0x02] = "STAX", [0x07] = "RLC", [0x0A] = "LDAX",
+        [0x0F] = "RRC", [0x12] = "STAX", [0x1A] = "LDAX", [0x1F] = "RAR",
+        [0x22] = "SHLD", [0x27] = "DAA", [0x2A] = "LHLD", [0x2F] = "CMA",
+        [0x32] = "STA", [0x37] = "STC", [0x3A] = "LDA", [0xC1] = "POP",
+        [0xC3] = "JMP", [0xC5] = "PUSH", [0xC6] = "ADI", [0xC9] = "RET",
+        [0xCD] = "CAL", [0xD1] = "POP", [0xD3] = "OUT", [0xD5] = "PUSH",
+        [0xD6] = "SUI", [0xDB] = "IN", [0xDE] = "SBI", [0xE1] = "POP",
+        [0xE3] = "XTHL", [0xE5] = "PUSH", [0xE6] = "ANI", [0xE9] = "PCHL",
+        [0xEB] = "XCHG", [0xF1] = "POPPSW", [0xF5] = "PUSHPSW", [0xF6] = "ORI",
+        [0xFB] = "EI", [0xFE] = "CPI",
+    };
+    static const char *alu[8] = { "ADD", "ADC", "SUB", "SBB", "ANA", "XRA", "ORA", "CMP" };
+
+    if (op == 0x76) {
+        return "HLT";
+    }
+    if ((op & 0xC0) == 0x40) {
+        return "MOV";
+    }
+    if ((op & 0xC0) == 0x80) {
+        return alu[(op >> 3) & 0x07];
+    }
+    if ((op & 0xCF) == 0x01) return "LXI";
+    if ((op & 0xCF) == 0x03) return "INX";
+    if ((op & 0xCF) == 0x0B) return "DCX";
+    if ((op & 0xCF) == 0x09) return "DAD";
+    if ((op & 0xC7) == 0x04) return "INR";
+    if ((op & 0xC7) == 0x05) return "DCR";
+    if ((op & 0xC7) == 0xC4) return "CX";
+    if ((op & 0xC7) == 0xC2) return "JX";
+    if ((op & 0xC7) == 0x06) return "MVI";
+    if ((op & 0xC7) == 0xC0) return "RX";
+
+    return misc[op] != NULL ? misc[op] : "???";
+}
@@ -0,0 +1,72 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "8080e.h"
+
+/*
+ * Binary execution trace.
+ *
+ * The trace lives in a per-machine ring of fixed size blocks. Every block
+ * starts with a header holding the full register file, so a reader can
+ * start decoding at any block. Records only carry what changed:
+ *
+ *   u16 mask
+ *   u8  opcode, operand bytes, u8 cycles     unless TR_SYNC is set
+ *   new values of every register in mask, in bit order
+ *
+ * The address of an instruction is the pc left behind by the previous
+ * record, so pc is only stored when it did not simply advance past the
+ * operands. Changes made between instructions (interrupts) are stored as
+ * TR_SYNC records without an instruction.
+ *
+ * A dump is a file header, an index with one entry per block and then
+ * the blocks, oldest first. All values are little endian.
+ */
+#define TRACE_MAGIC "I8TR"
+#define TRACE_VERSION (1)
+#define TRACE_BLOCK_SIZE (4096)
+#define TRACE_FILE_HEADER_SIZE (12)
+#define TRACE_INDEX_SIZE (24)
+#define TRACE_BLOCK_HEADER_SIZE (36)
+#define TRACE_DEFAULT_KB (1024)
+/* Mask, opcode and operands, cycles and every register */
+#define TRACE_MAX_RECORD_SIZE (2 + 1 + 2 + 1 + 17)
+
+#define TR_PC       (0x0001)
+#define TR_SP       (0x0002)
+#define TR_A        (0x0004)
+#define TR_F        (0x0008)
+#define TR_BC       (0x0010)
+#define TR_DE       (0x0020)
+#define TR_HL       (0x0040)
+#define TR_INTR     (0x0080)
+#define TR_PENDING  (0x0100)
+#define TR_SHIFT    (0x0200)
+#define TR_SHIFT_OFF (0x0400)
+#define TR_SYNC     (0x8000)
+
+struct trace_t;
+
+struct trace_t *trace_create(int size_kb, const char *dump_path);
+
+void trace_free(struct trace_t *trace);
+
+void trace_record(struct trace_t *trace, const struct cpu_regs_t *before,
+                  const unsigned char *code, int cycles,
+                  const struct cpu_regs_t *after, unsigned long long cycle);
+
+int trace_write(struct trace_t *trace, const char *path);
+
+/* Writes every trace that was created with a dump path. */
+void trace_dump_all(void);
+
+int trace_ins_length(unsigned char op);
+
+const char *trace_mnemonic(unsigned char op);
+
+/* Bytes the registers in mask take in a record */
+int trace_regs_size(unsigned short mask);
+
+const unsigned char *trace_get_regs(const unsigned char *p, unsigned short mask, struct cpu_regs_t *regs);
+
+#endif
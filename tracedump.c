@@ -0,0 +1,219 @@
+#include "trace.h"
+#include "bytes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Offline decoder for the binary traces written by enable_trace(). Prints
+ * the same columns as the TRACE_INS/TRACE_STATE macros in 8080e.c.
+ */
+
+#define BYTETOBINARYPATTERN "%d%d%d%d%d%d%d%d"
+#define BYTETOBINARY(byte)  \
+  (byte & 0x80 ? 1 : 0), \
+  (byte & 0x40 ? 1 : 0), \
+  (byte & 0x20 ? 1 : 0), \
+  (byte & 0x10 ? 1 : 0), \
+  (byte & 0x08 ? 1 : 0), \
+  (byte & 0x04 ? 1 : 0), \
+  (byte & 0x02 ? 1 : 0), \
+  (byte & 0x01 ? 1 : 0)
+
+static void usage()
+{
+    printf("Usage: tracedump [-s FIRST INSTRUCTION] [-n COUNT] <TRACE FILE>\n");
+}
+
+static void print_header()
+{
+    printf("\t\t\t\tpc\tsp\ta\tb\tc\td\te\tSZ0A0P1C\th\tl\tINTR\tSHIFT\tSHIFT OFF\n");
+}
+
+static void print_state(const struct cpu_regs_t *r)
+{
+    printf("\t\t\t\t0x%04x\t0x%04x\t0x%02x\t0x%02x\t0x%02x\t0x%02x\t0x%02x\t"BYTETOBINARYPATTERN"\t0x%02x\t0x%02x\t%d\t0x%04x\t0x%02x\n",
+           r->pc, r->sp, r->a, r->bc >> 8, r->bc & 0xFF, r->de >> 8, r->de & 0xFF, BYTETOBINARY(r->f),
+           r->hl >> 8, r->hl & 0xFF, r->intr, r->shift_reg, r->shift_reg_offset);
+}
+
+/*
+ * Whether the record at p ends by end. Only worth asking near the end:
+ * a block torn by a crash can stop in the middle of a record.
+ */
+static int record_fits(const unsigned char *p, const unsigned char *end)
+{
+    unsigned short mask;
+    long size = 2;
+
+    if (end - p < 2) {
+        return 0;
+    }
+    mask = get16(p);
+    if (!(mask & TR_SYNC)) {
+        if (end - p < 3) {
+            return 0;
+        }
+        size += trace_ins_length(p[2]) + 1;
+    }
+
+    return end - p >= size + trace_regs_size(mask);
+}
+
+/* Returns the number of instructions printed. */
+static long long decode_block(const unsigned char *block, unsigned long long from, long long limit)
+{
+    const unsigned char *p = block;
+    const unsigned char *end;
+    unsigned long long seq, cycle;
+    struct cpu_regs_t regs;
+    long long printed = 0;
+    int header = 0;
+
+    seq = get64(p);
+    cycle = get64(p + 8);
+    memset(&regs, 0, sizeof(regs));
+    trace_get_regs(p + 16, 0x07FF, &regs);
+    end = block + get16(block + TRACE_BLOCK_HEADER_SIZE - 2);
+    p = block + TRACE_BLOCK_HEADER_SIZE;
+
+    while (p < end && printed < limit) {
+        unsigned short mask;
+        unsigned short pc = regs.pc;
+        const unsigned char *code;
+        int len, cycles;
+
+        if (end - p < TRACE_MAX_RECORD_SIZE && !record_fits(p, end)) {
+            break;
+        }
+        mask = get16(p);
+        p += 2;
+
+        if (mask & TR_SYNC) {
+            p = trace_get_regs(p, mask, &regs);
+            if (seq >= from) {
+                printf("%llu:\t0x%04x\t%4s\n", seq, pc, "INT");
+                print_state(&regs);
+            }
+            continue;
+        }
+
+        code = p;
+        len = trace_ins_length(code[0]);
+        p += len;
+        cycles = *p++;
+        p = trace_get_regs(p, mask, &regs);
+        if (!(mask & TR_PC)) {
+            regs.pc = pc + len;
+        }
+        cycle += cycles;
+
+        if (seq >= from) {
+            if (!header) {
+                print_header();
+                header = 1;
+            }
+
+            printf("%llu:\t0x%04x\t%4s\t", seq + 1, pc, trace_mnemonic(code[0]));
+            if (len == 2) {
+                printf("0x%02x\t", code[1]);
+            } else if (len == 3) {
+                printf("0x%04x\t", code[1] | (code[2] << 8));
+            }
+            printf("cycle: %d/%llu\n", cycles, cycle);
+            print_state(&regs);
+            ++printed;
+        }
+
+        ++seq;
+    }
+
+    return printed;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned char header[TRACE_FILE_HEADER_SIZE];
+    unsigned char *index, *block;
+    unsigned long long from = 0;
+    long long limit = -1;
+    int count, first, used, i, opt;
+    FILE *in;
+
+    while ((opt = getopt(argc, argv, "s:n:")) != -1) {
+        switch (opt) {
+            case 's':
+                from = strtoull(optarg, NULL, 0);
+                break;
+            case 'n':
+                limit = strtoll(optarg, NULL, 0);
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage();
+        return 1;
+    }
+
+    if (limit < 0) {
+        limit = 0x7FFFFFFFFFFFFFFFLL;
+    }
+
+    in = fopen(argv[optind], "rb");
+    if (in == NULL) {
+        perror("fopen() failed");
+        return 1;
+    }
+
+    if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+        memcmp(header, TRACE_MAGIC, 4) != 0 ||
+        get16(header + 4) != TRACE_VERSION ||
+        get16(header + 6) != TRACE_BLOCK_SIZE) {
+        printf("not a trace file\n");
+        return 1;
+    }
+
+    count = get16(header + 8);
+    index = malloc((size_t)count * TRACE_INDEX_SIZE);
+    block = malloc(TRACE_BLOCK_SIZE);
+    if (index == NULL || block == NULL ||
+        fread(index, TRACE_INDEX_SIZE, count, in) != (size_t)count) {
+        printf("truncated trace file\n");
+        return 1;
+    }
+
+    // Seek to the last block starting at or before the first wanted instruction
+    first = 0;
+    for (i = 0; i < count; ++i) {
+        if (get64(index + i * TRACE_INDEX_SIZE) <= from) {
+            first = i;
+        }
+    }
+
+    for (i = first; i < count && limit > 0; ++i) {
+        if (fseek(in, get64(index + i * TRACE_INDEX_SIZE + 16), SEEK_SET) != 0 ||
+            fread(block, 1, TRACE_BLOCK_SIZE, in) != TRACE_BLOCK_SIZE) {
+            printf("truncated trace file\n");
+            return 1;
+        }
+        used = get16(block + TRACE_BLOCK_HEADER_SIZE - 2);
+        if (used < TRACE_BLOCK_HEADER_SIZE || used > TRACE_BLOCK_SIZE) {
+            printf("corrupted block %d\n", i);
+            return 1;
+        }
+
+        limit -= decode_block(block, from, limit);
+    }
+
+    free(block);
+    free(index);
+    fclose(in);
+
+    return 0;
+}
@@ -1,10 +1,16 @@
 #include <stdio.h>
 #include <unistd.h>
 
+/* Called by ABORT before exiting, e.g. to dump the execution trace */
+extern void (*abort_hook)(void);
+
 #define ABORT(msg)                  \
     do {                            \
         printf msg;                 \
         fflush(stdout);             \
+        if (abort_hook != NULL) {   \
+            abort_hook();           \
+        }                           \
         _exit(1);                   \
     } while (0)
 
@@ -0,0 +1,337 @@
+#include "video.h"
+#include "bytes.h"
+#include "frame.h"
+#include "xrle.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct video_writer_t {
+    FILE *out;
+    int interval;
+    int frames;
+    unsigned long long offset;
+    // File offset of every keyframe
+    unsigned long long *keys;
+    int nkeys;
+    int key_capacity;
+    int failed;
+    unsigned char prev[DISPLAY_SIZE];
+    unsigned char record[2 + XRLE_BOUND(DISPLAY_SIZE)];
+};
+
+struct video_t {
+    const unsigned char *data;
+    size_t size;
+    unsigned long long rom_hash;
+    int interval;
+    int frames;
+    unsigned long long *keys;
+    int nkeys;
+    // The frame in buf, -1 for none, and where the record after it is
+    int current;
+    size_t offset;
+    // What video_read() returns next
+    int next;
+    unsigned char buf[DISPLAY_SIZE];
+};
+
+static const unsigned char black[DISPLAY_SIZE];
+
+struct video_writer_t *video_create(const char *path, int keyframe_interval, unsigned long long rom_hash)
+{
+    unsigned char header[VIDEO_HEADER_SIZE];
+    struct video_writer_t *writer;
+
+    if (keyframe_interval < 1) {
+        return NULL;
+    }
+
+    writer = calloc(1, sizeof(*writer));
+    if (writer == NULL) {
+        return NULL;
+    }
+    writer->interval = keyframe_interval;
+
+    writer->out = fopen(path, "wb");
+    if (writer->out == NULL) {
+        perror("fopen() failed");
+        free(writer);
+        return NULL;
+    }
+
+    memcpy(header, VIDEO_MAGIC, 4);
+    put32(put64(put16(put16(header + 4, VIDEO_VERSION), 0), rom_hash), keyframe_interval);
+    if (fwrite(header, 1, sizeof(header), writer->out) != sizeof(header)) {
+        fclose(writer->out);
+        free(writer);
+        return NULL;
+    }
+    writer->offset = sizeof(header);
+
+    return writer;
+}
+
+int video_write(struct video_writer_t *writer, const unsigned char *vram)
+{
+    const unsigned char *base = writer->prev;
+    size_t size;
+
+    if (writer->frames % writer->interval == 0) {
+        if (writer->nkeys == writer->key_capacity) {
+            int capacity = writer->key_capacity ? writer->key_capacity * 2 : 1024;
+            unsigned long long *keys = realloc(writer->keys, capacity * sizeof(*keys));
+
+            if (keys == NULL) {
+                writer->failed = 1;
+                return -1;
+            }
+            writer->keys = keys;
+            writer->key_capacity = capacity;
+        }
+        writer->keys[writer->nkeys++] = writer->offset;
+        base = black;
+    }
+
+    size = xrle_encode(base, vram, DISPLAY_SIZE, writer->record + 2);
+    put16(writer->record, size);
+    if (fwrite(writer->record, 1, size + 2, writer->out) != size + 2) {
+        writer->failed = 1;
+        return -1;
+    }
+
+    memcpy(writer->prev, vram, DISPLAY_SIZE);
+    writer->offset += size + 2;
+    ++writer->frames;
+
+    return 0;
+}
+
+int video_close(struct video_writer_t *writer)
+{
+    unsigned char entry[8], trailer[VIDEO_TRAILER_SIZE];
+    int res = writer->failed ? -1 : 0, i;
+
+    for (i = 0; i < writer->nkeys && res == 0; ++i) {
+        put64(entry, writer->keys[i]);
+        if (fwrite(entry, 1, sizeof(entry), writer->out) != sizeof(entry)) {
+            res = -1;
+        }
+    }
+
+    put32(put32(trailer, writer->frames), writer->nkeys);
+    memcpy(trailer + 8, VIDEO_INDEX_MAGIC, 4);
+    if (res == 0 && fwrite(trailer, 1, sizeof(trailer), writer->out) != sizeof(trailer)) {
+        res = -1;
+    }
+    if (fclose(writer->out) != 0) {
+        res = -1;
+    }
+
+    free(writer->keys);
+    free(writer);
+
+    return res;
+}
+
+/* Uses the index at the end of the file, 0 if there is a valid one */
+static int read_index(struct video_t *video)
+{
+    const unsigned char *trailer;
+    unsigned long long nkeys;
+    int i;
+
+    if (video->size < VIDEO_HEADER_SIZE + VIDEO_TRAILER_SIZE) {
+        return -1;
+    }
+    trailer = video->data + video->size - VIDEO_TRAILER_SIZE;
+    if (memcmp(trailer + 8, VIDEO_INDEX_MAGIC, 4) != 0) {
+        return -1;
+    }
+
+    video->frames = get32(trailer);
+    nkeys = get32(trailer + 4);
+    if (nkeys != (video->frames + (unsigned long long)video->interval - 1) / video->interval ||
+        nkeys * 8 > video->size - VIDEO_HEADER_SIZE - VIDEO_TRAILER_SIZE) {
+        return -1;
+    }
+
+    video->keys = malloc((nkeys + 1) * sizeof(*video->keys));
+    if (video->keys == NULL) {
+        return -1;
+    }
+    for (i = 0; i < nkeys; ++i) {
+        video->keys[i] = get64(trailer - nkeys * 8 + i * 8);
+        if (video->keys[i] < VIDEO_HEADER_SIZE || video->keys[i] >= video->size) {
+            free(video->keys);
+            video->keys = NULL;
+            return -1;
+        }
+    }
+    video->nkeys = nkeys;
+
+    return 0;
+}
+
+/* Walks the records for a file without an index, keeping the whole ones */
+static int scan_index(struct video_t *video)
+{
+    size_t offset = VIDEO_HEADER_SIZE;
+    int capacity = 0;
+
+    video->frames = 0;
+    while (offset + 2 <= video->size && offset + 2 + get16(video->data + offset) <= video->size) {
+        if (video->frames % video->interval == 0) {
+            if (video->nkeys == capacity) {
+                unsigned long long *keys;
+
+                capacity = capacity ? capacity * 2 : 1024;
+                keys = realloc(video->keys, capacity * sizeof(*keys));
+                if (keys == NULL) {
+                    return -1;
+                }
+                video->keys = keys;
+            }
+            video->keys[video->nkeys++] = offset;
+        }
+        offset += 2 + get16(video->data + offset);
+        ++video->frames;
+    }
+
+    return 0;
+}
+
+struct video_t *video_open(const char *path)
+{
+    struct video_t *video;
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open() failed");
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < VIDEO_HEADER_SIZE) {
+        printf("%s is not a recording\n", path);
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap() failed");
+        return NULL;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    video = calloc(1, sizeof(*video));
+    if (video == NULL) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    video->data = data;
+    video->size = st.st_size;
+    video->current = -1;
+
+    if (memcmp(video->data, VIDEO_MAGIC, 4) != 0 || get16(video->data + 4) != VIDEO_VERSION ||
+        (video->interval = get32(video->data + 16)) < 1) {
+        printf("%s is not a recording\n", path);
+        video_free(video);
+        return NULL;
+    }
+    video->rom_hash = get64(video->data + 8);
+
+    if (read_index(video) != 0) {
+        printf("%s has no index, scanning it\n", path);
+        if (scan_index(video) != 0) {
+            video_free(video);
+            return NULL;
+        }
+    }
+
+    return video;
+}
+
+void video_free(struct video_t *video)
+{
+    munmap((void *)video->data, video->size);
+    free(video->keys);
+    free(video);
+}
+
+int video_frames(const struct video_t *video)
+{
+    return video->frames;
+}
+
+int video_keyframe_interval(const struct video_t *video)
+{
+    return video->interval;
+}
+
+unsigned long long video_rom_hash(const struct video_t *video)
+{
+    return video->rom_hash;
+}
+
+int video_seek(struct video_t *video, int frame)
+{
+    if (frame < 0 || frame >= video->frames) {
+        return -1;
+    }
+
+    video->next = frame;
+    return 0;
+}
+
+/* Applies the record at video->offset on top of buf */
+static int apply_record(struct video_t *video)
+{
+    size_t size;
+
+    if (video->offset + 2 > video->size) {
+        return -1;
+    }
+    size = get16(video->data + video->offset);
+    if (video->offset + 2 + size > video->size ||
+        xrle_apply(video->buf, DISPLAY_SIZE, video->data + video->offset + 2, size) != 0) {
+        return -1;
+    }
+
+    video->offset += 2 + size;
+    ++video->current;
+
+    return 0;
+}
+
+int video_read(struct video_t *video, unsigned char *vram)
+{
+    int key = video->next - video->next % video->interval;
+
+    if (video->next >= video->frames) {
+        return -1;
+    }
+
+    // Same chain and not past it yet, otherwise start over from its keyframe
+    if (video->current < key || video->current >= video->next) {
+        memset(video->buf, 0, DISPLAY_SIZE);
+        video->current = key - 1;
+        video->offset = video->keys[key / video->interval];
+    }
+    while (video->current < video->next) {
+        if (apply_record(video) != 0) {
+            video->current = -1;
+            return -1;
+        }
+    }
+
+    memcpy(vram, video->buf, DISPLAY_SIZE);
+    return video->next++;
+}
@@ -0,0 +1,59 @@
+#ifndef VIDEO_H
+#define VIDEO_H
+
+/*
+ * Recording of the 1bpp VRAM stream, DISPLAY_SIZE bytes a frame. Every
+ * keyframe_interval frames there is a keyframe, the XOR+RLE delta (see
+ * xrle.h) against an all black screen; every other frame is the delta
+ * against the frame before it. Seeking decodes at most keyframe_interval
+ * frames.
+ *
+ * File layout, little endian:
+ *   "I8VV", u16 version, u16 flags, u64 ROM hash, u32 keyframe interval,
+ *   one record per frame: u16 size, delta
+ *   index: u64 file offset of every keyframe's record,
+ *   u32 frames, u32 keyframes, "I8VI"
+ *
+ * A repeated frame is an empty record. A file cut short, say by a crash,
+ * has no index; the reader rebuilds it from the records that are whole.
+ */
+#define VIDEO_MAGIC "I8VV"
+#define VIDEO_INDEX_MAGIC "I8VI"
+#define VIDEO_VERSION (1)
+#define VIDEO_HEADER_SIZE (20)
+#define VIDEO_TRAILER_SIZE (12)
+
+struct video_writer_t;
+struct video_t;
+
+/* Returns NULL if path can't be written */
+struct video_writer_t *video_create(const char *path, int keyframe_interval, unsigned long long rom_hash);
+
+int video_write(struct video_writer_t *writer, const unsigned char *vram);
+
+/* Writes the index and frees the writer, -1 if any write failed */
+int video_close(struct video_writer_t *writer);
+
+/* Maps the file, returns NULL if it is not a recording */
+struct video_t *video_open(const char *path);
+
+void video_free(struct video_t *video);
+
+int video_frames(const struct video_t *video);
+
+int video_keyframe_interval(const struct video_t *video);
+
+unsigned long long video_rom_hash(const struct video_t *video);
+
+/* The next video_read() returns frame, -1 if it is out of range */
+int video_seek(struct video_t *video, int frame);
+
+/*
+ * Decodes the next frame into vram, DISPLAY_SIZE bytes, and returns its
+ * number. Reading on from the frame before only applies one delta, after
+ * a seek it takes up to a keyframe interval of them. Returns -1 at the
+ * end or if the record is corrupted.
+ */
+int video_read(struct video_t *video, unsigned char *vram);
+
+#endif
@@ -0,0 +1,136 @@
+#include "xrle.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Zero runs shorter than this are cheaper to keep inside a literal */
+#define MIN_SKIP (3)
+
+static unsigned char *put_skip(unsigned char *p, size_t n)
+{
+    if (n <= 127) {
+        *p++ = n - 1;
+        return p;
+    }
+
+    *p++ = 0x7F;
+    n -= 128;
+    while (n >= 0x80) {
+        *p++ = (n & 0x7F) | 0x80;
+        n >>= 7;
+    }
+    *p++ = n;
+
+    return p;
+}
+
+static unsigned char *put_literal(unsigned char *p, const unsigned char *from,
+                                  const unsigned char *to, size_t n)
+{
+    while (n > 0) {
+        size_t chunk = n > 128 ? 128 : n;
+        size_t i;
+
+        *p++ = 0x80 | (chunk - 1);
+        for (i = 0; i < chunk; ++i) {
+            *p++ = from[i] ^ to[i];
+        }
+
+        from += chunk;
+        to += chunk;
+        n -= chunk;
+    }
+
+    return p;
+}
+
+size_t xrle_encode(const unsigned char *from, const unsigned char *to, size_t len, unsigned char *out)
+{
+    unsigned char *p = out;
+    size_t i = 0;
+
+    while (i < len) {
+        size_t start = i;
+
+        while (i < len && from[i] == to[i]) {
+            ++i;
+        }
+        if (i == len) {
+            break;
+        }
+        if (i > start) {
+            p = put_skip(p, i - start);
+        }
+
+        // Literal until a run of MIN_SKIP unchanged bytes or the end
+        start = i;
+        while (i < len) {
+            size_t same = 0;
+
+            while (i + same < len && same < MIN_SKIP && from[i + same] == to[i + same]) {
+                ++same;
+            }
+            if (same == MIN_SKIP || i + same == len) {
+                break;
+            }
+            i += same + 1;
+        }
+
+        p = put_literal(p, from + start, to + start, i - start);
+    }
+
+    return p - out;
+}
+
+int xrle_apply(unsigned char *buf, size_t len, const unsigned char *in, size_t in_len)
+{
+    const unsigned char *end = in + in_len;
+    size_t pos = 0;
+
+    while (in < end) {
+        unsigned char t = *in++;
+
+        if (t < 0x7F) {
+            pos += t + 1;
+        } else if (t == 0x7F) {
+            size_t n = 0;
+            int shift = 0;
+
+            do {
+                if (in == end) {
+                    return -1;
+                }
+                n |= (size_t)(*in & 0x7F) << shift;
+                shift += 7;
+            } while (*in++ & 0x80);
+
+            pos += 128 + n;
+        } else {
+            size_t n = (t & 0x7F) + 1;
+            size_t i = 0;
+
+            if (pos + n > len || (size_t)(end - in) < n) {
+                return -1;
+            }
+#ifdef __SSE2__
+            for (; i + 16 <= n; i += 16) {
+                __m128i *p = (__m128i *)(buf + pos + i);
+
+                _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), _mm_loadu_si128((const __m128i *)(in + i))));
+            }
+#endif
+            for (; i < n; ++i) {
+                buf[pos + i] ^= in[i];
+            }
+            in += n;
+            pos += n;
+        }
+
+        if (pos > len) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
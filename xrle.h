@@ -0,0 +1,24 @@
+#ifndef XRLE_H
+#define XRLE_H
+
+#include <stddef.h>
+
+/*
+ * XOR + run length delta between two equally sized buffers. The stream
+ * is a sequence of tokens:
+ *
+ *   0x00 - 0x7E  skip t + 1 unchanged bytes
+ *   0x7F         skip 128 + varint unchanged bytes
+ *   0x80 - 0xFF  (t & 0x7F) + 1 XOR bytes follow
+ *
+ * Trailing unchanged bytes are not encoded. Since the delta is an XOR,
+ * applying it to either buffer yields the other one.
+ */
+#define XRLE_BOUND(len) ((len) + (len) / 128 + 16)
+
+size_t xrle_encode(const unsigned char *from, const unsigned char *to, size_t len, unsigned char *out);
+
+/* XORs the delta into buf, returns -1 if the stream doesn't fit len */
+int xrle_apply(unsigned char *buf, size_t len, const unsigned char *in, size_t in_len);
+
+#endif